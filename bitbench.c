@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "bitkernels.h"
+
+/* a letter page at 600 dpi */
+#define BENCH_WIDTH		5100
+#define BENCH_ROWS		6600
+#define BENCH_PASSES	5
+
+static uint8 *pagea, *pageb, *dstrow;
+static uint64 *srcwords, *dstwords;
+static volatile uint32 sink;
+
+static void
+fill_page(uint8 *page, uint32 bytes, unsigned int seed)
+{
+	uint32 i;
+
+	/* mostly white with short black runs, roughly like scanned text */
+	srand(seed);
+	memset(page, 0, bytes);
+	for (i = 0; i < bytes; i++)
+		if (rand() % 8 == 0)
+			page[i] = (uint8)(0xff >> (rand() % 8)) & (uint8)(0xff << (rand() % 4));
+}
+
+static void
+bench_popcount(uint32 rowbytes)
+{
+	uint32 y;
+	for (y = 0; y < BENCH_ROWS; y++)
+		sink += bits->popcount(pagea + y * rowbytes, rowbytes);
+}
+
+static void
+bench_popcount_xor(uint32 rowbytes)
+{
+	uint32 y;
+	for (y = 0; y < BENCH_ROWS; y++)
+		sink += bits->popcount_xor(pagea + y * rowbytes, pageb + y * rowbytes, rowbytes);
+}
+
+static void
+bench_find_pixel(uint32 rowbytes)
+{
+	uint32 y, x;
+	int black;
+
+	/* walk every run on the row, as the margin and despeckle scans do */
+	for (y = 0; y < BENCH_ROWS; y++)
+		for (x = 0, black = 1; x < BENCH_WIDTH; black = !black)
+		{
+			x = bits->find_pixel(pagea + y * rowbytes, x, BENCH_WIDTH, black);
+			sink += x;
+		}
+}
+
+static void
+bench_shift_words(uint32 rowbytes)
+{
+	uint32 words = (rowbytes + 7) / 8;
+	uint32 y;
+
+	for (y = 0; y < BENCH_ROWS; y++)
+	{
+		bits->shift_words(dstwords, words + 2, srcwords, words, (long)(y % 97) - 48);
+		sink += (uint32)dstwords[words / 2];
+	}
+}
+
+static void
+bench_row_or(uint32 rowbytes)
+{
+	uint32 y;
+	for (y = 0; y < BENCH_ROWS; y++)
+		bits->row_or(dstrow, pagea + y * rowbytes, rowbytes);
+	sink += dstrow[0];
+}
+
+static void
+bench_row_and(uint32 rowbytes)
+{
+	uint32 y;
+	for (y = 0; y < BENCH_ROWS; y++)
+		bits->row_and(dstrow, pagea + y * rowbytes, rowbytes);
+	sink += dstrow[0];
+}
+
+static void
+bench_reverse_row(uint32 rowbytes)
+{
+	uint32 y;
+	for (y = 0; y < BENCH_ROWS; y++)
+		bits->reverse_row(dstrow, pagea + y * rowbytes, rowbytes);
+	sink += dstrow[0];
+}
+
+typedef struct bench_entry bench_entry;
+struct bench_entry
+{
+	const char *name;
+	void	(*run)(uint32 rowbytes);
+};
+
+static const bench_entry benches[] =
+{
+	{ "popcount", bench_popcount },
+	{ "popcount_xor", bench_popcount_xor },
+	{ "find_pixel", bench_find_pixel },
+	{ "shift_words", bench_shift_words },
+	{ "row_or", bench_row_or },
+	{ "row_and", bench_row_and },
+	{ "reverse_row", bench_reverse_row },
+	{ NULL, NULL }
+};
+
+int
+main(int argc, char* argv[])
+{
+	static const char *sets[] = { "scalar", "bmi2", "avx2", "avx512", NULL };
+	uint32 rowbytes = (BENCH_WIDTH + 7) / 8;
+	LARGE_INTEGER frequency, start, end;
+	char env[40];
+	double best, ns;
+	int set, bench, pass;
+
+	pagea = malloc(rowbytes * BENCH_ROWS);
+	pageb = malloc(rowbytes * BENCH_ROWS);
+	dstrow = malloc(rowbytes);
+	srcwords = malloc(((rowbytes + 7) / 8) * sizeof(uint64));
+	dstwords = malloc(((rowbytes + 7) / 8 + 2) * sizeof(uint64));
+	if (pagea == NULL || pageb == NULL || dstrow == NULL || srcwords == NULL || dstwords == NULL)
+	{
+		fprintf(stderr, "bitbench: Out of memory\n");
+		return -1;
+	}
+	fill_page(pagea, rowbytes * BENCH_ROWS, 1);
+	fill_page(pageb, rowbytes * BENCH_ROWS, 2);
+	memset(dstrow, 0xff, rowbytes);
+	row_load_words(srcwords, pagea, rowbytes);
+	QueryPerformanceFrequency(&frequency);
+
+	/* time each kernel over a whole page, best of a few passes, for every set this CPU can run */
+	printf("ns per %u-pixel row, best of %d passes over %u rows\n\n", BENCH_WIDTH, BENCH_PASSES, BENCH_ROWS);
+	printf("%-14s", "");
+	for (set = 0; sets[set] != NULL; set++)
+		printf("%10s", sets[set]);
+	printf("\n");
+	for (bench = 0; benches[bench].name != NULL; bench++)
+	{
+		printf("%-14s", benches[bench].name);
+		for (set = 0; sets[set] != NULL; set++)
+		{
+			/* pick the set the same way the tools do */
+			sprintf(env, "BITKERNELS=%s", sets[set]);
+			putenv(env);
+			bit_kernels_init();
+			if (strcmp(bits->name, sets[set]) != 0)
+			{
+				printf("%10s", "-");
+				continue;
+			}
+			best = 0;
+			for (pass = 0; pass < BENCH_PASSES; pass++)
+			{
+				QueryPerformanceCounter(&start);
+				benches[bench].run(rowbytes);
+				QueryPerformanceCounter(&end);
+				ns = (double)(end.QuadPart - start.QuadPart) * 1e9 / (double)frequency.QuadPart / BENCH_ROWS;
+				if (pass == 0 || ns < best)
+					best = ns;
+			}
+			printf("%10.1f", best);
+		}
+		printf("\n");
+	}
+	return 0;
+}
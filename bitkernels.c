@@ -0,0 +1,685 @@
+#include <stdlib.h>
+#include <string.h>
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "bitkernels.h"
+
+#define TARGET_BMI2		__attribute__((target("popcnt,lzcnt,bmi,bmi2")))
+#define TARGET_AVX2		__attribute__((target("popcnt,lzcnt,bmi,bmi2,avx,avx2")))
+#define TARGET_AVX512	__attribute__((target("popcnt,lzcnt,bmi,bmi2,avx,avx2,avx512f,avx512bw,avx512vpopcntdq")))
+#define ALWAYS_INLINE	__attribute__((always_inline)) static inline
+
+static const uint8 popcount_table[256] =
+{
+	0,1,1,2,1,2,2,3, 1,2,2,3,2,3,3,4,
+	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
+	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
+	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
+	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
+	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
+	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
+	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
+
+	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
+	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
+	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
+	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
+	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
+	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
+	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
+	4,5,5,6,5,6,6,7, 5,6,6,7,6,7,7,8
+};
+
+static const uint8 bitreverse_table[256] =
+{
+	0x00,0x80,0x40,0xc0,0x20,0xa0,0x60,0xe0, 0x10,0x90,0x50,0xd0,0x30,0xb0,0x70,0xf0,
+	0x08,0x88,0x48,0xc8,0x28,0xa8,0x68,0xe8, 0x18,0x98,0x58,0xd8,0x38,0xb8,0x78,0xf8,
+	0x04,0x84,0x44,0xc4,0x24,0xa4,0x64,0xe4, 0x14,0x94,0x54,0xd4,0x34,0xb4,0x74,0xf4,
+	0x0c,0x8c,0x4c,0xcc,0x2c,0xac,0x6c,0xec, 0x1c,0x9c,0x5c,0xdc,0x3c,0xbc,0x7c,0xfc,
+	0x02,0x82,0x42,0xc2,0x22,0xa2,0x62,0xe2, 0x12,0x92,0x52,0xd2,0x32,0xb2,0x72,0xf2,
+	0x0a,0x8a,0x4a,0xca,0x2a,0xaa,0x6a,0xea, 0x1a,0x9a,0x5a,0xda,0x3a,0xba,0x7a,0xfa,
+	0x06,0x86,0x46,0xc6,0x26,0xa6,0x66,0xe6, 0x16,0x96,0x56,0xd6,0x36,0xb6,0x76,0xf6,
+	0x0e,0x8e,0x4e,0xce,0x2e,0xae,0x6e,0xee, 0x1e,0x9e,0x5e,0xde,0x3e,0xbe,0x7e,0xfe,
+	0x01,0x81,0x41,0xc1,0x21,0xa1,0x61,0xe1, 0x11,0x91,0x51,0xd1,0x31,0xb1,0x71,0xf1,
+	0x09,0x89,0x49,0xc9,0x29,0xa9,0x69,0xe9, 0x19,0x99,0x59,0xd9,0x39,0xb9,0x79,0xf9,
+	0x05,0x85,0x45,0xc5,0x25,0xa5,0x65,0xe5, 0x15,0x95,0x55,0xd5,0x35,0xb5,0x75,0xf5,
+	0x0d,0x8d,0x4d,0xcd,0x2d,0xad,0x6d,0xed, 0x1d,0x9d,0x5d,0xdd,0x3d,0xbd,0x7d,0xfd,
+	0x03,0x83,0x43,0xc3,0x23,0xa3,0x63,0xe3, 0x13,0x93,0x53,0xd3,0x33,0xb3,0x73,0xf3,
+	0x0b,0x8b,0x4b,0xcb,0x2b,0xab,0x6b,0xeb, 0x1b,0x9b,0x5b,0xdb,0x3b,0xbb,0x7b,0xfb,
+	0x07,0x87,0x47,0xc7,0x27,0xa7,0x67,0xe7, 0x17,0x97,0x57,0xd7,0x37,0xb7,0x77,0xf7,
+	0x0f,0x8f,0x4f,0xcf,0x2f,0xaf,0x6f,0xef, 0x1f,0x9f,0x5f,0xdf,0x3f,0xbf,0x7f,0xff
+};
+
+void
+row_load_words(uint64 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x, words = bytes / 8;
+	
+	/* pack bytes into words, leftmost pixel in the high bit */
+	for (x = 0; x < words; x++, src += 8)
+		dst[x] = ((uint64)src[0] << 56) | ((uint64)src[1] << 48) | ((uint64)src[2] << 40) | ((uint64)src[3] << 32) |
+				 ((uint64)src[4] << 24) | ((uint64)src[5] << 16) | ((uint64)src[6] << 8) | (uint64)src[7];
+	
+	/* pad out any partial word with zeros */
+	if (bytes % 8 != 0)
+	{
+		uint64 word = 0;
+		for (x = 0; x < bytes % 8; x++)
+			word |= (uint64)src[x] << (56 - 8 * x);
+		dst[words] = word;
+	}
+}
+
+void
+row_store_words(uint8 *dst, const uint64 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	/* unpack words back into bytes */
+	for (x = 0; x < bytes; x++)
+		dst[x] = src[x / 8] >> (56 - 8 * (x % 8));
+}
+
+/*
+ * shared bodies; each variant below inlines these so they compile for its instruction set
+ */
+
+ALWAYS_INLINE uint64
+load_word(const uint8 *src)
+{
+	uint64 word;
+	memcpy(&word, src, sizeof(word));
+	return word;
+}
+
+ALWAYS_INLINE void
+shift_words_body(uint64 *dst, uint32 first, uint32 last, const uint64 *src, uint32 srcwords, long wordoffs, int shift)
+{
+	long x;
+	
+	/* destination bit N comes from source bit N + offset; funnel adjacent source words together */
+	for (x = first; x < (long)last; x++)
+	{
+		long srcx = x + wordoffs;
+		uint64 hi = (srcx >= 0 && srcx < (long)srcwords) ? src[srcx] : 0;
+		uint64 lo = (srcx + 1 >= 0 && srcx + 1 < (long)srcwords) ? src[srcx + 1] : 0;
+		dst[x] = (shift == 0) ? hi : ((hi << shift) | (lo >> (64 - shift)));
+	}
+}
+
+ALWAYS_INLINE void
+shift_words_split(long offset, uint32 dstwords, uint32 srcwords, long *wordoffs, int *shift, uint32 *first, uint32 *last)
+{
+	*wordoffs = (offset >= 0) ? (offset / 64) : -((63 - offset) / 64);
+	*shift = offset - *wordoffs * 64;
+	
+	/* [first, last) are the destination words whose two source words are both inside the row */
+	*first = (*wordoffs < 0) ? -*wordoffs : 0;
+	*last = (*wordoffs + 1 < (long)srcwords) ? (srcwords - 1 - *wordoffs) : 0;
+	if (*last > dstwords)
+		*last = dstwords;
+	if (*first > *last)
+		*first = *last;
+}
+
+ALWAYS_INLINE uint32
+popcount_words(const uint8 *src1, const uint8 *src2, uint32 bytes, uint32 *done)
+{
+	uint32 x, count = 0;
+	
+	/* a word at a time, XORing in the second row if there is one */
+	for (x = 0; x + 8 <= bytes; x += 8)
+		count += __builtin_popcountll(load_word(src1 + x) ^ (src2 ? load_word(src2 + x) : 0));
+	*done = x;
+	return count;
+}
+
+ALWAYS_INLINE uint32
+find_pixel_words(const uint8 *row, uint32 i, uint32 width, int black)
+{
+	uint32 bytes = (width + 7) / 8;
+	uint64 flip = black ? 0 : ~(uint64)0;
+	uint32 found;
+	
+	/* whole words, byte-swapped so the leftmost pixel is the high bit */
+	for ( ; i + 8 <= bytes; i += 8)
+	{
+		uint64 word = load_word(row + i) ^ flip;
+		if (word != 0)
+		{
+			found = i * 8 + __builtin_clzll(__builtin_bswap64(word));
+			return (found < width) ? found : width;
+		}
+	}
+	
+	/* then any leftover bytes */
+	for ( ; i < bytes; i++)
+	{
+		uint32 byte = (row[i] ^ (uint8)flip);
+		if (byte != 0)
+		{
+			found = i * 8 + __builtin_clz(byte) - 24;
+			return (found < width) ? found : width;
+		}
+	}
+	return width;
+}
+
+ALWAYS_INLINE uint32
+find_pixel_first_byte(const uint8 *row, uint32 x, uint32 width, int black, uint32 *found)
+{
+	uint32 byte;
+	
+	/* check the rest of the byte containing x */
+	*found = width;
+	if (x >= width)
+		return 1;
+	byte = (row[x / 8] ^ (black ? 0 : 0xff)) & (0xff >> (x % 8));
+	if (byte == 0)
+		return 0;
+	*found = (x / 8) * 8 + __builtin_clz(byte) - 24;
+	if (*found > width)
+		*found = width;
+	return 1;
+}
+
+ALWAYS_INLINE uint32
+find_pixel_near(const uint8 *row, uint32 *i, uint32 width, int black, uint32 *found)
+{
+	uint32 bytes = (width + 7) / 8;
+	uint64 flip = black ? 0 : ~(uint64)0;
+	int n;
+	
+	/* most runs are short, so try a few words before setting up vector compares */
+	for (n = 0; n < 8 && *i + 8 <= bytes; n++, *i += 8)
+	{
+		uint64 word = load_word(row + *i) ^ flip;
+		if (word != 0)
+		{
+			*found = *i * 8 + __builtin_clzll(__builtin_bswap64(word));
+			if (*found > width)
+				*found = width;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * scalar: lookup tables and byte loops, for any x86
+ */
+
+static uint32
+popcount_scalar(const uint8 *src, uint32 bytes)
+{
+	uint32 x, count = 0;
+	
+	for (x = 0; x < bytes; x++)
+		count += popcount_table[src[x]];
+	return count;
+}
+
+static uint32
+popcount_xor_scalar(const uint8 *src1, const uint8 *src2, uint32 bytes)
+{
+	uint32 x, count = 0;
+	
+	for (x = 0; x < bytes; x++)
+		count += popcount_table[src1[x] ^ src2[x]];
+	return count;
+}
+
+static uint32
+find_pixel_scalar(const uint8 *row, uint32 x, uint32 width, int black)
+{
+	uint8 skip = black ? 0x00 : 0xff;
+	
+	/* step a pixel at a time, skipping whole bytes of the wrong color where we can */
+	while (x < width)
+	{
+		uint8 byte = row[x / 8];
+		if ((x % 8) == 0 && byte == skip)
+			x += 8;
+		else if (((byte & (0x80 >> (x % 8))) != 0) == (black != 0))
+			return x;
+		else
+			x++;
+	}
+	return width;
+}
+
+static void
+shift_words_scalar(uint64 *dst, uint32 dstwords, const uint64 *src, uint32 srcwords, long offset)
+{
+	long wordoffs = (offset >= 0) ? (offset / 64) : -((63 - offset) / 64);
+	
+	shift_words_body(dst, 0, dstwords, src, srcwords, wordoffs, offset - wordoffs * 64);
+}
+
+static void
+row_or_scalar(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x < bytes; x++)
+		dst[x] |= src[x];
+}
+
+static void
+row_and_scalar(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x < bytes; x++)
+		dst[x] &= src[x];
+}
+
+static void
+reverse_row_scalar(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x < bytes; x++)
+		dst[x] = bitreverse_table[src[bytes - 1 - x]];
+}
+
+/*
+ * POPCNT/LZCNT/BMI2: a 64-bit word at a time with single-instruction counts and variable shifts
+ */
+
+TARGET_BMI2 static uint32
+popcount_bmi2(const uint8 *src, uint32 bytes)
+{
+	uint32 x, count = popcount_words(src, NULL, bytes, &x);
+	
+	for ( ; x < bytes; x++)
+		count += __builtin_popcount(src[x]);
+	return count;
+}
+
+TARGET_BMI2 static uint32
+popcount_xor_bmi2(const uint8 *src1, const uint8 *src2, uint32 bytes)
+{
+	uint32 x, count = popcount_words(src1, src2, bytes, &x);
+	
+	for ( ; x < bytes; x++)
+		count += __builtin_popcount(src1[x] ^ src2[x]);
+	return count;
+}
+
+TARGET_BMI2 static uint32
+find_pixel_bmi2(const uint8 *row, uint32 x, uint32 width, int black)
+{
+	uint32 found;
+	
+	if (find_pixel_first_byte(row, x, width, black, &found))
+		return found;
+	return find_pixel_words(row, x / 8 + 1, width, black);
+}
+
+TARGET_BMI2 static void
+shift_words_bmi2(uint64 *dst, uint32 dstwords, const uint64 *src, uint32 srcwords, long offset)
+{
+	long wordoffs = (offset >= 0) ? (offset / 64) : -((63 - offset) / 64);
+	
+	shift_words_body(dst, 0, dstwords, src, srcwords, wordoffs, offset - wordoffs * 64);
+}
+
+TARGET_BMI2 static void
+row_or_bmi2(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x + 8 <= bytes; x += 8)
+	{
+		uint64 word = load_word(dst + x) | load_word(src + x);
+		memcpy(dst + x, &word, sizeof(word));
+	}
+	for ( ; x < bytes; x++)
+		dst[x] |= src[x];
+}
+
+TARGET_BMI2 static void
+row_and_bmi2(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x + 8 <= bytes; x += 8)
+	{
+		uint64 word = load_word(dst + x) & load_word(src + x);
+		memcpy(dst + x, &word, sizeof(word));
+	}
+	for ( ; x < bytes; x++)
+		dst[x] &= src[x];
+}
+
+TARGET_BMI2 static void
+reverse_row_bmi2(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	/* reverse the bits of each word by swapping ever smaller groups, finishing with a byte swap */
+	for (x = 0; x + 8 <= bytes; x += 8)
+	{
+		uint64 word = load_word(src + bytes - 8 - x);
+		word = ((word >> 1) & 0x5555555555555555ull) | ((word & 0x5555555555555555ull) << 1);
+		word = ((word >> 2) & 0x3333333333333333ull) | ((word & 0x3333333333333333ull) << 2);
+		word = ((word >> 4) & 0x0f0f0f0f0f0f0f0full) | ((word & 0x0f0f0f0f0f0f0f0full) << 4);
+		word = __builtin_bswap64(word);
+		memcpy(dst + x, &word, sizeof(word));
+	}
+	for ( ; x < bytes; x++)
+		dst[x] = bitreverse_table[src[bytes - 1 - x]];
+}
+
+/*
+ * AVX2: 32 bytes at a time; popcount uses the nibble lookup with VPSHUFB and sums with VPSADBW
+ */
+
+TARGET_AVX2 static __m256i
+popcount_bytes_avx2(__m256i value)
+{
+	const __m256i lookup = _mm256_setr_epi8(0,1,1,2,1,2,2,3, 1,2,2,3,2,3,3,4, 0,1,1,2,1,2,2,3, 1,2,2,3,2,3,3,4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(value, nibble));
+	__m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(value, 4), nibble));
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+TARGET_AVX2 static uint32
+popcount_sum_avx2(__m256i sum)
+{
+	__m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+	
+	/* fold the four 64-bit sums; no 64-bit extracts, so this builds for 32-bit targets too */
+	return _mm_cvtsi128_si32(_mm_add_epi64(half, _mm_unpackhi_epi64(half, half)));
+}
+
+TARGET_AVX2 static uint32
+popcount_avx2(const uint8 *src, uint32 bytes)
+{
+	__m256i sum = _mm256_setzero_si256();
+	uint32 x;
+	
+	for (x = 0; x + 32 <= bytes; x += 32)
+		sum = _mm256_add_epi64(sum, popcount_bytes_avx2(_mm256_loadu_si256((const __m256i *)(src + x))));
+	return popcount_sum_avx2(sum) + popcount_bmi2(src + x, bytes - x);
+}
+
+TARGET_AVX2 static uint32
+popcount_xor_avx2(const uint8 *src1, const uint8 *src2, uint32 bytes)
+{
+	__m256i sum = _mm256_setzero_si256();
+	uint32 x;
+	
+	for (x = 0; x + 32 <= bytes; x += 32)
+		sum = _mm256_add_epi64(sum, popcount_bytes_avx2(_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(src1 + x)), _mm256_loadu_si256((const __m256i *)(src2 + x)))));
+	return popcount_sum_avx2(sum) + popcount_xor_bmi2(src1 + x, src2 + x, bytes - x);
+}
+
+TARGET_AVX2 static uint32
+find_pixel_avx2(const uint8 *row, uint32 x, uint32 width, int black)
+{
+	const __m256i skip = _mm256_set1_epi8(black ? 0x00 : 0xff);
+	uint32 bytes = (width + 7) / 8;
+	uint32 found, i;
+	
+	if (find_pixel_first_byte(row, x, width, black, &found))
+		return found;
+	
+	i = x / 8 + 1;
+	if (find_pixel_near(row, &i, width, black, &found))
+		return found;
+	
+	/* skip 32-byte blocks of the wrong color, then let the word loop pin down the pixel */
+	for ( ; i + 32 <= bytes; i += 32)
+	{
+		uint32 mask = ~(uint32)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(row + i)), skip));
+		if (mask != 0)
+		{
+			i += __builtin_ctz(mask);
+			break;
+		}
+	}
+	return find_pixel_words(row, i, width, black);
+}
+
+TARGET_AVX2 static void
+shift_words_avx2(uint64 *dst, uint32 dstwords, const uint64 *src, uint32 srcwords, long offset)
+{
+	uint32 first, last, x;
+	long wordoffs;
+	int shift;
+	
+	/* vectors where both source words are in range, the scalar body around the edges; shifts by 64 give zero */
+	shift_words_split(offset, dstwords, srcwords, &wordoffs, &shift, &first, &last);
+	shift_words_body(dst, 0, first, src, srcwords, wordoffs, shift);
+	for (x = first; x + 4 <= last; x += 4)
+	{
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(src + x + wordoffs));
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(src + x + wordoffs + 1));
+		__m256i result = _mm256_or_si256(_mm256_sll_epi64(hi, _mm_cvtsi32_si128(shift)), _mm256_srl_epi64(lo, _mm_cvtsi32_si128(64 - shift)));
+		_mm256_storeu_si256((__m256i *)(dst + x), result);
+	}
+	shift_words_body(dst, x, dstwords, src, srcwords, wordoffs, shift);
+}
+
+TARGET_AVX2 static void
+row_or_avx2(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x + 32 <= bytes; x += 32)
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(dst + x)), _mm256_loadu_si256((const __m256i *)(src + x))));
+	row_or_bmi2(dst + x, src + x, bytes - x);
+}
+
+TARGET_AVX2 static void
+row_and_avx2(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x + 32 <= bytes; x += 32)
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(dst + x)), _mm256_loadu_si256((const __m256i *)(src + x))));
+	row_and_bmi2(dst + x, src + x, bytes - x);
+}
+
+TARGET_AVX2 static void
+reverse_row_avx2(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	const __m256i revlo = _mm256_setr_epi8(0x00,0x80,0x40,0xc0,0x20,0xa0,0x60,0xe0, 0x10,0x90,0x50,0xd0,0x30,0xb0,0x70,0xf0,
+										   0x00,0x80,0x40,0xc0,0x20,0xa0,0x60,0xe0, 0x10,0x90,0x50,0xd0,0x30,0xb0,0x70,0xf0);
+	const __m256i revhi = _mm256_setr_epi8(0x0,0x8,0x4,0xc,0x2,0xa,0x6,0xe, 0x1,0x9,0x5,0xd,0x3,0xb,0x7,0xf,
+										   0x0,0x8,0x4,0xc,0x2,0xa,0x6,0xe, 0x1,0x9,0x5,0xd,0x3,0xb,0x7,0xf);
+	const __m256i backwards = _mm256_setr_epi8(15,14,13,12,11,10,9,8, 7,6,5,4,3,2,1,0, 15,14,13,12,11,10,9,8, 7,6,5,4,3,2,1,0);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	uint32 x;
+	
+	/* reverse each byte's bits through nibble lookups, then the byte order within and across the two lanes */
+	for (x = 0; x + 32 <= bytes; x += 32)
+	{
+		__m256i value = _mm256_loadu_si256((const __m256i *)(src + bytes - 32 - x));
+		value = _mm256_or_si256(_mm256_shuffle_epi8(revlo, _mm256_and_si256(value, nibble)),
+								_mm256_shuffle_epi8(revhi, _mm256_and_si256(_mm256_srli_epi16(value, 4), nibble)));
+		value = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(value, backwards), 0x4e);
+		_mm256_storeu_si256((__m256i *)(dst + x), value);
+	}
+	reverse_row_bmi2(dst + x, src, bytes - x);
+}
+
+/*
+ * AVX-512: 64 bytes at a time, with VPOPCNTQ for counts and byte compare masks for run scans
+ */
+
+TARGET_AVX512 static uint32
+popcount_avx512(const uint8 *src, uint32 bytes)
+{
+	__m512i sum = _mm512_setzero_si512();
+	uint32 x;
+	
+	for (x = 0; x + 64 <= bytes; x += 64)
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_loadu_si512((const void *)(src + x))));
+	return _mm512_reduce_add_epi64(sum) + popcount_bmi2(src + x, bytes - x);
+}
+
+TARGET_AVX512 static uint32
+popcount_xor_avx512(const uint8 *src1, const uint8 *src2, uint32 bytes)
+{
+	__m512i sum = _mm512_setzero_si512();
+	uint32 x;
+	
+	for (x = 0; x + 64 <= bytes; x += 64)
+		sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512((const void *)(src1 + x)), _mm512_loadu_si512((const void *)(src2 + x)))));
+	return _mm512_reduce_add_epi64(sum) + popcount_xor_bmi2(src1 + x, src2 + x, bytes - x);
+}
+
+TARGET_AVX512 static uint32
+find_pixel_avx512(const uint8 *row, uint32 x, uint32 width, int black)
+{
+	const __m512i skip = _mm512_set1_epi8(black ? 0x00 : 0xff);
+	uint32 bytes = (width + 7) / 8;
+	uint32 found, i;
+	
+	if (find_pixel_first_byte(row, x, width, black, &found))
+		return found;
+	
+	i = x / 8 + 1;
+	if (find_pixel_near(row, &i, width, black, &found))
+		return found;
+	
+	/* skip 64-byte blocks of the wrong color, then let the word loop pin down the pixel */
+	for ( ; i + 64 <= bytes; i += 64)
+	{
+		__mmask64 mask = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512((const void *)(row + i)), skip);
+		if (mask != 0)
+		{
+			i += __builtin_ctzll(mask);
+			break;
+		}
+	}
+	return find_pixel_words(row, i, width, black);
+}
+
+TARGET_AVX512 static void
+shift_words_avx512(uint64 *dst, uint32 dstwords, const uint64 *src, uint32 srcwords, long offset)
+{
+	uint32 first, last, x;
+	long wordoffs;
+	int shift;
+	
+	shift_words_split(offset, dstwords, srcwords, &wordoffs, &shift, &first, &last);
+	shift_words_body(dst, 0, first, src, srcwords, wordoffs, shift);
+	for (x = first; x + 8 <= last; x += 8)
+	{
+		__m512i hi = _mm512_loadu_si512((const void *)(src + x + wordoffs));
+		__m512i lo = _mm512_loadu_si512((const void *)(src + x + wordoffs + 1));
+		__m512i result = _mm512_or_si512(_mm512_sll_epi64(hi, _mm_cvtsi32_si128(shift)), _mm512_srl_epi64(lo, _mm_cvtsi32_si128(64 - shift)));
+		_mm512_storeu_si512((void *)(dst + x), result);
+	}
+	shift_words_body(dst, x, dstwords, src, srcwords, wordoffs, shift);
+}
+
+TARGET_AVX512 static void
+row_or_avx512(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x + 64 <= bytes; x += 64)
+		_mm512_storeu_si512((void *)(dst + x), _mm512_or_si512(_mm512_loadu_si512((const void *)(dst + x)), _mm512_loadu_si512((const void *)(src + x))));
+	row_or_bmi2(dst + x, src + x, bytes - x);
+}
+
+TARGET_AVX512 static void
+row_and_avx512(uint8 *dst, const uint8 *src, uint32 bytes)
+{
+	uint32 x;
+	
+	for (x = 0; x + 64 <= bytes; x += 64)
+		_mm512_storeu_si512((void *)(dst + x), _mm512_and_si512(_mm512_loadu_si512((const void *)(dst + x)), _mm512_loadu_si512((const void *)(src + x))));
+	row_and_bmi2(dst + x, src + x, bytes - x);
+}
+
+/*
+ * dispatch
+ */
+
+static const bit_kernels kernels_scalar =
+{
+	"scalar", popcount_scalar, popcount_xor_scalar, find_pixel_scalar, shift_words_scalar, row_or_scalar, row_and_scalar, reverse_row_scalar
+};
+
+static const bit_kernels kernels_bmi2 =
+{
+	"bmi2", popcount_bmi2, popcount_xor_bmi2, find_pixel_bmi2, shift_words_bmi2, row_or_bmi2, row_and_bmi2, reverse_row_bmi2
+};
+
+static const bit_kernels kernels_avx2 =
+{
+	"avx2", popcount_avx2, popcount_xor_avx2, find_pixel_avx2, shift_words_avx2, row_or_avx2, row_and_avx2, reverse_row_avx2
+};
+
+static const bit_kernels kernels_avx512 =
+{
+	"avx512", popcount_avx512, popcount_xor_avx512, find_pixel_avx512, shift_words_avx512, row_or_avx512, row_and_avx512, reverse_row_avx2
+};
+
+const bit_kernels *bits = &kernels_scalar;
+
+static uint64
+read_xcr0(void)
+{
+	unsigned int lo, hi;
+	
+	/* XGETBV, spelled out for assemblers that don't know it */
+	__asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" : "=a" (lo), "=d" (hi) : "c" (0));
+	return ((uint64)hi << 32) | lo;
+}
+
+void
+bit_kernels_init(void)
+{
+	const bit_kernels *supported[4];
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int ecx1 = 0, ebx7 = 0, ecx7 = 0, ecxext = 0;
+	uint64 xcr0 = 0;
+	const char *wanted;
+	int count = 0;
+	
+	/* gather the feature bits: leaf 1 for POPCNT/OSXSAVE, leaf 7 for BMI/AVX2/AVX-512, 0x80000001 for LZCNT */
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		ecx1 = ecx;
+	if (__get_cpuid_max(0, NULL) >= 7)
+	{
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		ebx7 = ebx;
+		ecx7 = ecx;
+	}
+	if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx))
+		ecxext = ecx;
+	
+	/* AVX state needs OS support too: XMM/YMM for AVX2, plus the opmask and ZMM state for AVX-512 */
+	if (ecx1 & (1 << 27))
+		xcr0 = read_xcr0();
+	
+	/* list what this CPU can run, best last */
+	supported[count++] = &kernels_scalar;
+	if ((ecx1 & (1 << 23)) && (ecxext & (1 << 5)) && (ebx7 & (1 << 3)) && (ebx7 & (1 << 8)))
+	{
+		supported[count++] = &kernels_bmi2;
+		if ((ebx7 & (1 << 5)) && (xcr0 & 0x06) == 0x06)
+		{
+			supported[count++] = &kernels_avx2;
+			if ((ebx7 & (1 << 16)) && (ebx7 & (1 << 30)) && (ecx7 & (1 << 14)) && (xcr0 & 0xe6) == 0xe6)
+				supported[count++] = &kernels_avx512;
+		}
+	}
+	
+	/* take the best, unless the environment asks for a particular supported set */
+	bits = supported[count - 1];
+	wanted = getenv("BITKERNELS");
+	if (wanted != NULL)
+		while (count-- > 0)
+			if (strcmp(wanted, supported[count]->name) == 0)
+				bits = supported[count];
+}
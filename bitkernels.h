@@ -0,0 +1,42 @@
+#ifndef BITKERNELS_H
+#define BITKERNELS_H
+
+#include "tiff.h"
+
+typedef unsigned long long uint64;
+
+/* bit-level row kernels; rows are MSB-first bytes, black = 1 */
+typedef struct bit_kernels bit_kernels;
+struct bit_kernels
+{
+	const char *name;
+
+	/* number of set bits in a row, or in the XOR of two rows */
+	uint32	(*popcount)(const uint8 *src, uint32 bytes);
+	uint32	(*popcount_xor)(const uint8 *src1, const uint8 *src2, uint32 bytes);
+
+	/* first pixel at or after x that is black (or white), or width if there is none */
+	uint32	(*find_pixel)(const uint8 *row, uint32 x, uint32 width, int black);
+
+	/* destination bit N comes from source bit N + offset, over words with the leftmost pixel in the high bit */
+	void	(*shift_words)(uint64 *dst, uint32 dstwords, const uint64 *src, uint32 srcwords, long offset);
+
+	/* dst |= src and dst &= src */
+	void	(*row_or)(uint8 *dst, const uint8 *src, uint32 bytes);
+	void	(*row_and)(uint8 *dst, const uint8 *src, uint32 bytes);
+
+	/* mirror a row of bytes: byte order and the bits within each byte are both reversed */
+	void	(*reverse_row)(uint8 *dst, const uint8 *src, uint32 bytes);
+};
+
+/* the best kernels for this CPU, valid (as scalar) even before bit_kernels_init */
+extern const bit_kernels *bits;
+
+/* pick kernels by CPUID; the BITKERNELS environment variable can ask for a lesser set by name */
+void bit_kernels_init(void);
+
+/* pack bytes into words with the leftmost pixel in the high bit, and back */
+void row_load_words(uint64 *dst, const uint8 *src, uint32 bytes);
+void row_store_words(uint8 *dst, const uint64 *src, uint32 bytes);
+
+#endif
@@ -1,4 +1,5 @@
-gcc tiff3hole.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -o tiff3hole.exe
-gcc tiffalign.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -o tiffalign.exe
-gcc tiffrotate.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -o tiffrotate.exe
-gcc tiffbook.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -o tiffbook.exe
+gcc tiff3hole.c bitkernels.c pageout.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -lpsapi -o tiff3hole.exe
+gcc tiffalign.c bitkernels.c pageout.c shear.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -lpsapi -o tiffalign.exe
+gcc tiffrotate.c bitkernels.c pageout.c shear.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -lpsapi -o tiffrotate.exe
+gcc tiffbook.c bitkernels.c pageout.c -g -fno-omit-frame-pointer -O3 -Ilibtiff -Wl,--large-address-aware libtiff3.dll -lpsapi -o tiffbook.exe
+gcc bitbench.c bitkernels.c -g -O3 -Ilibtiff -o bitbench.exe
@@ -0,0 +1,896 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <windows.h>
+
+#include "bitkernels.h"
+#include "pageout.h"
+
+/* take the T.4 run code tables from libtiff's header, under our own names */
+#define G3CODES
+#define TIFFFaxWhiteCodes pageout_white_codes
+#define TIFFFaxBlackCodes pageout_black_codes
+#include "t4.h"
+
+#define FILL_BAND_ROWS 256
+#define MAX_STRIP_WORKERS 64
+
+uint32 pageout_strip_rows = 0;
+
+/* a growable in-memory file for TIFFClientOpen */
+typedef struct memory_file memory_file;
+struct memory_file
+{
+	uint8 *		data;
+	uint32		size;
+	uint32		capacity;
+	uint32		position;
+};
+
+static tsize_t
+memory_file_read(thandle_t handle, tdata_t buffer, tsize_t size)
+{
+	return 0;
+}
+
+static tsize_t
+memory_file_write(thandle_t handle, tdata_t buffer, tsize_t size)
+{
+	memory_file *file = (memory_file *)handle;
+	uint32 capacity;
+	uint8 *data;
+
+	if (file->position + size > file->capacity)
+	{
+		for (capacity = file->capacity ? file->capacity : 65536; capacity < file->position + size; capacity *= 2)
+			;
+		data = _TIFFrealloc(file->data, capacity);
+		if (data == NULL)
+			return -1;
+		file->data = data;
+		file->capacity = capacity;
+	}
+	memcpy(file->data + file->position, buffer, size);
+	file->position += size;
+	if (file->position > file->size)
+		file->size = file->position;
+	return size;
+}
+
+static toff_t
+memory_file_seek(thandle_t handle, toff_t offset, int whence)
+{
+	memory_file *file = (memory_file *)handle;
+
+	if (whence == SEEK_CUR)
+		offset += file->position;
+	else if (whence == SEEK_END)
+		offset += file->size;
+	file->position = offset;
+	return offset;
+}
+
+static int
+memory_file_close(thandle_t handle)
+{
+	return 0;
+}
+
+static toff_t
+memory_file_size(thandle_t handle)
+{
+	return ((memory_file *)handle)->size;
+}
+
+static int
+memory_file_map(thandle_t handle, tdata_t *base, toff_t *size)
+{
+	return 0;
+}
+
+static void
+memory_file_unmap(thandle_t handle, tdata_t base, toff_t size)
+{
+}
+
+static const tableentry horizcode = { 3, 0x1, 0 };
+static const tableentry passcode = { 4, 0x1, 0 };
+static const tableentry vcodes[7] =
+{
+	{ 7, 0x03, 0 }, { 6, 0x03, 0 }, { 3, 0x03, 0 }, { 1, 0x1, 0 }, { 3, 0x2, 0 }, { 6, 0x02, 0 }, { 7, 0x02, 0 }
+};
+
+struct pageout_g4
+{
+	uint32		width;
+	uint32 *	changes;
+	uint32 *	refchanges;
+	uint32		refcount;
+	uint8 *		data;
+	uint32		size;
+	uint32		capacity;
+	uint64		bits;
+	int			bitcount;
+	int			failed;
+};
+
+/* codes collect in the low bits of a word and go out MSB first, 32 bits at a time */
+static inline void
+g4_put(pageout_g4 *g4, uint32 code, int length)
+{
+	uint32 word;
+
+	g4->bits = (g4->bits << length) | code;
+	g4->bitcount += length;
+	if (g4->bitcount >= 32)
+	{
+		g4->bitcount -= 32;
+		word = (uint32)(g4->bits >> g4->bitcount);
+		g4->data[g4->size++] = word >> 24;
+		g4->data[g4->size++] = word >> 16;
+		g4->data[g4->size++] = word >> 8;
+		g4->data[g4->size++] = word;
+	}
+}
+
+static void
+g4_put_span(pageout_g4 *g4, uint32 span, const tableentry *table)
+{
+	const tableentry *entry;
+
+	/* the same make-up codes libtiff picks: as many 2560s as needed, then one more make-up and the terminator */
+	while (span >= 2624)
+	{
+		entry = &table[63 + (2560 >> 6)];
+		g4_put(g4, entry->code, entry->length);
+		span -= entry->runlen;
+	}
+	if (span >= 64)
+	{
+		entry = &table[63 + (span >> 6)];
+		g4_put(g4, entry->code, entry->length);
+		span -= entry->runlen;
+	}
+	g4_put(g4, table[span].code, table[span].length);
+}
+
+/* make room for the worst a row could produce */
+static int
+g4_reserve(pageout_g4 *g4, uint32 count)
+{
+	uint32 needed = g4->size + (count + g4->refcount + 4) * 8 + (g4->width / 2560 + 2) * 4;
+	uint32 capacity;
+	uint8 *data;
+
+	if (needed <= g4->capacity)
+		return 0;
+	for (capacity = g4->capacity * 2; capacity < needed; capacity *= 2)
+		;
+	data = _TIFFrealloc(g4->data, capacity);
+	if (data == NULL)
+	{
+		g4->failed = 1;
+		return -1;
+	}
+	g4->data = data;
+	g4->capacity = capacity;
+	return 0;
+}
+
+pageout_g4 *
+pageout_g4_begin(uint32 width)
+{
+	pageout_g4 *g4;
+
+	g4 = _TIFFmalloc(sizeof(pageout_g4));
+	if (g4 == NULL)
+		return NULL;
+	memset(g4, 0, sizeof(pageout_g4));
+	g4->width = width;
+	g4->capacity = 65536;
+	g4->changes = _TIFFmalloc((width + 4) * sizeof(uint32));
+	g4->refchanges = _TIFFmalloc((width + 4) * sizeof(uint32));
+	g4->data = _TIFFmalloc(g4->capacity);
+	if (g4->changes == NULL || g4->refchanges == NULL || g4->data == NULL)
+	{
+		fprintf(stderr, "pageout_g4_begin: Out of memory allocating encoder for width %d\n", width);
+		g4->failed = 1;
+		_TIFFfree(pageout_g4_end(g4, &width));
+		return NULL;
+	}
+
+	/* the line above the first is white */
+	g4->refchanges[0] = g4->refchanges[1] = g4->refchanges[2] = width;
+	return g4;
+}
+
+/* one row in 2D mode against the previous one; this follows libtiff's Fax3Encode2DRow choice for choice */
+static void
+g4_encode_row(pageout_g4 *g4, const uint32 *cur, const uint32 *ref)
+{
+	uint32 width = g4->width;
+	uint32 a0 = 0, a1 = cur[0], a2, b1 = ref[0], b2;
+	uint32 ia = 0, ir = 0, ib = 0;
+	int color = 0;
+	int d;
+
+	for (;;)
+	{
+		b2 = (b1 < width) ? ref[ib + 1] : width;
+		if (b2 >= a1)
+		{
+			d = (int)b1 - (int)a1;
+			if (d < -3 || d > 3)
+			{
+				/* horizontal mode: the runs from a0 to a1 and a1 to a2 */
+				a2 = (a1 < width) ? cur[ia + 1] : width;
+				g4_put(g4, horizcode.code, horizcode.length);
+				g4_put_span(g4, a1 - a0, color ? pageout_black_codes : pageout_white_codes);
+				g4_put_span(g4, a2 - a1, color ? pageout_white_codes : pageout_black_codes);
+				a0 = a2;
+			}
+			else
+			{
+				g4_put(g4, vcodes[d + 3].code, vcodes[d + 3].length);
+				a0 = a1;
+			}
+		}
+		else
+		{
+			g4_put(g4, passcode.code, passcode.length);
+			a0 = b2;
+		}
+		if (a0 >= width)
+			break;
+
+		/* a1 is the first change past a0, whose color is the parity of the changes up to it */
+		while (cur[ia] <= a0)
+			ia++;
+		color = ia & 1;
+		a1 = cur[ia];
+
+		/* b1 is the first change on the reference line past a0 to the opposite of a0's color */
+		while (ref[ir] <= a0)
+			ir++;
+		ib = ir + ((ir ^ color) & 1);
+		b1 = ref[ib];
+	}
+}
+
+int
+pageout_g4_changes(pageout_g4 *g4, const uint32 *changes, uint32 count)
+{
+	uint32 *swap;
+
+	if (g4->failed || g4_reserve(g4, count) != 0)
+		return -1;
+	if (changes != g4->changes)
+		memcpy(g4->changes, changes, count * sizeof(uint32));
+	g4->changes[count] = g4->changes[count + 1] = g4->changes[count + 2] = g4->width;
+	g4_encode_row(g4, g4->changes, g4->refchanges);
+
+	/* this row is the reference for the next */
+	swap = g4->refchanges;
+	g4->refchanges = g4->changes;
+	g4->changes = swap;
+	g4->refcount = count;
+	return 0;
+}
+
+int
+pageout_g4_row(pageout_g4 *g4, const uint8 *row)
+{
+	uint32 bytes = (g4->width + 7) / 8;
+	uint32 *changes = g4->changes;
+	uint32 count = 0, base, index;
+	uint64 word, last = 0, flips;
+	uint8 tail[8];
+	int shift;
+
+	/* a pixel that differs from the one to its left is a change; find them a word at a time, leftmost first */
+	for (base = 0; base < g4->width; base += 64)
+	{
+		index = base / 8;
+		if (bytes - index >= 8)
+			memcpy(&word, row + index, 8);
+		else
+		{
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, row + index, bytes - index);
+			memcpy(&word, tail, 8);
+		}
+		word = __builtin_bswap64(word);
+		flips = word ^ ((word >> 1) | (last << 63));
+		last = word & 1;
+		if (g4->width - base < 64)
+			flips &= ~0ULL << (64 - (g4->width - base));
+		while (flips != 0)
+		{
+			shift = __builtin_clzll(flips);
+			changes[count++] = base + shift;
+			flips &= ~(0x8000000000000000ULL >> shift);
+		}
+	}
+	return pageout_g4_changes(g4, changes, count);
+}
+
+uint8 *
+pageout_g4_end(pageout_g4 *g4, uint32 *size)
+{
+	uint8 *data = NULL;
+
+	/* EOFB is two EOLs, then the last byte is padded with zeros */
+	if (!g4->failed && g4_reserve(g4, 0) == 0)
+	{
+		g4_put(g4, EOL, 12);
+		g4_put(g4, EOL, 12);
+		for ( ; g4->bitcount >= 8; g4->bitcount -= 8)
+			g4->data[g4->size++] = (uint8)(g4->bits >> (g4->bitcount - 8));
+		if (g4->bitcount > 0)
+			g4->data[g4->size++] = (uint8)(g4->bits << (8 - g4->bitcount));
+		data = g4->data;
+		*size = g4->size;
+		g4->data = NULL;
+	}
+	if (g4->data != NULL)
+		_TIFFfree(g4->data);
+	if (g4->changes != NULL)
+		_TIFFfree(g4->changes);
+	if (g4->refchanges != NULL)
+		_TIFFfree(g4->refchanges);
+	_TIFFfree(g4);
+	return data;
+}
+
+static void
+set_page_fields(TIFF *out, const pageout_page *page, uint32 length, uint32 rowsperstrip)
+{
+	TIFFSetField(out, TIFFTAG_IMAGEWIDTH, page->width);
+	TIFFSetField(out, TIFFTAG_IMAGELENGTH, length);
+	TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, page->bitspersample);
+	TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(out, TIFFTAG_COMPRESSION, (page->bitspersample == 8) ? COMPRESSION_LZW : COMPRESSION_CCITTFAX4);
+	TIFFSetField(out, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
+	TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
+	TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, rowsperstrip);
+}
+
+static void
+set_page_tags(TIFF *out, const pageout_page *page, uint32 rowsperstrip)
+{
+	set_page_fields(out, page, page->length, rowsperstrip);
+	if (page->orientation != 0) TIFFSetField(out, TIFFTAG_ORIENTATION, page->orientation);
+	if (page->xres != 0) TIFFSetField(out, TIFFTAG_XRESOLUTION, page->xres);
+	if (page->yres != 0) TIFFSetField(out, TIFFTAG_YRESOLUTION, page->yres);
+	if (page->resunit != 0) TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, page->resunit);
+}
+
+static uint32
+page_rowbytes(const pageout_page *page)
+{
+	return (page->width * page->bitspersample + 7) / 8;
+}
+
+/* hand out rows y..y+rows-1 of the page as contiguous rows, either in place or rendered into buffer */
+static const uint8 *
+page_rows(const pageout_page *page, uint32 y, uint32 rows, uint8 *buffer)
+{
+	uint32 rowbytes = page_rowbytes(page);
+	uint32 i;
+
+	if (page->pixels == NULL)
+	{
+		memset(buffer, 0, rows * rowbytes);
+		(*page->fill)(page->param, y, rows, buffer);
+		return buffer;
+	}
+	if (page->rowbytes == rowbytes)
+		return page->pixels + y * rowbytes;
+	for (i = 0; i < rows; i++)
+		memcpy(buffer + i * rowbytes, page->pixels + (y + i) * page->rowbytes, rowbytes);
+	return buffer;
+}
+
+/* encode a bilevel strip a band of rows at a time */
+static int
+encode_strip_g4(const pageout_page *page, uint32 y, uint32 rows, uint8 **data, uint32 *size)
+{
+	uint32 rowbytes = page_rowbytes(page);
+	uint32 bandrows = (rows < FILL_BAND_ROWS) ? rows : FILL_BAND_ROWS;
+	const uint8 *src;
+	uint8 *buffer = NULL;
+	pageout_g4 *g4;
+	uint32 done, band, i;
+
+	g4 = pageout_g4_begin(page->width);
+	if (g4 == NULL)
+		return -1;
+	if (page->pixels == NULL || page->rowbytes != rowbytes)
+	{
+		buffer = _TIFFmalloc(bandrows * rowbytes);
+		if (buffer == NULL)
+		{
+			_TIFFfree(pageout_g4_end(g4, size));
+			return -1;
+		}
+	}
+	for (done = 0; done < rows; done += band)
+	{
+		band = (rows - done < bandrows) ? (rows - done) : bandrows;
+		src = page_rows(page, y + done, band, buffer);
+		for (i = 0; i < band; i++)
+			pageout_g4_row(g4, src + i * rowbytes);
+	}
+	if (buffer != NULL)
+		_TIFFfree(buffer);
+	*data = pageout_g4_end(g4, size);
+	return (*data != NULL) ? 0 : -1;
+}
+
+/* encode a gray strip as a one-strip image in memory; everything written after the header is the strip itself */
+static int
+encode_strip_lzw(const pageout_page *page, uint32 y, uint32 rows, uint8 **data, uint32 *size)
+{
+	uint32 rowbytes = page_rowbytes(page);
+	const uint8 *src;
+	uint8 *buffer = NULL;
+	memory_file file;
+	TIFF *tif = NULL;
+	uint32 start;
+
+	memset(&file, 0, sizeof(file));
+	if (page->pixels == NULL || page->rowbytes != rowbytes)
+	{
+		buffer = _TIFFmalloc(rows * rowbytes);
+		if (buffer == NULL)
+			goto error;
+	}
+	src = page_rows(page, y, rows, buffer);
+
+	tif = TIFFClientOpen("strip", "w", (thandle_t)&file, memory_file_read, memory_file_write, memory_file_seek,
+		memory_file_close, memory_file_size, memory_file_map, memory_file_unmap);
+	if (tif == NULL)
+		goto error;
+	start = file.size;
+	set_page_fields(tif, page, rows, rows);
+	if (TIFFWriteEncodedStrip(tif, 0, (tdata_t)src, rows * rowbytes) < 0)
+		goto error;
+
+	*size = file.size - start;
+	*data = _TIFFmalloc(*size ? *size : 1);
+	if (*data == NULL)
+		goto error;
+	memcpy(*data, file.data + start, *size);
+
+	TIFFClose(tif);
+	if (buffer != NULL)
+		_TIFFfree(buffer);
+	_TIFFfree(file.data);
+	return 0;
+
+error:
+	if (tif != NULL)
+		TIFFClose(tif);
+	if (buffer != NULL)
+		_TIFFfree(buffer);
+	if (file.data != NULL)
+		_TIFFfree(file.data);
+	return -1;
+}
+
+static int
+encode_strip(const pageout_page *page, uint32 y, uint32 rows, uint8 **data, uint32 *size)
+{
+	if (page->bitspersample == 8)
+		return encode_strip_lzw(page, y, rows, data, size);
+	return encode_strip_g4(page, y, rows, data, size);
+}
+
+static pageout_encoded *
+encoded_alloc(const pageout_page *page)
+{
+	pageout_encoded *encoded;
+
+	encoded = _TIFFmalloc(sizeof(pageout_encoded));
+	if (encoded == NULL)
+		return NULL;
+	encoded->page = *page;
+	encoded->page.pixels = NULL;
+	encoded->page.fill = NULL;
+	encoded->page.param = NULL;
+	encoded->rowsperstrip = (pageout_strip_rows != 0 && pageout_strip_rows < page->length) ? pageout_strip_rows : page->length;
+	encoded->stripcount = (encoded->rowsperstrip != 0) ? (page->length + encoded->rowsperstrip - 1) / encoded->rowsperstrip : 0;
+	encoded->stripdata = _TIFFmalloc((encoded->stripcount + 1) * sizeof(uint8 *));
+	encoded->stripsize = _TIFFmalloc((encoded->stripcount + 1) * sizeof(uint32));
+	if (encoded->stripdata != NULL)
+		memset(encoded->stripdata, 0, (encoded->stripcount + 1) * sizeof(uint8 *));
+	if (encoded->stripdata == NULL || encoded->stripsize == NULL)
+	{
+		fprintf(stderr, "pageout_encode_page: Out of memory allocating %d strips\n", encoded->stripcount);
+		pageout_encoded_free(encoded);
+		return NULL;
+	}
+	return encoded;
+}
+
+void
+pageout_encoded_free(pageout_encoded *encoded)
+{
+	uint32 strip;
+
+	if (encoded->stripdata != NULL)
+	{
+		for (strip = 0; strip < encoded->stripcount; strip++)
+			if (encoded->stripdata[strip] != NULL)
+				_TIFFfree(encoded->stripdata[strip]);
+		_TIFFfree(encoded->stripdata);
+	}
+	if (encoded->stripsize != NULL)
+		_TIFFfree(encoded->stripsize);
+	_TIFFfree(encoded);
+}
+
+typedef struct strip_worker_data strip_worker_data;
+struct strip_worker_data
+{
+	const pageout_page *page;
+	pageout_encoded *encoded;
+	volatile LONG *nextstrip;
+	volatile LONG *failed;
+	HANDLE		event;
+};
+
+/* pull strips off the shared counter until they are all taken */
+static void
+encode_strips(strip_worker_data *data)
+{
+	const pageout_page *page = data->page;
+	pageout_encoded *encoded = data->encoded;
+	uint32 strip, y;
+
+	while ((strip = (uint32)InterlockedIncrement(data->nextstrip) - 1) < encoded->stripcount)
+	{
+		y = strip * encoded->rowsperstrip;
+		if (encode_strip(page, y, (page->length - y < encoded->rowsperstrip) ? (page->length - y) : encoded->rowsperstrip,
+				&encoded->stripdata[strip], &encoded->stripsize[strip]) != 0)
+			InterlockedExchange(data->failed, 1);
+	}
+}
+
+static DWORD WINAPI
+strip_worker(LPVOID param)
+{
+	strip_worker_data *data = param;
+
+	encode_strips(data);
+	SetEvent(data->event);
+	return 0;
+}
+
+/* encode the strips of a page with up to workercount threads, ourselves included */
+static pageout_encoded *
+encode_page(const pageout_page *page, int workercount)
+{
+	strip_worker_data workers[MAX_STRIP_WORKERS];
+	volatile LONG nextstrip = 0, failed = 0;
+	pageout_encoded *encoded;
+	int worker;
+
+	encoded = encoded_alloc(page);
+	if (encoded == NULL)
+		return NULL;
+
+	/* each worker takes the next strip that nobody has started */
+	if (workercount > MAX_STRIP_WORKERS)
+		workercount = MAX_STRIP_WORKERS;
+	if (workercount > (int)encoded->stripcount)
+		workercount = (int)encoded->stripcount;
+	for (worker = 0; worker < workercount; worker++)
+	{
+		workers[worker].page = page;
+		workers[worker].encoded = encoded;
+		workers[worker].nextstrip = &nextstrip;
+		workers[worker].failed = &failed;
+		workers[worker].event = NULL;
+		if (worker != 0)
+		{
+			workers[worker].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			QueueUserWorkItem(strip_worker, &workers[worker], WT_EXECUTEDEFAULT);
+		}
+	}
+	if (workercount > 0)
+		encode_strips(&workers[0]);
+	for (worker = 1; worker < workercount; worker++)
+	{
+		WaitForSingleObject(workers[worker].event, INFINITE);
+		CloseHandle(workers[worker].event);
+	}
+	if (failed)
+	{
+		fprintf(stderr, "pageout_encode_page: Unable to encode strips\n");
+		pageout_encoded_free(encoded);
+		return NULL;
+	}
+	return encoded;
+}
+
+pageout_encoded *
+pageout_encode_page(const pageout_page *page)
+{
+	/* the callers are already running a page per thread */
+	return encode_page(page, 1);
+}
+
+pageout_encoded *
+pageout_encode_page_parallel(const pageout_page *page)
+{
+	SYSTEM_INFO sysinfo;
+
+	GetSystemInfo(&sysinfo);
+	return encode_page(page, (int)sysinfo.dwNumberOfProcessors);
+}
+
+int
+pageout_write_encoded(TIFF *out, const pageout_encoded *encoded)
+{
+	uint32 strip;
+
+	/* the strips are already compressed, so they go out raw and in order */
+	set_page_tags(out, &encoded->page, encoded->rowsperstrip);
+	for (strip = 0; strip < encoded->stripcount; strip++)
+		if (TIFFWriteRawStrip(out, strip, (tdata_t)encoded->stripdata[strip], encoded->stripsize[strip]) < 0)
+			return -1;
+	return (TIFFWriteDirectory(out) == 0) ? -1 : 0;
+}
+
+int
+pageout_write_page(TIFF *out, const pageout_page *page)
+{
+	pageout_encoded *encoded;
+	int result;
+
+	if (page->length == 0)
+	{
+		set_page_tags(out, page, page->length);
+		return (TIFFWriteDirectory(out) == 0) ? -1 : 0;
+	}
+
+	/* encode the strips on one worker per processor, then write them */
+	encoded = pageout_encode_page_parallel(page);
+	if (encoded == NULL)
+		return -1;
+	result = pageout_write_encoded(out, encoded);
+	pageout_encoded_free(encoded);
+	return result;
+}
+
+struct pageout_file
+{
+	TIFF *		tiff;
+	FILE *		pdf;
+	uint32		objects;
+	long *		offsets;
+	uint32		offsetcapacity;
+	uint32 *	pages;
+	uint32		pagecount;
+	uint32		pagecapacity;
+};
+
+/* PDF objects 1 and 2 are the page tree and the catalog, which are written last */
+#define PDF_PAGES_OBJECT	1
+#define PDF_CATALOG_OBJECT	2
+
+/* page resolutions outside this range (in dpi) are treated as missing */
+#define PDF_MIN_DPI			1.0
+#define PDF_MAX_DPI			100000.0
+
+/* bytes per line of the content stream; a line with every number at its widest fits with room to spare */
+#define PDF_CONTENT_LINE	128
+
+static int
+has_pdf_extension(const char *name)
+{
+	size_t length = strlen(name);
+
+	return length >= 4 && name[length - 4] == '.' && tolower(name[length - 3]) == 'p' &&
+		tolower(name[length - 2]) == 'd' && tolower(name[length - 1]) == 'f';
+}
+
+/* start object number, or the next free one if number is 0 */
+static uint32
+pdf_begin_object(pageout_file *file, uint32 number)
+{
+	uint32 capacity;
+	long *offsets;
+
+	if (number == 0)
+		number = ++file->objects;
+	if (number >= file->offsetcapacity)
+	{
+		for (capacity = file->offsetcapacity ? file->offsetcapacity * 2 : 256; capacity <= number; capacity *= 2)
+			;
+		offsets = _TIFFrealloc(file->offsets, capacity * sizeof(long));
+		if (offsets == NULL)
+			return 0;
+		memset(offsets + file->offsetcapacity, 0, (capacity - file->offsetcapacity) * sizeof(long));
+		file->offsets = offsets;
+		file->offsetcapacity = capacity;
+	}
+	file->offsets[number] = ftell(file->pdf);
+	fprintf(file->pdf, "%u 0 obj\n", number);
+	return number;
+}
+
+/* points per pixel from a resolution tag, treating a missing or nonsensical one as 72 dpi */
+static double
+pdf_points_per_pixel(float resolution, uint16 resunit)
+{
+	double dpi = (resunit == RESUNIT_CENTIMETER) ? resolution * 2.54 : resolution;
+
+	/* written this way round so a NaN fails too */
+	if (!(dpi >= PDF_MIN_DPI && dpi <= PDF_MAX_DPI))
+		return 1.0;
+	return 72.0 / dpi;
+}
+
+/* each strip becomes an image XObject whose stream is the strip as is; the page draws them top to bottom */
+static int
+pdf_append(pageout_file *file, const pageout_encoded *encoded)
+{
+	const pageout_page *page = &encoded->page;
+	double xscale = pdf_points_per_pixel(page->xres, page->resunit);
+	double yscale = pdf_points_per_pixel(page->yres, page->resunit);
+	uint32 firstimage, strip, rows, y, number, content;
+	uint32 *pages;
+	char *text;
+	size_t length, capacity;
+	int count;
+
+	firstimage = file->objects + 1;
+	for (strip = 0, y = 0; strip < encoded->stripcount; strip++, y += rows)
+	{
+		rows = (page->length - y < encoded->rowsperstrip) ? (page->length - y) : encoded->rowsperstrip;
+		if (pdf_begin_object(file, 0) == 0)
+			return -1;
+		fprintf(file->pdf, "<< /Type /XObject /Subtype /Image /Width %u /Height %u /ColorSpace /DeviceGray ", page->width, rows);
+		if (page->bitspersample == 8)
+			fprintf(file->pdf, "/BitsPerComponent 8 /Decode [1 0] /Filter /LZWDecode ");
+		else
+			fprintf(file->pdf, "/BitsPerComponent 1 /Filter /CCITTFaxDecode /DecodeParms << /K -1 /Columns %u /Rows %u >> ", page->width, rows);
+		fprintf(file->pdf, "/Length %u >>\nstream\n", encoded->stripsize[strip]);
+		if (fwrite(encoded->stripdata[strip], 1, encoded->stripsize[strip], file->pdf) != encoded->stripsize[strip])
+			return -1;
+		fprintf(file->pdf, "\nendstream\nendobj\n");
+	}
+
+	/* the content stream places the strips; PDF's origin is the bottom left */
+	capacity = encoded->stripcount * PDF_CONTENT_LINE + 1;
+	text = _TIFFmalloc(capacity);
+	if (text == NULL)
+		return -1;
+	length = 0;
+	for (strip = 0, y = 0; strip < encoded->stripcount; strip++, y += rows)
+	{
+		rows = (page->length - y < encoded->rowsperstrip) ? (page->length - y) : encoded->rowsperstrip;
+		count = snprintf(text + length, capacity - length, "q %.4f 0 0 %.4f 0 %.4f cm /I%u Do Q\n",
+			page->width * xscale, rows * yscale, (page->length - y - rows) * yscale, strip);
+		if (count < 0 || (size_t)count >= capacity - length)
+		{
+			_TIFFfree(text);
+			return -1;
+		}
+		length += count;
+	}
+	content = pdf_begin_object(file, 0);
+	if (content == 0)
+	{
+		_TIFFfree(text);
+		return -1;
+	}
+	fprintf(file->pdf, "<< /Length %u >>\nstream\n%s\nendstream\nendobj\n", (uint32)length, text);
+	_TIFFfree(text);
+
+	number = pdf_begin_object(file, 0);
+	if (number == 0)
+		return -1;
+	fprintf(file->pdf, "<< /Type /Page /Parent %u 0 R /MediaBox [0 0 %.4f %.4f] /Contents %u 0 R /Resources << /XObject <<",
+		PDF_PAGES_OBJECT, page->width * xscale, page->length * yscale, content);
+	for (strip = 0; strip < encoded->stripcount; strip++)
+		fprintf(file->pdf, " /I%u %u 0 R", strip, firstimage + strip);
+	fprintf(file->pdf, " >> >> >>\nendobj\n");
+
+	if (file->pagecount == file->pagecapacity)
+	{
+		pages = _TIFFrealloc(file->pages, (file->pagecapacity ? file->pagecapacity * 2 : 64) * sizeof(uint32));
+		if (pages == NULL)
+			return -1;
+		file->pages = pages;
+		file->pagecapacity = file->pagecapacity ? file->pagecapacity * 2 : 64;
+	}
+	file->pages[file->pagecount++] = number;
+	return ferror(file->pdf) ? -1 : 0;
+}
+
+static int
+pdf_finish(pageout_file *file)
+{
+	uint32 page, number;
+	long xref;
+
+	if (pdf_begin_object(file, PDF_PAGES_OBJECT) == 0)
+		return -1;
+	fprintf(file->pdf, "<< /Type /Pages /Count %u /Kids [", file->pagecount);
+	for (page = 0; page < file->pagecount; page++)
+		fprintf(file->pdf, "%s%u 0 R", (page % 10 == 0) ? "\n" : " ", file->pages[page]);
+	fprintf(file->pdf, " ] >>\nendobj\n");
+	if (pdf_begin_object(file, PDF_CATALOG_OBJECT) == 0)
+		return -1;
+	fprintf(file->pdf, "<< /Type /Catalog /Pages %u 0 R >>\nendobj\n", PDF_PAGES_OBJECT);
+
+	xref = ftell(file->pdf);
+	fprintf(file->pdf, "xref\n0 %u\n0000000000 65535 f \n", file->objects + 1);
+	for (number = 1; number <= file->objects; number++)
+		fprintf(file->pdf, "%010ld 00000 n \n", file->offsets[number]);
+	fprintf(file->pdf, "trailer\n<< /Size %u /Root %u 0 R >>\nstartxref\n%ld\n%%%%EOF\n", file->objects + 1, PDF_CATALOG_OBJECT, xref);
+	return ferror(file->pdf) ? -1 : 0;
+}
+
+pageout_file *
+pageout_open(const char *name)
+{
+	pageout_file *file;
+
+	file = _TIFFmalloc(sizeof(pageout_file));
+	if (file == NULL)
+		return NULL;
+	memset(file, 0, sizeof(pageout_file));
+	if (has_pdf_extension(name))
+	{
+		file->pdf = fopen(name, "wb");
+		if (file->pdf != NULL)
+		{
+			file->objects = PDF_CATALOG_OBJECT;
+			fprintf(file->pdf, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n");
+			return file;
+		}
+	}
+	else
+	{
+		file->tiff = TIFFOpen(name, "w");
+		if (file->tiff != NULL)
+			return file;
+	}
+	_TIFFfree(file);
+	return NULL;
+}
+
+int
+pageout_append(pageout_file *file, const pageout_encoded *encoded)
+{
+	if (file->pdf != NULL)
+		return pdf_append(file, encoded);
+	return pageout_write_encoded(file->tiff, encoded);
+}
+
+int
+pageout_close(pageout_file *file)
+{
+	int result = 0;
+
+	if (file->pdf != NULL)
+	{
+		result = pdf_finish(file);
+		if (fclose(file->pdf) != 0)
+			result = -1;
+	}
+	else
+		TIFFClose(file->tiff);
+	if (file->offsets != NULL)
+		_TIFFfree(file->offsets);
+	if (file->pages != NULL)
+		_TIFFfree(file->pages);
+	_TIFFfree(file);
+	return result;
+}
@@ -0,0 +1,70 @@
+#ifndef PAGEOUT_H
+#define PAGEOUT_H
+
+#include "tiffio.h"
+
+/* one page to write as a directory: 1-bit pages are CCITT G4 (MSB-first, black = 1), 8-bit gray pages are LZW */
+typedef struct pageout_page pageout_page;
+struct pageout_page
+{
+	uint32		width;
+	uint32		length;
+	uint16		bitspersample;
+	uint16		orientation;
+	float		xres;
+	float		yres;
+	uint16		resunit;
+
+	/* rows come straight from pixels if it is set; otherwise fill renders rows y..y+rows-1 into cleared rows of (width * bitspersample + 7) / 8 bytes */
+	const uint8 *pixels;
+	uint32		rowbytes;
+	void		(*fill)(const void *param, uint32 y, uint32 rows, uint8 *dst);
+	const void *param;
+};
+
+/* a page whose strips are already compressed; page supplies the tags, its pixels and fill are no longer used */
+typedef struct pageout_encoded pageout_encoded;
+struct pageout_encoded
+{
+	pageout_page page;
+	uint32		rowsperstrip;
+	uint32		stripcount;
+	uint8 **	stripdata;
+	uint32 *	stripsize;
+};
+
+/* an output file of encoded pages: a PDF if the name ends in .pdf, otherwise a multi-page TIFF */
+typedef struct pageout_file pageout_file;
+pageout_file *pageout_open(const char *name);
+int pageout_append(pageout_file *file, const pageout_encoded *encoded);
+
+/* finish and close the file; a PDF only gets its page tree and cross-reference table here */
+int pageout_close(pageout_file *file);
+
+/* a CCITT G4 encoder fed one row at a time, either packed or as the list of positions where the color
+   flips (starting from white, in increasing order); the output is byte for byte what libtiff writes */
+typedef struct pageout_g4 pageout_g4;
+pageout_g4 *pageout_g4_begin(uint32 width);
+int pageout_g4_row(pageout_g4 *g4, const uint8 *row);
+int pageout_g4_changes(pageout_g4 *g4, const uint32 *changes, uint32 count);
+
+/* finish the strip and free the encoder; returns the strip for _TIFFfree, or NULL if anything failed */
+uint8 *pageout_g4_end(pageout_g4 *g4, uint32 *size);
+
+/* rows per strip; 0 keeps each page in a single strip */
+extern uint32 pageout_strip_rows;
+
+/* write a page and its directory; with strips, they are encoded in parallel and written raw in order */
+int pageout_write_page(TIFF *out, const pageout_page *page);
+
+/* compress a page on this thread so that it can be written later by whichever thread owns the file */
+pageout_encoded *pageout_encode_page(const pageout_page *page);
+
+/* the same, but with the strips spread over one worker per processor as pageout_write_page does */
+pageout_encoded *pageout_encode_page_parallel(const pageout_page *page);
+
+/* append an encoded page and its directory; this is just I/O */
+int pageout_write_encoded(TIFF *out, const pageout_encoded *encoded);
+void pageout_encoded_free(pageout_encoded *encoded);
+
+#endif
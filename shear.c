@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bitkernels.h"
+#include "shear.h"
+
+typedef struct shear_segment shear_segment;
+struct shear_segment
+{
+	uint32		word;
+	long		dy;
+	uint64		mask;
+};
+
+static long
+round_shear(double value)
+{
+	return (long)floor(value);
+}
+
+int
+shear_rotate(uint8 *dst, const uint8 *src, uint32 width, uint32 length, uint32 rowbytes, double angle)
+{
+	double radians = angle * M_PI / 180.0;
+	double sinval = sin(radians);
+	double shearx1, sheary, shearx2;
+	long centerx = width / 2;
+	long centery = length / 2;
+	uint32 size = (width > length) ? width : length;
+	uint32 srcwords = (rowbytes + 7) / 8;
+	uint32 pad, padwidth, rowwords, segcount, x;
+	shear_segment *segment = NULL;
+	uint64 *pass1 = NULL;
+	uint64 *pass2 = NULL;
+	uint64 *rowbuf = NULL;
+	int result = -1;
+	long y;
+
+	/* source = Sx(a) * Sy(b) * Sx(a) * dest, with a = tan(angle/2) and b = -sin(angle); for small angles,
+	   Sx(sin) * Sy(-sin) is within half a pixel of a true rotation and saves a pass */
+	if (sinval * sinval * size < 2.0)
+		shearx1 = sinval, sheary = -sinval, shearx2 = 0.0;
+	else
+		shearx1 = shearx2 = tan(radians / 2.0), sheary = -sinval;
+
+	/* the intermediate passes need room for rows sheared off either side */
+	pad = (uint32)ceil(fabs(shearx1) * (length - centery)) + 1;
+	padwidth = width + 2 * pad;
+	rowwords = (padwidth + 63) / 64;
+
+	/* allocate memory for the intermediate images and column segments */
+	pass1 = _TIFFmalloc(length * rowwords * sizeof(uint64));
+	pass2 = _TIFFmalloc(length * rowwords * sizeof(uint64));
+	rowbuf = _TIFFmalloc((rowwords + srcwords) * sizeof(uint64));
+	segment = _TIFFmalloc((rowwords + padwidth) * sizeof(shear_segment));
+	if (pass1 == NULL || pass2 == NULL || rowbuf == NULL || segment == NULL)
+	{
+		fprintf(stderr, "shear_rotate: Out of memory allocating shear buffers\n");
+		goto done;
+	}
+
+	/* pass 1: shift each row horizontally into the padded image */
+	for (y = 0; y < length; y++)
+	{
+		row_load_words(rowbuf, src + y * rowbytes, rowbytes);
+		bits->shift_words(pass1 + y * rowwords, rowwords, rowbuf, srcwords, round_shear(shearx1 * (y - centery)) - pad);
+	}
+
+	/* pass 2: shift each column vertically; break each word into segments of columns sharing the same shift */
+	segcount = 0;
+	for (x = 0; x < padwidth; x++)
+	{
+		long dy = round_shear(sheary * ((long)x - (long)pad - centerx));
+		if (x % 64 == 0 || segment[segcount - 1].dy != dy)
+		{
+			segment[segcount].word = x / 64;
+			segment[segcount].mask = 0;
+			segment[segcount].dy = dy;
+			segcount++;
+		}
+		segment[segcount - 1].mask |= (uint64)1 << (63 - x % 64);
+	}
+	for (y = 0; y < length; y++)
+	{
+		uint64 *dstwords = pass2 + y * rowwords;
+		uint32 seg;
+
+		memset(dstwords, 0, rowwords * sizeof(uint64));
+		for (seg = 0; seg < segcount; seg++)
+		{
+			long srcy = y + segment[seg].dy;
+			if (srcy >= 0 && srcy < length)
+				dstwords[segment[seg].word] |= pass1[srcy * rowwords + segment[seg].word] & segment[seg].mask;
+		}
+	}
+
+	/* pass 3: shift each row horizontally back out of the padded image */
+	for (y = 0; y < length; y++)
+	{
+		uint8 *dstrow = dst + y * rowbytes;
+
+		bits->shift_words(rowbuf, srcwords, pass2 + y * rowwords, rowwords, round_shear(shearx2 * (y - centery)) + pad);
+		row_store_words(dstrow, rowbuf, rowbytes);
+		if (width % 8 != 0)
+			dstrow[rowbytes - 1] &= 0xff00 >> (width % 8);
+	}
+	result = 0;
+
+done:
+	if (segment != NULL)
+		_TIFFfree(segment);
+	if (rowbuf != NULL)
+		_TIFFfree(rowbuf);
+	if (pass2 != NULL)
+		_TIFFfree(pass2);
+	if (pass1 != NULL)
+		_TIFFfree(pass1);
+	return result;
+}
+
+uint32
+shear_stray_pixels(const uint8 *row, const uint8 *const ref[3], uint32 bytes, uint8 *scratch)
+{
+	uint32 i, r, prev, near;
+
+	/* spread ref by a pixel each way, vertically then horizontally */
+	memset(scratch, 0, bytes);
+	for (r = 0; r < 3; r++)
+		if (ref[r] != NULL)
+			bits->row_or(scratch, ref[r], bytes);
+
+	/* keep the row's pixels that the spread ref doesn't cover; each byte borrows its neighbors' edge bits */
+	prev = 0;
+	for (i = 0; i < bytes; i++)
+	{
+		near = scratch[i] | (scratch[i] << 1) | (scratch[i] >> 1) | (prev << 7);
+		if (i + 1 < bytes)
+			near |= scratch[i + 1] >> 7;
+		prev = scratch[i];
+		scratch[i] = row[i] & ~near;
+	}
+	return bits->popcount(scratch, bytes);
+}
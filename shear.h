@@ -0,0 +1,17 @@
+#ifndef SHEAR_H
+#define SHEAR_H
+
+#include "tiffio.h"
+
+/* default for -t: the fraction of black pixels the shear rotation may get visibly wrong before falling back to sampling */
+#define SHEAR_DEFAULT_TOLERANCE 0.02
+
+/* rotate a 1-bit page about its center with three shears (two for small angles); src and dst are both
+   width x length with rowbytes per row, MSB-first, black = 1; returns 0, or -1 if out of memory */
+int shear_rotate(uint8 *dst, const uint8 *src, uint32 width, uint32 length, uint32 rowbytes, double angle);
+
+/* count the pixels set in row with nothing set within one pixel of them in ref, the three rows around it
+   (NULL for rows off the page); scratch holds bytes bytes */
+uint32 shear_stray_pixels(const uint8 *row, const uint8 *const ref[3], uint32 bytes, uint8 *scratch);
+
+#endif
@@ -10,8 +10,11 @@
 #endif
 
 #include <windows.h>
+#include <psapi.h>
 
 #include "tiffio.h"
+#include "bitkernels.h"
+#include "pageout.h"
 
 typedef struct bilevel_image bilevel_image;
 struct bilevel_image
@@ -23,10 +26,42 @@ struct bilevel_image
 	float	xres;
 	float	yres;
 	uint16	resunit;
+	uint16	bitspersample;
 	uint16	rowbytes;
+	uint32	capacity;
 	uint8	pixels[1];
 };
 
+typedef struct bilevel_profile bilevel_profile;
+struct bilevel_profile
+{
+	uint32	width;
+	uint32	length;
+	uint32	*rows;
+	uint32	*columns;
+};
+
+typedef struct bilevel_view bilevel_view;
+struct bilevel_view
+{
+	const bilevel_image *parent;
+	long	left;
+	long	top;
+	uint32	width;
+	uint32	length;
+};
+
+typedef struct worker_progress worker_progress;
+struct worker_progress
+{
+	volatile LONG	sequence;
+	volatile uint32	stage;
+	volatile uint32	total;
+	volatile long	arg;
+	volatile uint32	value;
+	char		message[100];
+};
+
 typedef struct image_worker_data image_worker_data;
 struct image_worker_data
 {
@@ -44,22 +79,42 @@ struct image_worker_data
 	volatile uint32 done;
 	volatile uint32 error;
 	bilevel_image *target;
+	int			finalindex;
 	int			lefthalf;
-	char 		status[100];
+	worker_progress progress;
 };
 
 static CRITICAL_SECTION critsect;
+static DWORD spareslot = TLS_OUT_OF_INDEXES;
+static uint32 *rgbabuffer = NULL;
+static uint32 rgbabuffersize = 0;
 static HANDLE event;
 
 static image_worker_data *workerlist = NULL;
 static int workercount = 0;
 
 static float target_resolution = 600;
+static int area_threshold = 0;
+static int gray_output = 0;
 static uint32 targetwidth = 0;
 static uint32 targetlength = 0;
 
 static int single_sided = 0;
 
+/* progress stages, indexing stage_text */
+#define STAGE_LOADING			0
+#define STAGE_WAITING			1
+#define STAGE_CROPPING			2
+#define STAGE_SCALING			3
+#define STAGE_ENCODING			4
+#define STAGE_DONE				5
+#define STAGE_MESSAGE			6
+
+static const char *stage_text[] =
+{
+	"Loading...", "Waiting...", "Cropping...", "Scaling...", "Encoding...", "Done", ""
+};
+
 static uint32 crop_top = ~0;
 static uint32 crop_bottom = ~0;
 static uint32 crop_left = ~0;
@@ -68,32 +123,72 @@ static int load_count;
 
 static int pagecount;
 static bilevel_image **finalpage;
+static pageout_encoded **encodedpage;
+static volatile LONG *pagewriters;
 
-static const uint8 popcount[256] =
-{
-	0,1,1,2,1,2,2,3, 1,2,2,3,2,3,3,4,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	4,5,5,6,5,6,6,7, 5,6,6,7,6,7,7,8
-};
 	
 static	void usage(void);
 
 #define FACTOR(val, size)  ((val < size / 6 || val > 5 * size / 6) ? 1 : 3)
 
+static void
+progress_set(worker_progress *progress, uint32 stage, uint32 total, long arg)
+{
+	/* an odd sequence number tells the reporter an update is under way */
+	InterlockedIncrement(&progress->sequence);
+	progress->stage = stage;
+	progress->total = total;
+	progress->arg = arg;
+	progress->value = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_stage(worker_progress *progress, uint32 stage)
+{
+	progress_set(progress, stage, 0, 0);
+}
+
+static void
+progress_update(worker_progress *progress, uint32 value)
+{
+	/* a single aligned store, cheap enough for inner loops; the reporter reads it unlocked */
+	if (progress != NULL)
+		progress->value = value;
+}
+
+static void
+progress_message(worker_progress *progress, const char *format, va_list args)
+{
+	InterlockedIncrement(&progress->sequence);
+	vsnprintf(progress->message, sizeof(progress->message), format, args);
+	progress->stage = STAGE_MESSAGE;
+	progress->total = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_read(const worker_progress *progress, worker_progress *copy)
+{
+	LONG sequence;
+	
+	/* retry until no update overlapped our copy */
+	do
+	{
+		sequence = progress->sequence;
+		MemoryBarrier();
+		copy->stage = progress->stage;
+		copy->total = progress->total;
+		copy->arg = progress->arg;
+		memcpy(copy->message, progress->message, sizeof(copy->message));
+		MemoryBarrier();
+	} while ((sequence & 1) != 0 || sequence != progress->sequence);
+	copy->message[sizeof(copy->message) - 1] = 0;
+	copy->value = progress->value;
+	if (copy->value > copy->total)
+		copy->value = copy->total;
+}
+
 static void
 warning_handler(const char *module, const char *format, va_list args)
 {
@@ -124,7 +219,7 @@ warning_handler_ext(thandle_t handle, const char *module, const char *format, va
 	/* if we found one, output a warning */
 //	if (worker != NULL)
 //		printf(format, args);
-//		vsnprintf(worker->status, sizeof(worker->status), format, args);
+//		progress_message(&worker->progress, format, args);
 }
 
 static void
@@ -145,7 +240,7 @@ error_handler_ext(thandle_t handle, const char *module, const char *format, va_l
 	/* if we found one, output an error */
 	if (worker != NULL)
 //		printf(format, args);
-		vsnprintf(worker->status, sizeof(worker->status), format, args);
+		progress_message(&worker->progress, format, args);
 }
 
 static bilevel_image *
@@ -153,6 +248,7 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 {
 	uint16 rowbytes = (width + 7) / 8;
 	bilevel_image *image;
+	uint32 capacity;
 	
 	/* borrow width/length from clone if not specified */
 	if (clonefrom != NULL)
@@ -161,17 +257,35 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 		if (length == 0) length = clonefrom->length;
 	}
 	
-	/* allocate memory for the image */
+	/* reuse this thread's spare image if it's big enough, otherwise allocate memory for the image */
 	rowbytes = (width + 7) / 8;
-	image = _TIFFmalloc(sizeof(*image) + length * rowbytes);
-	if (image == NULL)
-		return NULL;
+	image = (spareslot != TLS_OUT_OF_INDEXES) ? TlsGetValue(spareslot) : NULL;
+	if (image != NULL)
+	{
+		TlsSetValue(spareslot, NULL);
+		if (image->capacity < length * rowbytes)
+		{
+			_TIFFfree(image);
+			image = NULL;
+		}
+	}
+	if (image != NULL)
+		capacity = image->capacity;
+	else
+	{
+		capacity = length * rowbytes;
+		image = _TIFFmalloc(sizeof(*image) + capacity);
+		if (image == NULL)
+			return NULL;
+	}
 	
 	/* clear to 0 and fill in the basics */
 	memset(image, 0, sizeof(*image) + length * rowbytes);
 	image->width = width;
 	image->length = length;
+	image->bitspersample = 1;
 	image->rowbytes = rowbytes;
+	image->capacity = capacity;
 	
 	/* clone remaining fields */
 	if (clonefrom != NULL)
@@ -188,73 +302,170 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 static void
 bilevel_image_free(bilevel_image *image)
 {
-	_TIFFfree(image);
+	bilevel_image *spare;
+	
+	/* keep the larger of this and the current spare around for the next stage on this thread */
+	if (spareslot != TLS_OUT_OF_INDEXES && image != NULL)
+	{
+		spare = TlsGetValue(spareslot);
+		if (spare == NULL || spare->capacity < image->capacity)
+		{
+			TlsSetValue(spareslot, image);
+			image = spare;
+		}
+	}
+	if (image != NULL)
+		_TIFFfree(image);
 }
 
+/* free this thread's spare; it only pays off between the stages of one page, and a pool thread
+   may not see another page for a long time */
 static void
-bilevel_image_compute_margins(const bilevel_image *image, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+bilevel_image_release_spare(void)
 {
-	uint32 x, y;
+	bilevel_image *spare;
 	
-	/* trim the top */
-	if (top != NULL)
-		for (*top = 0; *top < image->length; *top += 1)
-		{
-			const uint8 *src = image->pixels + *top * image->rowbytes;
-			uint32 pop = 0;
-
-			for (x = 0; x < image->width; x += 8)
-				pop += popcount[*src++];
-			if (pop * 1000 > image->width)
-				break;
-		}
-
-	/* trim the bottom */
-	if (bottom != NULL)
-		for (*bottom = 0; *bottom < image->length; *bottom += 1)
-		{
-			const uint8 *src = image->pixels + (image->length - 1 - *bottom) * image->rowbytes;
-			uint32 pop = 0;
+	if (spareslot != TLS_OUT_OF_INDEXES)
+	{
+		spare = TlsGetValue(spareslot);
+		TlsSetValue(spareslot, NULL);
+		if (spare != NULL)
+			_TIFFfree(spare);
+	}
+}
 
-			for (x = 0; x < image->width; x += 8)
-				pop += popcount[*src++];
-			if (pop * 1000 > image->width)
-				break;
-		}
+static bilevel_profile *
+bilevel_image_profile(const bilevel_image *image)
+{
+	bilevel_profile *profile;
+	uint64 spread[256];
+	uint64 *lanes;
+	uint32 x, y, k, rowsleft;
 	
-	/* trim the left */
-	if (left != NULL)
-		for (*left = 0; *left < image->width; *left += 1)
+	/* allocate the profile with both histograms in one block, plus a word of 8 byte-wide column counters per source byte */
+	profile = _TIFFmalloc(sizeof(*profile) + (image->length + image->rowbytes * 8) * sizeof(uint32));
+	lanes = _TIFFmalloc(image->rowbytes * sizeof(uint64));
+	if (profile == NULL || lanes == NULL)
+	{
+		fprintf(stderr, "bilevel_image_profile: Out of memory allocating profile for %dx%d\n", image->width, image->length);
+		if (profile != NULL)
+			_TIFFfree(profile);
+		if (lanes != NULL)
+			_TIFFfree(lanes);
+		return NULL;
+	}
+	profile->width = image->width;
+	profile->length = image->length;
+	profile->rows = (uint32 *)(profile + 1);
+	profile->columns = profile->rows + image->length;
+	memset(profile->columns, 0, image->rowbytes * 8 * sizeof(uint32));
+	memset(lanes, 0, image->rowbytes * sizeof(uint64));
+	
+	/* spread[b] puts each bit of b in its own byte, leftmost pixel lowest */
+	for (x = 0; x < 256; x++)
+		for (spread[x] = 0, k = 0; k < 8; k++)
+			if (x & (0x80 >> k))
+				spread[x] |= (uint64)1 << (8 * k);
+	
+	/* one row-major pass: popcount each row for its total and add its bits to the column counters */
+	rowsleft = 255;
+	for (y = 0; y < image->length; y++)
+	{
+		const uint8 *src = image->pixels + y * image->rowbytes;
+		
+		profile->rows[y] = bits->popcount(src, image->rowbytes);
+		for (x = 0; x < image->rowbytes; x++)
 		{
-			const uint8 *src = image->pixels + *left / 8;
-			int shift = 7 - (*left % 8);
-			uint32 pop = 0;
-			
-			for (y = 0; y < image->length; y++)
+			/* skip white a word at a time */
+			if (x % 8 == 0 && x + 8 <= image->rowbytes)
 			{
-				pop += (*src >> shift) & 1;
-				src += image->rowbytes;
+				uint64 word;
+				memcpy(&word, src + x, sizeof(word));
+				if (word == 0)
+				{
+					x += 7;
+					continue;
+				}
 			}
-			if (pop * 1000 > image->length)
-				break;
+			lanes[x] += spread[src[x]];
 		}
+		
+		/* the byte counters would overflow after 255 rows, so empty them into the column totals first */
+		if (--rowsleft == 0 || y == image->length - 1)
+		{
+			for (x = 0; x < image->rowbytes; x++)
+				if (lanes[x] != 0)
+				{
+					for (k = 0; k < 8; k++)
+						profile->columns[x * 8 + k] += (uint32)(lanes[x] >> (8 * k)) & 0xff;
+					lanes[x] = 0;
+				}
+			rowsleft = 255;
+		}
+	}
+	_TIFFfree(lanes);
+	return profile;
+}
 
-	/* trim the right */
+static void
+bilevel_profile_free(bilevel_profile *profile)
+{
+	_TIFFfree(profile);
+}
+
+static void
+bilevel_profile_margins(const bilevel_profile *profile, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+{
+	/* a row or column is content once more than 0.1% of it is black */
+	if (top != NULL)
+		for (*top = 0; *top < profile->length; *top += 1)
+			if (profile->rows[*top] * 1000 > profile->width)
+				break;
+	if (bottom != NULL)
+		for (*bottom = 0; *bottom < profile->length; *bottom += 1)
+			if (profile->rows[profile->length - 1 - *bottom] * 1000 > profile->width)
+				break;
+	if (left != NULL)
+		for (*left = 0; *left < profile->width; *left += 1)
+			if (profile->columns[*left] * 1000 > profile->length)
+				break;
 	if (right != NULL)
-		for (*right = 0; *right < image->width; *right += 1)
-		{
-			const uint8 *src = image->pixels + (image->width - 1 - *right) / 8;
-			int shift = 7 - ((image->width - 1 - *right) % 8);
-			uint32 pop = 0;
-			
-			for (y = 0; y < image->length; y++)
-			{
-				pop += (*src >> shift) & 1;
-				src += image->rowbytes;
-			}
-			if (pop * 1000 > image->length)
+		for (*right = 0; *right < profile->width; *right += 1)
+			if (profile->columns[profile->width - 1 - *right] * 1000 > profile->length)
 				break;
-		}
+}
+
+static void
+bilevel_image_compute_margins(const bilevel_image *image, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+{
+	bilevel_profile *profile;
+	
+	/* all four margins come from the row and column profiles */
+	profile = bilevel_image_profile(image);
+	if (profile == NULL)
+	{
+		if (top != NULL) *top = 0;
+		if (left != NULL) *left = 0;
+		if (right != NULL) *right = 0;
+		if (bottom != NULL) *bottom = 0;
+		return;
+	}
+	bilevel_profile_margins(profile, top, left, right, bottom);
+	bilevel_profile_free(profile);
+}
+
+static uint32 *
+get_rgba_buffer(uint32 bytes)
+{
+	/* loads are serialized by the critical section, so they all share one buffer that only ever grows */
+	if (bytes > rgbabuffersize)
+	{
+		if (rgbabuffer != NULL)
+			_TIFFfree(rgbabuffer);
+		rgbabuffer = _TIFFmalloc(bytes);
+		rgbabuffersize = (rgbabuffer != NULL) ? bytes : 0;
+	}
+	return rgbabuffer;
 }
 
 static bilevel_image *
@@ -302,10 +513,11 @@ bilevel_image_load(image_worker_data *data)
 
 	/* allocate RGBA buffer */
 EnterCriticalSection(&critsect);
-	rgba = _TIFFmalloc(width * length * 4);
+	rgba = get_rgba_buffer(width * length * 4);
 	if (rgba == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating RGBA %dx%d\n", data->filename, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 
@@ -313,6 +525,7 @@ EnterCriticalSection(&critsect);
 	if (TIFFReadRGBAImageOriented(in, width, length, rgba, ORIENTATION_TOPLEFT, 1) == 0)
 	{
 		fprintf(stderr, "%s: Error reading image\n", data->filename);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	
@@ -321,6 +534,7 @@ EnterCriticalSection(&critsect);
 	if (image == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating bilevel %dx%d\n", data->filename, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	image->name = data->filename;
@@ -359,8 +573,6 @@ EnterCriticalSection(&critsect);
 	if (++load_count == workercount)
 		SetEvent(event);
 
-	/* free memory */
-	_TIFFfree(rgba);
 LeaveCriticalSection(&critsect);
 	TIFFClose(in);
 	return image;
@@ -368,65 +580,365 @@ LeaveCriticalSection(&critsect);
 error:
 	if (image != NULL)
 		bilevel_image_free(image);
-	if (rgba != NULL)
-		_TIFFfree(rgba);
 	if (in != NULL)
 		TIFFClose(in);
 	return NULL;
 }
 
+/* compress a final page and let its pixels go */
+static int
+bilevel_image_encode_page(int index)
+{
+	bilevel_image *image = finalpage[index];
+	pageout_page page;
+	
+	memset(&page, 0, sizeof(page));
+	page.width = image->width;
+	page.length = image->length;
+	page.bitspersample = image->bitspersample;
+	page.orientation = image->orientation;
+	page.xres = image->xres;
+	page.yres = image->yres;
+	page.resunit = image->resunit;
+	page.pixels = image->pixels;
+	page.rowbytes = image->rowbytes;
+	encodedpage[index] = pageout_encode_page(&page);
+	if (encodedpage[index] == NULL)
+		return -1;
+	bilevel_image_free(image);
+	finalpage[index] = NULL;
+	return 0;
+}
+
 static int
 bilevel_image_save_images(const char *name)
 {
-	TIFF *out;
-	uint32 y;
+	pageout_file *out;
 	int page;
 	
-	out = TIFFOpen(name, "w");
+	out = pageout_open(name);
 	if (out == NULL)
 		return -1;
 
+	/* the workers have compressed their pages already, so this is just appending them in order */
 	for (page = 0; page < pagecount; page++)
 	{
-		bilevel_image *image = finalpage[page];
-
-		TIFFSetField(out, TIFFTAG_IMAGEWIDTH, image->width);
-		TIFFSetField(out, TIFFTAG_IMAGELENGTH, image->length);
-		TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 1);
-		TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
-		TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-		TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_CCITTFAX4);
-		TIFFSetField(out, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
-		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
-		TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, image->length);
-		if (image->orientation != 0) TIFFSetField(out, TIFFTAG_ORIENTATION, image->orientation);
-		if (image->xres != 0) TIFFSetField(out, TIFFTAG_XRESOLUTION, image->xres);
-		if (image->yres != 0) TIFFSetField(out, TIFFTAG_YRESOLUTION, image->yres);
-		if (image->resunit != 0) TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, image->resunit);
-
-		for (y = 0; y < image->length; y++)
-			if (TIFFWriteScanline(out, (tdata_t)(image->pixels + y * image->rowbytes), y, 0) < 0)
-				goto error;
-
-		if (TIFFWriteDirectory(out) == 0)
+		/* except for pages no input landed on */
+		if (encodedpage[page] == NULL && bilevel_image_encode_page(page) != 0)
+			goto error;
+		if (pageout_append(out, encodedpage[page]) != 0)
 			goto error;
+		pageout_encoded_free(encodedpage[page]);
+		encodedpage[page] = NULL;
 	}
 
-	TIFFClose(out);
+	if (pageout_close(out) != 0)
+	{
+		remove(name);
+		return -1;
+	}
 	return 0;
 
 error:
-	TIFFClose(out);
+	pageout_close(out);
 	remove(name);
 	return -1;
 }
 
 static void
-bilevel_image_scale_to_target(const bilevel_image *srcimage, bilevel_image *target, uint32 targetleft, uint32 targettop, uint32 targetwidth, uint32 targetlength, int flip)
+bilevel_view_init(bilevel_view *view, const bilevel_image *parent, long left, long top, uint32 width, uint32 length)
+{
+	view->parent = parent;
+	view->left = left;
+	view->top = top;
+	view->width = width;
+	view->length = length;
+}
+
+static const uint8 *
+bilevel_view_row(const bilevel_view *view, uint32 y, uint8 *buffer)
+{
+	const bilevel_image *parent = view->parent;
+	uint32 bytes = (view->width + 7) / 8;
+	long srcy = view->top + (long)y;
+	long srcx = (view->left >= 0) ? view->left / 8 : -((7 - view->left) / 8);
+	int shift = view->left - srcx * 8;
+	const uint8 *srcrow;
+	uint32 x;
+
+	/* rows above or below the parent are white */
+	if (srcy < 0 || srcy >= (long)parent->length)
+	{
+		memset(buffer, 0, bytes);
+		return buffer;
+	}
+	srcrow = parent->pixels + srcy * parent->rowbytes;
+	
+	/* a byte-aligned row that lies within the parent is used in place */
+	if (shift == 0 && srcx >= 0 && srcx + bytes <= parent->rowbytes)
+		return srcrow + srcx;
+	
+	/* otherwise shift it into the buffer, with white beyond the parent's edges */
+	for (x = 0; x < bytes; x++, srcx++)
+	{
+		uint8 hipix = (srcx >= 0 && srcx < (long)parent->rowbytes) ? srcrow[srcx] : 0;
+		uint8 lopix = (srcx + 1 >= 0 && srcx + 1 < (long)parent->rowbytes) ? srcrow[srcx + 1] : 0;
+		buffer[x] = (hipix << shift) | (lopix >> (8 - shift));
+	}
+	return buffer;
+}
+
+static void
+scale_row_mapped(uint8 *dst, const uint8 *src, const uint32 *srccol, uint32 width)
+{
+	uint32 x, pix = 0;
+	
+	/* gather one source pixel per destination pixel, storing each byte as it fills */
+	for (x = 0; x < width; x++)
+	{
+		pix = (pix << 1) | ((src[srccol[x] >> 3] >> (~srccol[x] & 7)) & 1);
+		if ((x & 7) == 7)
+			*dst++ = pix;
+	}
+	if (width & 7)
+		*dst = pix << (8 - (width & 7));
+}
+
+static void
+scale_row_double(uint8 *dst, const uint8 *src, uint32 srcbytes)
+{
+	uint32 x;
+	
+	/* every source pixel becomes two */
+	for (x = 0; x < srcbytes; x++)
+	{
+		uint32 pix = src[x];
+		pix = (pix | (pix << 4)) & 0x0f0f;
+		pix = (pix | (pix << 2)) & 0x3333;
+		pix = (pix | (pix << 1)) & 0x5555;
+		pix |= pix << 1;
+		dst[2 * x] = pix >> 8;
+		dst[2 * x + 1] = pix;
+	}
+}
+
+static void
+scale_row_halve(uint8 *dst, const uint8 *src, uint32 srcbytes)
+{
+	uint32 x;
+	
+	/* keep the second pixel of every pair, which is where the sample points fall */
+	for (x = 0; 2 * x < srcbytes; x++)
+	{
+		uint32 pix = src[2 * x] << 8;
+		if (2 * x + 1 < srcbytes)
+			pix |= src[2 * x + 1];
+		pix &= 0x5555;
+		pix = (pix | (pix >> 1)) & 0x3333;
+		pix = (pix | (pix >> 2)) & 0x0f0f;
+		pix = (pix | (pix >> 4)) & 0x00ff;
+		dst[x] = pix;
+	}
+}
+
+static void
+row_or_shifted(uint8 *dst, const uint8 *src, uint32 width, int shift)
+{
+	uint32 bytes = (width + 7) / 8;
+	uint32 dstbytes = (shift + width + 7) / 8;
+	uint8 last = src[bytes - 1] & (0xff << (bytes * 8 - width));
+	uint32 x;
+	
+	/* OR width pixels of src into dst, starting shift pixels into the first byte; anything past width is ignored */
+	if (shift == 0)
+	{
+		bits->row_or(dst, src, bytes - 1);
+		dst[bytes - 1] |= last;
+		return;
+	}
+	for (x = 0; x < bytes; x++)
+	{
+		uint8 pix = (x == bytes - 1) ? last : src[x];
+		dst[x] |= pix >> shift;
+		if (x + 1 < dstbytes)
+			dst[x + 1] |= pix << (8 - shift);
+	}
+}
+
+static void
+bilevel_image_place(const bilevel_view *srcimage, bilevel_image *target, uint32 targetleft, uint32 targettop, uint32 targetwidth, uint32 targetlength, worker_progress *progress)
 {
-	uint32 scaledwidth, scaledlength;
+	uint32 width = srcimage->width;
+	uint32 length = srcimage->length;
+	uint8 *rowbuffer;
+	uint32 y;
+	
+	/* the caller only places pages that fit, so nothing is ever trimmed */
+	rowbuffer = _TIFFmalloc((width + 7) / 8);
+	if (rowbuffer == NULL)
+	{
+		fprintf(stderr, "bilevel_image_place: Out of memory allocating row buffer\n");
+		return;
+	}
+	
+	/* center, rounding down to a whole byte so every row lands with a plain OR */
+	targetleft = (targetleft + (targetwidth - width) / 2) & ~7;
+	targettop += (targetlength - length) / 2;
+	
+	/* the view does any funnel shift on the source side */
+	progress_set(progress, STAGE_SCALING, length, 0);
+	for (y = 0; y < length; y++)
+	{
+		const uint8 *srcrow = bilevel_view_row(srcimage, y, rowbuffer);
+		if (bits->find_pixel(srcrow, 0, width, 1) < width)
+			row_or_shifted(target->pixels + (targettop + y) * target->rowbytes + targetleft / 8, srcrow, width, 0);
+		progress_update(progress, y + 1);
+	}
+	_TIFFfree(rowbuffer);
+}
+
+static void
+bilevel_image_area_scale(const bilevel_view *srcimage, bilevel_image *target, uint32 targetleft, uint32 targettop, uint32 scaledwidth, uint32 scaledlength, int flip, worker_progress *progress)
+{
+	uint32 srcbytes = (srcimage->width + 7) / 8;
+	uint32 scaledbytes = (scaledwidth + 7) / 8;
+	uint32 lastfirst = ~0, lastend = 0;
+	uint32 *boxes;
+	uint64 *lanes;
+	const uint16 *columns;
+	uint8 *scaledrow;
+	uint8 *rowbuffer = NULL;
+	uint64 spread[16];
+	uint32 x, y, i, k;
+	int black = FALSE;
+	
+	/* allocate memory: a box per destination column, and two words of four 16-bit column counters per source byte */
+	boxes = _TIFFmalloc(2 * scaledwidth * sizeof(uint32));
+	lanes = _TIFFmalloc(2 * srcbytes * sizeof(uint64));
+	scaledrow = _TIFFmalloc(scaledbytes);
+	rowbuffer = _TIFFmalloc(srcbytes);
+	if (boxes == NULL || lanes == NULL || scaledrow == NULL || rowbuffer == NULL)
+	{
+		fprintf(stderr, "bilevel_image_area_scale: Out of memory allocating column counters\n");
+		goto done;
+	}
+	columns = (const uint16 *)lanes;
+	
+	/* spread[n] puts each bit of nibble n in its own 16-bit lane, leftmost pixel lowest */
+	for (x = 0; x < 16; x++)
+		for (spread[x] = 0, k = 0; k < 4; k++)
+			if (x & (8 >> k))
+				spread[x] |= (uint64)1 << (16 * k);
+	
+	/* each destination column covers the source columns up to where the next one starts, and at least one */
+	for (x = 0; x < scaledwidth; x++)
+	{
+		uint32 first = (uint64)x * srcimage->width / scaledwidth;
+		uint32 end = (uint64)(x + 1) * srcimage->width / scaledwidth;
+		if (end <= first)
+			end = first + 1;
+		boxes[2 * x] = flip ? srcimage->width - end : first;
+		boxes[2 * x + 1] = flip ? srcimage->width - first : end;
+	}
+	
+	/* iterate over rows */
+	progress_set(progress, STAGE_SCALING, scaledlength, 0);
+	for (y = 0; y < scaledlength; y++)
+	{
+		uint32 first = (uint64)y * srcimage->length / scaledlength;
+		uint32 end = (uint64)(y + 1) * srcimage->length / scaledlength;
+		if (end <= first)
+			end = first + 1;
+		
+		/* count the covered source rows per column, four columns per add; the same rows again reuse the counts */
+		if (first != lastfirst || end != lastend)
+		{
+			memset(lanes, 0, 2 * srcbytes * sizeof(uint64));
+			black = FALSE;
+			for (i = first; i < end; i++)
+			{
+				const uint8 *srcrow = bilevel_view_row(srcimage, flip ? srcimage->length - 1 - i : i, rowbuffer);
+				for (x = 0; x < srcbytes; x++)
+				{
+					/* skip white a word at a time */
+					if (x % 8 == 0 && x + 8 <= srcbytes)
+					{
+						uint64 word;
+						memcpy(&word, srcrow + x, sizeof(word));
+						if (word == 0)
+						{
+							x += 7;
+							continue;
+						}
+					}
+					if (srcrow[x] != 0)
+					{
+						lanes[2 * x] += spread[srcrow[x] >> 4];
+						lanes[2 * x + 1] += spread[srcrow[x] & 15];
+						black = TRUE;
+					}
+				}
+			}
+			lastfirst = first;
+			lastend = end;
+		}
+		
+		/* white stays white */
+		if (black)
+		{
+			uint32 area, count;
+			
+			/* gray keeps the coverage, 255 for solid black; bilevel thresholds it */
+			if (target->bitspersample == 8)
+			{
+				uint8 *dstrow = target->pixels + (targettop + y) * target->rowbytes + targetleft;
+				for (x = 0; x < scaledwidth; x++)
+				{
+					for (count = 0, k = boxes[2 * x]; k < boxes[2 * x + 1]; k++)
+						count += columns[k];
+					area = (boxes[2 * x + 1] - boxes[2 * x]) * (end - first);
+					dstrow[x] = (count * 255 + area / 2) / area;
+				}
+			}
+			else
+			{
+				memset(scaledrow, 0, scaledbytes);
+				for (x = 0; x < scaledwidth; x++)
+				{
+					for (count = 0, k = boxes[2 * x]; k < boxes[2 * x + 1]; k++)
+						count += columns[k];
+					area = (boxes[2 * x + 1] - boxes[2 * x]) * (end - first);
+					if (count * 100 >= area_threshold * area)
+						scaledrow[x >> 3] |= 0x80 >> (x & 7);
+				}
+				row_or_shifted(target->pixels + (targettop + y) * target->rowbytes + targetleft / 8, scaledrow, scaledwidth, targetleft & 7);
+			}
+		}
+		progress_update(progress, y + 1);
+	}
+
+done:
+	if (boxes != NULL)
+		_TIFFfree(boxes);
+	if (lanes != NULL)
+		_TIFFfree(lanes);
+	if (scaledrow != NULL)
+		_TIFFfree(scaledrow);
+	if (rowbuffer != NULL)
+		_TIFFfree(rowbuffer);
+}
+
+static void
+bilevel_image_scale_to_target(const bilevel_view *srcimage, bilevel_image *target, uint32 targetleft, uint32 targettop, uint32 targetwidth, uint32 targetlength, int flip, worker_progress *progress)
+{
+	uint32 scaledwidth, scaledlength, scaledbytes;
 	long long stepx, stepy;
 	long long srcx, srcy;
+	uint32 *srccol = NULL;
+	uint8 *scaledrow = NULL;
+	uint8 *rowbuffer = NULL;
+	uint32 lasty = (uint32)-1;
+	int blank = TRUE;
 	uint32 x, y;
 	
 	/* determine where the original image will go */
@@ -437,91 +949,111 @@ bilevel_image_scale_to_target(const bilevel_image *srcimage, bilevel_image *targ
 	else
 		scaledwidth = targetwidth;
 	
+	/* within 1% of unity scale, copy the page across pixel for pixel instead of resampling it, as long as
+	   it fits; a page even slightly too big is scaled down so none of its edges are lost */
+	if (!flip && target->bitspersample == 1 && srcimage->width <= targetwidth && srcimage->length <= targetlength &&
+		scaledwidth * 100 >= srcimage->width * 99 && scaledwidth * 100 <= srcimage->width * 101 &&
+		scaledlength * 100 >= srcimage->length * 99 && scaledlength * 100 <= srcimage->length * 101)
+	{
+		bilevel_image_place(srcimage, target, targetleft, targettop, targetwidth, targetlength, progress);
+		return;
+	}
+	
 	/* center */
 	targetleft += (targetwidth - scaledwidth) / 2;
 	targettop += (targetlength - scaledlength) / 2;
 	
+	/* area coverage replaces point sampling, as long as no box is too tall for the 16-bit column counters */
+	if ((area_threshold != 0 || target->bitspersample == 8) && srcimage->length / scaledlength < 65535)
+	{
+		bilevel_image_area_scale(srcimage, target, targetleft, targettop, scaledwidth, scaledlength, flip, progress);
+		return;
+	}
+	
 	/* compute the x step */
 	stepx = ((long long)srcimage->width << 32) / scaledwidth;
 	stepy = ((long long)srcimage->length << 32) / scaledlength;
 	
-	/* iterate over rows */
-	srcy = stepy / 2;
-	for (y = 0; y < scaledlength; y++)
+	/* allocate a row buffer for view rows that can't be read in place */
+	rowbuffer = _TIFFmalloc((srcimage->width + 7) / 8);
+	if (rowbuffer == NULL)
 	{
-		uint32 cury = srcy >> 32;
-		const uint8 *srcrow;
-		uint8 *dstrow = target->pixels + (targettop + y) * target->rowbytes;
-
-		if (flip) cury = srcimage->length - 1 - cury;
-		srcrow = srcimage->pixels + cury * srcimage->rowbytes;
-		
-		/* iterate over columns */
+		fprintf(stderr, "bilevel_image_scale_to_target: Out of memory allocating row buffer\n");
+		goto done;
+	}
+	
+	/* each scaled row is built here before it is ORed into place; the 2x kernel can run a byte over */
+	scaledbytes = (scaledwidth + 7) / 8;
+	scaledrow = _TIFFmalloc(scaledbytes + 2);
+	if (scaledrow == NULL)
+	{
+		fprintf(stderr, "bilevel_image_scale_to_target: Out of memory allocating row buffer\n");
+		goto done;
+	}
+	
+	/* exact 2x and 1/2x have their own kernels; anything else maps each column to its source once per page */
+	if (flip || (stepx != (1ll << 31) && stepx != (2ll << 32)))
+	{
+		srccol = _TIFFmalloc(scaledwidth * sizeof(uint32));
+		if (srccol == NULL)
+		{
+			fprintf(stderr, "bilevel_image_scale_to_target: Out of memory allocating column map\n");
+			goto done;
+		}
 		srcx = stepx / 2;
 		for (x = 0; x < scaledwidth; x++)
 		{
 			uint32 curx = srcx >> 32;
-			if (flip) curx = srcimage->width - 1 - curx;
+			srccol[x] = flip ? srcimage->width - 1 - curx : curx;
 			srcx += stepx;
-			if (srcrow[curx >> 3] & (0x80 >> (curx & 7)))
-				dstrow[(targetleft + x) >> 3] |= 0x80 >> ((targetleft + x) & 7);
 		}
-		
-		/* advance in Y */
-		srcy += stepy;
-	}
-}
-
-static bilevel_image *
-bilevel_image_crop(const bilevel_image *image, int left, int top, uint32 width, uint32 length)
-{
-	bilevel_image *result;
-	int shift = left & 7;
-	uint32 x, y;
-
-	/* allocate memory for the destination image */
-	result = bilevel_image_alloc(width, length, image);
-	if (result == NULL)
-	{
-		fprintf(stderr, "bilevel_image_crop: Out of memory allocating bilevel %dx%d\n", width, length);
-		return NULL;
 	}
 	
 	/* iterate over rows */
-	for (y = 0; y < length; y++)
+	progress_set(progress, STAGE_SCALING, scaledlength, 0);
+	srcy = stepy / 2;
+	for (y = 0; y < scaledlength; y++)
 	{
-		uint32 srcy = top + y;
-		
-		/* skip any rows that aren't within the source image bounds */
-		if (srcy < image->length)
+		uint32 cury = srcy >> 32;
+
+		/* build a scaled row only when we move onto a new source row; repeats reuse it */
+		if (flip) cury = srcimage->length - 1 - cury;
+		if (cury != lasty)
 		{
-			const uint8 *srcrow = image->pixels + srcy * image->rowbytes;
-			uint8 *dstrow = result->pixels + y * result->rowbytes;
-			uint8 lastpix = 0;
-			uint32 srcx;
-			
-			/* grab the first partial pixels if we can */
-			srcx = left >> 3;
-			if (srcx < image->rowbytes)
-				lastpix = srcrow[srcx];
+			const uint8 *srcrow;
 
-			/* iterate over groups of 8 pixels */
-			for (x = 0; x < width; x += 8)
+			srcrow = bilevel_view_row(srcimage, cury, rowbuffer);
+			blank = (bits->find_pixel(srcrow, 0, srcimage->width, 1) >= srcimage->width);
+			if (!blank)
 			{
-				uint8 newpix = 0;
-
-				/* if we can fetch within the rowbytes, fetch a new batch of pixels */
-				if (++srcx < image->rowbytes)
-					newpix = srcrow[srcx];
-				
-				/* store the shifted values and shift */
-				*dstrow++ = (lastpix << shift) | (newpix >> (8 - shift));
-				lastpix = newpix;
+				if (srccol != NULL)
+					scale_row_mapped(scaledrow, srcrow, srccol, scaledwidth);
+				else if (stepx == (1ll << 31))
+					scale_row_double(scaledrow, srcrow, (srcimage->width + 7) / 8);
+				else
+					scale_row_halve(scaledrow, srcrow, (srcimage->width + 7) / 8);
+				if (scaledwidth & 7)
+					scaledrow[scaledbytes - 1] &= 0xff << (8 - (scaledwidth & 7));
 			}
+			lasty = cury;
 		}
+		
+		/* all-white rows add nothing to the target */
+		if (!blank)
+			row_or_shifted(target->pixels + (targettop + y) * target->rowbytes + targetleft / 8, scaledrow, scaledwidth, targetleft & 7);
+		
+		/* advance in Y */
+		srcy += stepy;
+		progress_update(progress, y + 1);
 	}
-	
-	return result;
+
+done:
+	if (srccol != NULL)
+		_TIFFfree(srccol);
+	if (scaledrow != NULL)
+		_TIFFfree(scaledrow);
+	if (rowbuffer != NULL)
+		_TIFFfree(rowbuffer);
 }
 
 static int
@@ -572,7 +1104,7 @@ build_worker_list(char *files[], int count)
 			(*workerlist_tailptr)->name = fullname;
 			(*workerlist_tailptr)->index = index;
 			(*workerlist_tailptr)->overall_index = workercount;
-			strcpy((*workerlist_tailptr)->status, "Loading...");
+			progress_stage(&(*workerlist_tailptr)->progress, STAGE_LOADING);
 
 			/* add to the list */
 			workerlist_tailptr = &(*workerlist_tailptr)->next;
@@ -582,6 +1114,28 @@ build_worker_list(char *files[], int count)
 	return 0;
 }
 
+static void
+progress_format(const worker_progress *progress, char *text, size_t size)
+{
+	worker_progress copy;
+	
+	/* take a consistent snapshot, then format it here rather than in the workers */
+	progress_read(progress, &copy);
+	switch (copy.stage)
+	{
+		case STAGE_MESSAGE:
+			snprintf(text, size, "%s", copy.message);
+			break;
+
+		default:
+			if (copy.total != 0)
+				snprintf(text, size, "%s %3u%%", stage_text[copy.stage], (unsigned)(100.0 * copy.value / copy.total));
+			else
+				snprintf(text, size, "%s", stage_text[copy.stage]);
+			break;
+	}
+}
+
 static int
 queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back)
 {
@@ -617,6 +1171,7 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 		for (worker = workerlist; worker != NULL; worker = worker->next)
 		{
 			char namebuf[30];
+			char status[100];
 			if (!worker->done)
 				alldone = FALSE;
 			if (worker->error)
@@ -630,7 +1185,8 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 			}
 			else
 				strcpy(namebuf, worker->name);
-			printf("%20.20s: %-59.59s\n", namebuf, worker->status);
+			progress_format(&worker->progress, status, sizeof(status));
+			printf("%20.20s: %-59.59s\n", namebuf, status);
 		}
 		
 		/* on error, just bail */
@@ -650,7 +1206,7 @@ scale_image(PVOID param)
 	image_worker_data *data = param;
 	uint32 width = data->target->width;
 	uint32 length = data->target->length;
-	bilevel_image *original;
+	bilevel_view view;
 	uint32 xoffs, yoffs;
 	int left, right, top, bottom;
 	
@@ -666,28 +1222,39 @@ scale_image(PVOID param)
 	}
 	
 	/* block until the cropping is settled */
-	strcpy(data->status, "Waiting...");
+	progress_stage(&data->progress, STAGE_WAITING);
 	WaitForSingleObject(event, INFINITE);
 	
-	/* crop our image */
-	strcpy(data->status, "Cropping...");
-	original = data->image;
+	/* crop our image through a view; the pixels stay where they are */
+	progress_stage(&data->progress, STAGE_CROPPING);
 	left = (data->crop_left < crop_left) ? data->crop_left : crop_left;
 	right = (data->crop_right < crop_right) ? data->crop_right : crop_right;
 	top = (data->crop_top < crop_top) ? data->crop_top : crop_top;
 	bottom = (data->crop_bottom < crop_bottom) ? data->crop_bottom : crop_bottom;
-	data->image = bilevel_image_crop(original, left, top, data->image->width - right - left, data->image->length - bottom - top);
-	bilevel_image_free(original);
+	bilevel_view_init(&view, data->image, left, top, data->image->width - right - left, data->image->length - bottom - top);
 	
 	/* scale to the target - assume 8.5 x 11 input, put 0.3" inch margins on all sides
 	   except for 3-hole side, which gets 0.6" inch */
-	strcpy(data->status, "Scaling...");
 	xoffs = width * (data->lefthalf ? 30 : 60) / 850;
 	yoffs = length * 30 / 1100;
-	bilevel_image_scale_to_target(data->image, data->target, xoffs, yoffs, width * 760 / 850, length * 1040 / 1100, 0);
-	strcpy(data->status, "Done");
+	bilevel_image_scale_to_target(&view, data->target, xoffs, yoffs, width * 760 / 850, length * 1040 / 1100, 0, &data->progress);
+	bilevel_image_free(data->image);
+	data->image = NULL;
+	
+	/* the last worker to finish a page compresses it */
+	if (InterlockedDecrement(&pagewriters[data->finalindex]) == 0)
+	{
+		progress_stage(&data->progress, STAGE_ENCODING);
+		if (bilevel_image_encode_page(data->finalindex) != 0)
+		{
+			data->error = TRUE;
+			goto done;
+		}
+	}
+	progress_stage(&data->progress, STAGE_DONE);
 
 done:
+	bilevel_image_release_spare();
 	data->threadid = -1;
 	data->done = TRUE;
 	return 0;
@@ -704,11 +1271,21 @@ allocate_and_assign_pages(void)
 	pagecount = imagecount;
 	finalpage = _TIFFmalloc(sizeof(bilevel_image *) * pagecount);
 	memset(finalpage, 0, sizeof(bilevel_image *) * pagecount);
+	encodedpage = _TIFFmalloc(sizeof(pageout_encoded *) * pagecount);
+	memset(encodedpage, 0, sizeof(pageout_encoded *) * pagecount);
+	pagewriters = _TIFFmalloc(sizeof(LONG) * pagecount);
+	memset((void *)pagewriters, 0, sizeof(LONG) * pagecount);
 
 	/* allocate the pages */	
 	for (page = 0; page < pagecount; page++)
 	{
-		finalpage[page] = bilevel_image_alloc(targetwidth, targetlength, NULL);
+		/* gray pages keep a byte per pixel in the same structure */
+		finalpage[page] = bilevel_image_alloc(gray_output ? targetwidth * 8 : targetwidth, targetlength, NULL);
+		if (gray_output)
+		{
+			finalpage[page]->width = targetwidth;
+			finalpage[page]->bitspersample = 8;
+		}
 		finalpage[page]->orientation = ORIENTATION_TOPLEFT;
 		finalpage[page]->xres = target_resolution;
 		finalpage[page]->yres = target_resolution;
@@ -721,11 +1298,24 @@ allocate_and_assign_pages(void)
 	for (worker = workerlist; worker != NULL; worker = worker->next)
 	{
 		worker->target = finalpage[page];
+		worker->finalindex = page;
+		pagewriters[page]++;
 		worker->lefthalf = single_sided ? 0 : (page & 1);
 		page++;
 	}
 }
 
+static void
+report_page_faults(void)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	
+	/* page faults mostly come from touching freshly allocated page memory */
+	counters.cb = sizeof(counters);
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		printf("%lu page faults, %lu KB peak working set\n", (unsigned long)counters.PageFaultCount, (unsigned long)(counters.PeakWorkingSetSize / 1024));
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -736,10 +1326,12 @@ main(int argc, char* argv[])
 	char *xptr;
 	
 	InitializeCriticalSection(&critsect);
+	bit_kernels_init();
+	spareslot = TlsAlloc();
 	event = CreateEvent(NULL, TRUE, FALSE, NULL);
 
 	/* parse arguments */
-	while ((c = getopt(argc, argv, "sr:")) != -1)
+	while ((c = getopt(argc, argv, "a:gsS:r:")) != -1)
 	{
 		switch (c)
 		{
@@ -752,6 +1344,24 @@ main(int argc, char* argv[])
 				single_sided = 1;
 				break;
 
+			case 'a':
+				area_threshold = atoi(optarg);
+				if (area_threshold < 1 || area_threshold > 100)
+					usage();
+				printf("Scaling by area coverage, black at %d%%\n", area_threshold);
+				break;
+			
+			case 'g':
+				gray_output = 1;
+				printf("Writing 8-bit gray\n");
+				break;
+
+			case 'S':
+				if (atoi(optarg) < 1)
+					usage();
+				pageout_strip_rows = atoi(optarg);
+				break;
+
 			case '?':
 				usage();
 				break;
@@ -788,15 +1398,19 @@ main(int argc, char* argv[])
 	if (bilevel_image_save_images(argv[argc - 1]))
 		return -1;
 
+	report_page_faults();
 	return (0);
 }
 
 
 char* stuff[] = {
-"usage: tiffbook [options] input.tif [input2.tif [...]] output.tif",
+"usage: tiffbook [options] input.tif [input2.tif [...]] output.tif|output.pdf",
 "where options are:",
 " -r dpi	output resolution in dpi",
 " -s        assume single-sided",
+" -a pct    shrink by area coverage, black where pct% or more of the source is black",
+" -g        shrink by area coverage to 8-bit gray",
+" -S rows   write G4 strips of this many rows, encoded in parallel",
 NULL
 };
 
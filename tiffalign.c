@@ -10,8 +10,15 @@
 #endif
 
 #include <windows.h>
+#include <psapi.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include "tiffio.h"
+#include "bitkernels.h"
+#include "pageout.h"
+#include "shear.h"
 
 typedef struct bilevel_image bilevel_image;
 struct bilevel_image
@@ -24,9 +31,48 @@ struct bilevel_image
 	float	yres;
 	uint16	resunit;
 	uint16	rowbytes;
+	uint32	capacity;
+	uint8	pixels[1];
+};
+
+typedef struct gray_image gray_image;
+struct gray_image
+{
+	const char *name;
+	uint32	width;
+	uint32	length;
+	uint16	orientation;
+	float	xres;
+	float	yres;
+	uint16	resunit;
 	uint8	pixels[1];
 };
 
+typedef struct bilevel_profile bilevel_profile;
+struct bilevel_profile
+{
+	uint32	width;
+	uint32	length;
+	uint32	*rows;
+	uint32	*columns;
+};
+
+typedef struct rotate_params rotate_params;
+struct rotate_params
+{
+	long long	dxdx, dydx;
+	long long	dxdy, dydy;
+	long long	srcstartx, srcstarty;
+};
+
+typedef struct morph_op morph_op;
+struct morph_op
+{
+	char		op;
+	uint32		width;
+	uint32		length;
+};
+
 typedef struct rotate_worker_data rotate_worker_data;
 struct rotate_worker_data
 {
@@ -36,6 +82,17 @@ struct rotate_worker_data
 	long long 	score;
 };
 
+typedef struct worker_progress worker_progress;
+struct worker_progress
+{
+	volatile LONG	sequence;
+	volatile uint32	stage;
+	volatile uint32	total;
+	volatile long	arg;
+	volatile uint32	value;
+	char		message[100];
+};
+
 typedef struct image_worker_data image_worker_data;
 struct image_worker_data
 {
@@ -45,48 +102,160 @@ struct image_worker_data
 	int			index;
 	DWORD		threadid;
 	bilevel_image *image;
+	gray_image *gray;
+	pageout_encoded *encoded;
+	image_worker_data *writenext;
+	LONGLONG	writequeued;
+	volatile uint32 writing;
 	volatile uint32 done;
 	volatile uint32 error;
+	double		angle;
 	uint32		left;
 	uint32		right;
 	uint32		top;
 	uint32		bottom;
-	char 		status[100];
+	worker_progress progress;
 };
 
+#define MIN_BAND_ROWS 16
+#define MAX_ROTATE_BANDS 64
+#define MIN_CLEAN_ROWS 128
+#define MAX_MORPH_OPS 16
+#define MAX_WRITERS 16
+
 static CRITICAL_SECTION critsect;
+static DWORD spareslot = TLS_OUT_OF_INDEXES;
+static uint32 *rgbabuffer = NULL;
+static uint32 rgbabuffersize = 0;
 
 static image_worker_data *workerlist = NULL;
 static int workercount = 0;
 
 static uint32 median_width, median_length;
 static int cleanit = 0;
-
-static const uint8 popcount[256] =
-{
-	0,1,1,2,1,2,2,3, 1,2,2,3,2,3,3,4,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	4,5,5,6,5,6,6,7, 5,6,6,7,6,7,7,8
+static double shear_tolerance = SHEAR_DEFAULT_TOLERANCE;
+static int streamit = 0;
+static int graytoo = 0;
+
+static int orient_turns = 0;
+static int orient_auto = 0;
+
+/* write-behind: workers queue their encoded pages and a few writer threads do the file system work */
+static CRITICAL_SECTION writesect;
+static HANDLE writeevent = NULL;
+static HANDLE writerdone[MAX_WRITERS];
+static image_worker_data *writehead = NULL;
+static image_worker_data **writetail = &writehead;
+static int writeclosing = FALSE;
+static int writercount = 2;
+
+/* write metrics, kept under writesect; times are in performance counter ticks */
+static int writedepth = 0;
+static int writemaxdepth = 0;
+static LONGLONG writedepthsum = 0;
+static int writecount = 0;
+static LONGLONG writewaitsum = 0, writewaitmax = 0;
+static LONGLONG writetimesum = 0, writetimemax = 0;
+
+static morph_op morph_ops[MAX_MORPH_OPS];
+static int morph_count = 0;
+
+/* progress stages, indexing stage_text */
+#define STAGE_LOADING			0
+#define STAGE_DESPECKLE_SCAN	1
+#define STAGE_DESPECKLE_MERGE	2
+#define STAGE_DESPECKLE_ERASE	3
+#define STAGE_ORIENT_CHECK		4
+#define STAGE_TURNING			5
+#define STAGE_MORPHOLOGY		6
+#define STAGE_CHECKING			7
+#define STAGE_SCANNING			8
+#define STAGE_NOT_CONVERGING	9
+#define STAGE_ROTATING_GRAY		10
+#define STAGE_SAVING_GRAY		11
+#define STAGE_COPYING			12
+#define STAGE_SAVING			13
+#define STAGE_ENCODING			14
+#define STAGE_WRITE_QUEUED		15
+#define STAGE_WRITING			16
+#define STAGE_DONE				17
+#define STAGE_ERROR				18
+#define STAGE_MESSAGE			19
+
+static const char *stage_text[] =
+{
+	"Loading...", "Despeckle scanning...", "Despeckle merging...", "Erasing specks...",
+	"Checking orientation...", "Turning...", "Morphology...", "Checking alignment...",
+	"Scanning for best angle....", "Results not converging as expected", "Rotating gray...", "Saving gray...",
+	"Copying original...", "Saving...", "Encoding...", "Waiting to write...", "Writing...", "Done.", "Error!", ""
 };
+
 	
 static	void usage(void);
+static	int idle_band_threads(void);
+static	void rotate_params_init(rotate_params *params, uint32 width, uint32 length, double angle);
+static	void bilevel_image_rotate_rows(const bilevel_image *image, const rotate_params *params, long dsty, uint32 rows, long dstx, uint32 width, uint8 *dstrows, uint32 rowbytes, uint32 dstbit);
 
 #define FACTOR(val, size)  ((val < size / 6 || val > 5 * size / 6) ? 1 : 3)
 
+static void
+progress_set(worker_progress *progress, uint32 stage, uint32 total, long arg)
+{
+	/* an odd sequence number tells the reporter an update is under way */
+	InterlockedIncrement(&progress->sequence);
+	progress->stage = stage;
+	progress->total = total;
+	progress->arg = arg;
+	progress->value = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_stage(worker_progress *progress, uint32 stage)
+{
+	progress_set(progress, stage, 0, 0);
+}
+
+static void
+progress_update(worker_progress *progress, uint32 value)
+{
+	/* a single aligned store, cheap enough for inner loops; the reporter reads it unlocked */
+	if (progress != NULL)
+		progress->value = value;
+}
+
+static void
+progress_message(worker_progress *progress, const char *format, va_list args)
+{
+	InterlockedIncrement(&progress->sequence);
+	vsnprintf(progress->message, sizeof(progress->message), format, args);
+	progress->stage = STAGE_MESSAGE;
+	progress->total = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_read(const worker_progress *progress, worker_progress *copy)
+{
+	LONG sequence;
+	
+	/* retry until no update overlapped our copy */
+	do
+	{
+		sequence = progress->sequence;
+		MemoryBarrier();
+		copy->stage = progress->stage;
+		copy->total = progress->total;
+		copy->arg = progress->arg;
+		memcpy(copy->message, progress->message, sizeof(copy->message));
+		MemoryBarrier();
+	} while ((sequence & 1) != 0 || sequence != progress->sequence);
+	copy->message[sizeof(copy->message) - 1] = 0;
+	copy->value = progress->value;
+	if (copy->value > copy->total)
+		copy->value = copy->total;
+}
+
 static void
 warning_handler(const char *module, const char *format, va_list args)
 {
@@ -117,7 +286,7 @@ warning_handler_ext(thandle_t handle, const char *module, const char *format, va
 	/* if we found one, output a warning */
 //	if (worker != NULL)
 //		printf(format, args);
-//		vsnprintf(worker->status, sizeof(worker->status), format, args);
+//		progress_message(&worker->progress, format, args);
 }
 
 static void
@@ -138,7 +307,7 @@ error_handler_ext(thandle_t handle, const char *module, const char *format, va_l
 	/* if we found one, output an error */
 	if (worker != NULL)
 //		printf(format, args);
-		vsnprintf(worker->status, sizeof(worker->status), format, args);
+		progress_message(&worker->progress, format, args);
 }
 
 inline int
@@ -170,6 +339,7 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 {
 	uint16 rowbytes = (width + 7) / 8;
 	bilevel_image *image;
+	uint32 capacity;
 	
 	/* borrow width/height from clone if not specified */
 	if (clonefrom != NULL)
@@ -178,17 +348,68 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 		if (length == 0) length = clonefrom->length;
 	}
 	
-	/* allocate memory for the image */
+	/* reuse this thread's spare image if it's big enough, otherwise allocate memory for the image */
 	rowbytes = (width + 7) / 8;
-	image = _TIFFmalloc(sizeof(*image) + length * rowbytes);
-	if (image == NULL)
-		return NULL;
+	image = (spareslot != TLS_OUT_OF_INDEXES) ? TlsGetValue(spareslot) : NULL;
+	if (image != NULL)
+	{
+		TlsSetValue(spareslot, NULL);
+		if (image->capacity < length * rowbytes)
+		{
+			_TIFFfree(image);
+			image = NULL;
+		}
+	}
+	if (image != NULL)
+		capacity = image->capacity;
+	else
+	{
+		capacity = length * rowbytes;
+		image = _TIFFmalloc(sizeof(*image) + capacity);
+		if (image == NULL)
+			return NULL;
+	}
 	
 	/* clear to 0 and fill in the basics */
 	memset(image, 0, sizeof(*image) + length * rowbytes);
 	image->width = width;
 	image->length = length;
 	image->rowbytes = rowbytes;
+	image->capacity = capacity;
+	
+	/* clone remaining fields */
+	if (clonefrom != NULL)
+	{
+		image->name = clonefrom->name;
+		image->orientation = clonefrom->orientation;
+		image->xres = clonefrom->xres;
+		image->yres = clonefrom->yres;
+		image->resunit = clonefrom->resunit;
+	}
+	return image;
+}
+
+static gray_image *
+gray_image_alloc(uint32 width, uint32 length, const gray_image *clonefrom)
+{
+	gray_image *image;
+	
+	/* borrow width/height from clone if not specified */
+	if (clonefrom != NULL)
+	{
+		if (width == 0) width = clonefrom->width;
+		if (length == 0) length = clonefrom->length;
+	}
+	
+	/* allocate memory for the image */
+	image = _TIFFmalloc(sizeof(*image) + length * width);
+	if (image == NULL)
+		return NULL;
+	
+	/* fill in the basics; the pixels are left for the caller */
+	memset(image, 0, sizeof(*image));
+	image->width = width;
+	image->length = length;
 	
 	/* clone remaining fields */
 	if (clonefrom != NULL)
@@ -203,19 +424,71 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 }
 
 static void
-bilevel_image_free(bilevel_image *image)
+gray_image_free(gray_image *image)
 {
 	_TIFFfree(image);
 }
 
+static void
+bilevel_image_free(bilevel_image *image)
+{
+	bilevel_image *spare;
+	
+	/* keep the larger of this and the current spare around for the next stage on this thread */
+	if (spareslot != TLS_OUT_OF_INDEXES && image != NULL)
+	{
+		spare = TlsGetValue(spareslot);
+		if (spare == NULL || spare->capacity < image->capacity)
+		{
+			TlsSetValue(spareslot, image);
+			image = spare;
+		}
+	}
+	if (image != NULL)
+		_TIFFfree(image);
+}
+
+/* free this thread's spare; it only pays off between the stages of one page, and a pool thread
+   may not see another page for a long time */
+static void
+bilevel_image_release_spare(void)
+{
+	bilevel_image *spare;
+	
+	if (spareslot != TLS_OUT_OF_INDEXES)
+	{
+		spare = TlsGetValue(spareslot);
+		TlsSetValue(spareslot, NULL);
+		if (spare != NULL)
+			_TIFFfree(spare);
+	}
+}
+
+static uint32 *
+get_rgba_buffer(uint32 bytes)
+{
+	/* loads are serialized by the critical section, so they all share one buffer that only ever grows */
+	if (bytes > rgbabuffersize)
+	{
+		if (rgbabuffer != NULL)
+			_TIFFfree(rgbabuffer);
+		rgbabuffer = _TIFFmalloc(bytes);
+		rgbabuffersize = (rgbabuffer != NULL) ? bytes : 0;
+	}
+	return rgbabuffer;
+}
+
 static bilevel_image *
-bilevel_image_load(const char *name, int index)
+bilevel_image_load(const char *name, int index, gray_image **grayout)
 {
 	uint32 x, y, width, length, minb, maxb, threshb;
+	uint16 bitspersample = 1, samplesperpixel = 1;
 	bilevel_image *image = NULL;
+	gray_image *gray = NULL;
 	uint32 *rgba = NULL;
 	TIFF *in = NULL;
 	uint32 *src;
+	uint8 *dst;
 	
 	/* open source image */
 	in = TIFFOpen(name, "ru");
@@ -250,12 +523,17 @@ bilevel_image_load(const char *name, int index)
 		goto error;
 	}
 
+	/* note the depth, so we know whether a gray copy is worth keeping */
+	TIFFGetField(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	TIFFGetField(in, TIFFTAG_SAMPLESPERPIXEL, &samplesperpixel);
+	
 	/* allocate RGBA buffer */
 EnterCriticalSection(&critsect);
-	rgba = _TIFFmalloc(width * length * 4);
+	rgba = get_rgba_buffer(width * length * 4);
 	if (rgba == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating RGBA %dx%d\n", name, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 
@@ -263,6 +541,7 @@ EnterCriticalSection(&critsect);
 	if (TIFFReadRGBAImageOriented(in, width, length, rgba, ORIENTATION_TOPLEFT, 1) == 0)
 	{
 		fprintf(stderr, "%s: Error reading image\n", name);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	
@@ -271,6 +550,7 @@ EnterCriticalSection(&critsect);
 	if (image == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating bilevel %dx%d\n", name, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	image->name = name;
@@ -281,8 +561,26 @@ EnterCriticalSection(&critsect);
 	TIFFGetField(in, TIFFTAG_YRESOLUTION, &image->yres);
 	TIFFGetField(in, TIFFTAG_RESOLUTIONUNIT, &image->resunit);
 	
-	/* determine the min/max brightness */
+	/* if asked, keep an 8-bit gray copy of anything deeper than 1 bit */
+	if (grayout != NULL && bitspersample * samplesperpixel > 1)
+	{
+		gray = gray_image_alloc(width, length, NULL);
+		if (gray == NULL)
+		{
+			fprintf(stderr, "%s: Out of memory allocating gray %dx%d\n", name, width, length);
+			LeaveCriticalSection(&critsect);
+			goto error;
+		}
+		gray->name = name;
+		gray->orientation = image->orientation;
+		gray->xres = image->xres;
+		gray->yres = image->yres;
+		gray->resunit = image->resunit;
+	}
+	
+	/* determine the min/max brightness, filling in the gray copy along the way */
 	src = rgba;
+	dst = (gray != NULL) ? gray->pixels : NULL;
 	minb = 0xff * 10;
 	maxb = 0 * 10;
 	for (y = 0; y < length; y++)
@@ -292,6 +590,8 @@ EnterCriticalSection(&critsect);
 			int bright = (TIFFGetR(pix) * 4 + TIFFGetG(pix) * 5 + TIFFGetB(pix) * 1);
 			if (bright < minb) minb = bright;
 			if (bright > maxb) maxb = bright;
+			if (dst != NULL)
+				*dst++ = bright / 10;
 		}
 	
 	/* read the image, converting to bilevel along the way */
@@ -306,130 +606,376 @@ EnterCriticalSection(&critsect);
 				set_pixel(image, y, x);
 		}
 
-	/* free memory */
-	_TIFFfree(rgba);
 LeaveCriticalSection(&critsect);
 	TIFFClose(in);
+	if (grayout != NULL)
+		*grayout = gray;
 	return image;
 
 error:
+	if (gray != NULL)
+		gray_image_free(gray);
 	if (image != NULL)
 		bilevel_image_free(image);
-	if (rgba != NULL)
-		_TIFFfree(rgba);
 	if (in != NULL)
 		TIFFClose(in);
 	return NULL;
 }
 
 static int
-bilevel_image_save_image(const image_worker_data *workdata)
+backup_existing_file(const char *name, char **tempname)
 {
-	bilevel_image *image = workdata->image;
-	char *tempname = NULL;
-	TIFF *out = NULL;
 	FILE *file;
-	uint32 y;
-	int res;
 	
-	file = fopen(workdata->name, "r");
+	/* if the file exists, move it to ~name so it can be restored on failure */
+	*tempname = NULL;
+	file = fopen(name, "r");
 	if (file != NULL)
 	{
 		fclose(file);
-		tempname = malloc(strlen(workdata->name) + 2);
-		if (tempname == NULL)
+		*tempname = malloc(strlen(name) + 2);
+		if (*tempname == NULL)
 			return -1;
-		tempname[0] = '~';
-		strcpy(&tempname[1], workdata->name);
-		remove(tempname);
-		if (rename(workdata->name, tempname) != 0)
+		(*tempname)[0] = '~';
+		strcpy(&(*tempname)[1], name);
+		remove(*tempname);
+		if (rename(name, *tempname) != 0)
 		{
-			free(tempname);
+			free(*tempname);
+			*tempname = NULL;
 			return -1;
 		}
 	}
+	return 0;
+}
+
+typedef struct rotate_fill_data rotate_fill_data;
+struct rotate_fill_data
+{
+	const bilevel_image *image;
+	rotate_params params;
+};
+
+static void
+bilevel_image_rotate_fill(const void *param, uint32 y, uint32 rows, uint8 *dst)
+{
+	const rotate_fill_data *data = param;
+	
+	bilevel_image_rotate_rows(data->image, &data->params, y, rows, 0, data->image->width, dst, data->image->rowbytes, 0);
+}
+
+static void
+bilevel_image_page(const image_worker_data *workdata, pageout_page *page, rotate_fill_data *filldata)
+{
+	const bilevel_image *image = workdata->image;
+	
+	memset(page, 0, sizeof(*page));
+	page->width = image->width;
+	page->length = image->length;
+	page->bitspersample = 1;
+	page->orientation = image->orientation;
+	page->xres = image->xres;
+	page->yres = image->yres;
+	page->resunit = image->resunit;
+
+	/* if streaming, the writer renders the rotated rows a band or strip at a time */
+	if (workdata->angle != 0.0)
+	{
+		filldata->image = image;
+		rotate_params_init(&filldata->params, image->width, image->length, workdata->angle);
+		page->fill = bilevel_image_rotate_fill;
+		page->param = filldata;
+	}
+	
+	/* otherwise, write the image as is */
+	else
+	{
+		page->pixels = image->pixels;
+		page->rowbytes = image->rowbytes;
+	}
+}
+
+/* compress the page so a writer thread can save it, and let its pixels go */
+static int
+bilevel_image_encode(image_worker_data *workdata)
+{
+	rotate_fill_data filldata;
+	pageout_page page;
+	
+	bilevel_image_page(workdata, &page, &filldata);
+	workdata->encoded = pageout_encode_page_parallel(&page);
+	if (workdata->encoded == NULL)
+		return -1;
+	bilevel_image_free(workdata->image);
+	workdata->image = NULL;
+	return 0;
+}
+
+static int
+bilevel_image_save_image(const image_worker_data *workdata)
+{
+	rotate_fill_data filldata;
+	pageout_page page;
+	char *tempname = NULL;
+	TIFF *out = NULL;
+	int result;
+	
+	if (backup_existing_file(workdata->name, &tempname) != 0)
+		return -1;
 	
 	out = TIFFOpen(workdata->name, "w");
 	if (out == NULL)
 		goto error;
 
+	/* a page that is already encoded only needs writing */
+	if (workdata->encoded != NULL)
+		result = pageout_write_encoded(out, workdata->encoded);
+	else
+	{
+		bilevel_image_page(workdata, &page, &filldata);
+		result = pageout_write_page(out, &page);
+	}
+	if (result != 0)
+		goto error;
+
+	TIFFClose(out);
+	return 0;
+
+error:
+	if (out)
+	{
+		TIFFClose(out);
+		remove(workdata->name);
+	}
+	if (tempname)
+	{
+		rename(tempname, workdata->name);
+		free(tempname);
+	}
+	return -1;
+}
+
+static int
+gray_image_save_image(const image_worker_data *workdata)
+{
+	gray_image *image = workdata->gray;
+	char *tempname = NULL;
+	char *grayname = NULL;
+	const char *ext;
+	TIFF *out = NULL;
+	uint32 y;
+	
+	/* the gray copy goes next to the bilevel one, with -gray added before the extension */
+	grayname = malloc(strlen(workdata->name) + 10);
+	if (grayname == NULL)
+		return -1;
+	ext = strrchr(workdata->name, '.');
+	if (ext == NULL)
+		ext = workdata->name + strlen(workdata->name);
+	sprintf(grayname, "%.*s-gray%s", (int)(ext - workdata->name), workdata->name, ext);
+	
+	if (backup_existing_file(grayname, &tempname) != 0)
+	{
+		free(grayname);
+		return -1;
+	}
+	
+	out = TIFFOpen(grayname, "w");
+	if (out == NULL)
+		goto error;
+
 	TIFFSetField(out, TIFFTAG_IMAGEWIDTH, image->width);
 	TIFFSetField(out, TIFFTAG_IMAGELENGTH, image->length);
-	TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 1);
+	TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 8);
 	TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
 	TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-	TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_CCITTFAX4);
-	TIFFSetField(out, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
-	TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
-	TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, image->length);
+	TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_ADOBE_DEFLATE);
+	TIFFSetField(out, TIFFTAG_PREDICTOR, PREDICTOR_HORIZONTAL);
+	TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+	TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, 0));
 	if (image->orientation != 0) TIFFSetField(out, TIFFTAG_ORIENTATION, image->orientation);
 	if (image->xres != 0) TIFFSetField(out, TIFFTAG_XRESOLUTION, image->xres);
 	if (image->yres != 0) TIFFSetField(out, TIFFTAG_YRESOLUTION, image->yres);
 	if (image->resunit != 0) TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, image->resunit);
 
 	for (y = 0; y < image->length; y++)
-		if (TIFFWriteScanline(out, (tdata_t)(image->pixels + y * image->rowbytes), y, 0) < 0)
+		if (TIFFWriteScanline(out, (tdata_t)(image->pixels + y * image->width), y, 0) < 0)
 			goto error;
 
 	if (TIFFWriteDirectory(out) == 0)
 		goto error;
 
 	TIFFClose(out);
+	free(grayname);
 	return 0;
 
 error:
 	if (out)
 	{
 		TIFFClose(out);
-		remove(workdata->name);
+		remove(grayname);
 	}
 	if (tempname)
 	{
-		rename(tempname, workdata->name);
+		rename(tempname, grayname);
 		free(tempname);
 	}
+	free(grayname);
 	return -1;
 }
 
-static long long
-bilevel_image_rotate_score(const bilevel_image *image, double angle)
+static int
+bilevel_image_copy_original(const image_worker_data *workdata)
 {
-	long long dxdx, dydx, dxdy, dydy;
-	long long srcstartx, srcstarty;
-	long long summary = 0;
-	double sinval, cosval;
-	long dstx, dsty;
-	uint32 *vrun;
+	uint16 bitspersample, compression, value16;
+	uint32 value32;
+	float valuef;
+	char *tempname = NULL;
+	TIFF *in = NULL;
+	TIFF *out = NULL;
+	tdata_t buffer = NULL;
+	tsize_t buffersize = 0;
+	tstrip_t strip, numstrips;
 	
-	/* convert angle to rotation matrix */
-	sinval = sin(angle * M_PI / 180.0);
-	cosval = cos(angle * M_PI / 180.0);
-	dxdx = (long long)(cosval * (double)(1ll << 32));
-	dydx = (long long)(-sinval * (double)(1ll << 32));
-	dxdy = -dydx;
-	dydy = dxdx;
-
-	/* pick starting source x,y such that we remain centered */
-	srcstartx = ((long long)(image->width / 2) * (double)(1ll << 32)) - dxdx * (image->width / 2) - dxdy * (image->length / 2);
-	srcstarty = ((long long)(image->length / 2) * (double)(1ll << 32)) - dydx * (image->width / 2) - dydy * (image->length / 2);
-
-	/* allocate memory to track vertical runs */
-	vrun = _TIFFmalloc(image->width * sizeof(uint32));
-	if (vrun == NULL)
+	/* open source image */
+	in = TIFFOpen(workdata->filename, "r");
+	if (in == NULL)
+		return -1;
+	if (TIFFSetDirectory(in, workdata->index) == 0)
+	{
+		TIFFClose(in);
+		return -1;
+	}
+	
+	/* only 1-bit G4 strips can be passed through; anything else must be re-encoded */
+	TIFFGetFieldDefaulted(in, TIFFTAG_BITSPERSAMPLE, &bitspersample);
+	TIFFGetFieldDefaulted(in, TIFFTAG_COMPRESSION, &compression);
+	if (bitspersample != 1 || compression != COMPRESSION_CCITTFAX4 || TIFFIsTiled(in))
+	{
+		TIFFClose(in);
+		return 1;
+	}
+	
+	/* a single-image file would be written back over itself, so leave it alone */
+	if (strcmp(workdata->name, workdata->filename) == 0)
 	{
-		fprintf(stderr, "bilevel_image_rotate_score: Out of memory allocating vrun for rotation\n");
+		TIFFClose(in);
 		return 0;
 	}
-	memset(vrun, 0, image->width * sizeof(uint32));
-
-	/* iterate over the destination */
-	for (dsty = 0; dsty < image->length; dsty++)
+	
+	if (backup_existing_file(workdata->name, &tempname) != 0)
 	{
-		long long srcx = srcstartx + dsty * dxdy;
-		long long srcy = srcstarty + dsty * dydy;
-		long run = 0;
-		
-		/* iterate over destination rows */
+		TIFFClose(in);
+		return -1;
+	}
+	
+	out = TIFFOpen(workdata->name, "w");
+	if (out == NULL)
+		goto error;
+
+	/* copy the tags that describe the strip data */
+	if (TIFFGetField(in, TIFFTAG_IMAGEWIDTH, &value32)) TIFFSetField(out, TIFFTAG_IMAGEWIDTH, value32);
+	if (TIFFGetField(in, TIFFTAG_IMAGELENGTH, &value32)) TIFFSetField(out, TIFFTAG_IMAGELENGTH, value32);
+	if (TIFFGetField(in, TIFFTAG_ROWSPERSTRIP, &value32)) TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, value32);
+	if (TIFFGetField(in, TIFFTAG_T6OPTIONS, &value32)) TIFFSetField(out, TIFFTAG_T6OPTIONS, value32);
+	TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 1);
+	TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_CCITTFAX4);
+	if (TIFFGetField(in, TIFFTAG_FILLORDER, &value16)) TIFFSetField(out, TIFFTAG_FILLORDER, value16);
+	if (TIFFGetField(in, TIFFTAG_PHOTOMETRIC, &value16)) TIFFSetField(out, TIFFTAG_PHOTOMETRIC, value16);
+	if (TIFFGetField(in, TIFFTAG_ORIENTATION, &value16)) TIFFSetField(out, TIFFTAG_ORIENTATION, value16);
+	if (TIFFGetField(in, TIFFTAG_XRESOLUTION, &valuef)) TIFFSetField(out, TIFFTAG_XRESOLUTION, valuef);
+	if (TIFFGetField(in, TIFFTAG_YRESOLUTION, &valuef)) TIFFSetField(out, TIFFTAG_YRESOLUTION, valuef);
+	if (TIFFGetField(in, TIFFTAG_RESOLUTIONUNIT, &value16)) TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, value16);
+
+	/* copy the compressed strips across without decoding them */
+	numstrips = TIFFNumberOfStrips(in);
+	for (strip = 0; strip < numstrips; strip++)
+	{
+		tsize_t size = TIFFRawStripSize(in, strip);
+		if (size < 0)
+			goto error;
+		if (size > buffersize)
+		{
+			if (buffer != NULL)
+				_TIFFfree(buffer);
+			buffer = _TIFFmalloc(size);
+			if (buffer == NULL)
+				goto error;
+			buffersize = size;
+		}
+		size = TIFFReadRawStrip(in, strip, buffer, size);
+		if (size < 0 || TIFFWriteRawStrip(out, strip, buffer, size) < 0)
+			goto error;
+	}
+
+	if (TIFFWriteDirectory(out) == 0)
+		goto error;
+
+	if (buffer != NULL)
+		_TIFFfree(buffer);
+	TIFFClose(out);
+	TIFFClose(in);
+	free(tempname);
+	return 0;
+
+error:
+	if (buffer != NULL)
+		_TIFFfree(buffer);
+	if (out)
+	{
+		TIFFClose(out);
+		remove(workdata->name);
+	}
+	if (tempname)
+	{
+		rename(tempname, workdata->name);
+		free(tempname);
+	}
+	TIFFClose(in);
+	return -1;
+}
+
+static void
+bilevel_image_rotate_runs(const bilevel_image *image, double angle, long long *hsum, long long *vsum)
+{
+	long long dxdx, dydx, dxdy, dydy;
+	long long srcstartx, srcstarty;
+	double sinval, cosval;
+	long dstx, dsty;
+	uint32 *vrun;
+	
+	/* convert angle to rotation matrix */
+	sinval = sin(angle * M_PI / 180.0);
+	cosval = cos(angle * M_PI / 180.0);
+	dxdx = (long long)(cosval * (double)(1ll << 32));
+	dydx = (long long)(-sinval * (double)(1ll << 32));
+	dxdy = -dydx;
+	dydy = dxdx;
+
+	/* pick starting source x,y such that we remain centered */
+	srcstartx = ((long long)(image->width / 2) * (double)(1ll << 32)) - dxdx * (image->width / 2) - dxdy * (image->length / 2);
+	srcstarty = ((long long)(image->length / 2) * (double)(1ll << 32)) - dydx * (image->width / 2) - dydy * (image->length / 2);
+
+	/* allocate memory to track vertical runs */
+	*hsum = *vsum = 0;
+	vrun = _TIFFmalloc(image->width * sizeof(uint32));
+	if (vrun == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate_runs: Out of memory allocating vrun for rotation\n");
+		return;
+	}
+	memset(vrun, 0, image->width * sizeof(uint32));
+
+	/* iterate over the destination */
+	for (dsty = 0; dsty < image->length; dsty++)
+	{
+		long long srcx = srcstartx + dsty * dxdy;
+		long long srcy = srcstarty + dsty * dydy;
+		long run = 0;
+		
+		/* iterate over destination rows */
 		for (dstx = 0; dstx < image->width; dstx++)
 		{
 			uint32 sx = srcx >> 32;
@@ -445,8 +991,8 @@ bilevel_image_rotate_score(const bilevel_image *image, double angle)
 			/* otherwise, end the current run and update the vertical runs as well for this column */
 			else
 			{
-				summary += FACTOR(dsty, image->length) * run * run + 
-							FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
+				*hsum += FACTOR(dsty, image->length) * run * run;
+				*vsum += FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
 				run = 0;
 				vrun[dstx] = 0;
 			}
@@ -457,282 +1003,1466 @@ bilevel_image_rotate_score(const bilevel_image *image, double angle)
 		}
 		
 		/* account for any runs off the end */
-		summary += FACTOR(dsty, image->length) * run * run;
+		*hsum += FACTOR(dsty, image->length) * run * run;
 	}
 
 	/* account for any runs off the bottom */	
 	for (dstx = 0; dstx < image->width; dstx++)
-		summary += FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
+		*vsum += FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
 
-	/* free memory and return the result */
+	/* free memory */
 	_TIFFfree(vrun);
-	return summary;
 }
 
+static long long
+bilevel_image_rotate_score(const bilevel_image *image, double angle)
+{
+	long long hsum, vsum;
+	
+	/* the score is the combined horizontal and vertical run energy */
+	bilevel_image_rotate_runs(image, angle, &hsum, &vsum);
+	return hsum + vsum;
+}
+
+typedef struct object_run object_run;
+struct object_run
+{
+	uint32		parent;
+	uint32		y;
+	uint32		x0, x1;
+	uint32		minx, maxx;
+	uint32		miny, maxy;
+	uint32		pixels;
+};
+
 typedef struct
 {
-	uint8 *visited;
-	int max;
-	int rowbytes;
-	int failed;
-	int xorigin, yorigin;
-} object_bounds;
+	object_run *run;
+	uint32		count;
+	uint32		alloc;
+} object_run_list;
 
-static void
-get_object_max_dim_r(bilevel_image *image, int dy, int dx, object_bounds *bounds)
+#define SPECK_MAX_LONG		8
+#define SPECK_MAX_SHORT		3
+
+static uint32
+object_run_find(object_run_list *list, uint32 index)
 {
-	int x, y;
-	if (bounds->failed || dy < -bounds->max || dx < -bounds->max || dy > bounds->max || dx > bounds->max)
+	/* walk up to the root, halving the path as we go */
+	while (list->run[index].parent != index)
 	{
-		bounds->failed = 1;
-		return;
+		list->run[index].parent = list->run[list->run[index].parent].parent;
+		index = list->run[index].parent;
 	}
-	if (bounds->visited[dy * bounds->rowbytes + dx])
+	return index;
+}
+
+static void
+object_run_union(object_run_list *list, uint32 a, uint32 b)
+{
+	object_run *root;
+	
+	/* find both roots; the lower index wins so roots stay in scan order */
+	a = object_run_find(list, a);
+	b = object_run_find(list, b);
+	if (a == b)
 		return;
-	bounds->visited[dy * bounds->rowbytes + dx] = 1;
-	x = bounds->xorigin + dx;
-	y = bounds->yorigin + dy;
-	if (get_pixel(image, y-1, x)) get_object_max_dim_r(image, dy-1, dx, bounds);
-	if (get_pixel(image, y+1, x)) get_object_max_dim_r(image, dy+1, dx, bounds);
-	if (get_pixel(image, y, x-1)) get_object_max_dim_r(image, dy, dx-1, bounds);
-	if (get_pixel(image, y, x+1)) get_object_max_dim_r(image, dy, dx+1, bounds);
+	if (b < a)
+	{
+		uint32 temp = a;
+		a = b;
+		b = temp;
+	}
+	
+	/* merge the bounds and pixel count into the surviving root */
+	list->run[b].parent = a;
+	root = &list->run[a];
+	if (list->run[b].minx < root->minx) root->minx = list->run[b].minx;
+	if (list->run[b].maxx > root->maxx) root->maxx = list->run[b].maxx;
+	if (list->run[b].miny < root->miny) root->miny = list->run[b].miny;
+	if (list->run[b].maxy > root->maxy) root->maxy = list->run[b].maxy;
+	root->pixels += list->run[b].pixels;
 }
 
 static int
-get_object_max_dim(bilevel_image *image, int y, int x, int max1, int max2)
-{
-	object_bounds bounds;
-	
-	bounds.max = max1;
-	bounds.rowbytes = 2 * (max1 + 1) + 1;
-	bounds.failed = 0;
-	bounds.xorigin = x;
-	bounds.yorigin = y;
-	bounds.visited = malloc(bounds.rowbytes * bounds.rowbytes);
-	memset(bounds.visited, 0, bounds.rowbytes * bounds.rowbytes);
-
-	bounds.visited += max1 * bounds.rowbytes + max1;
-	get_object_max_dim_r(image, 0, 0, &bounds);
-	bounds.visited -= max1 * bounds.rowbytes + max1;
-	
-	if (!bounds.failed)
-	{
-		int miny, maxy, minx, maxx, x, y;
-		miny = minx = bounds.rowbytes;
-		maxy = maxx = -1;
-		for (y = 0; y < bounds.rowbytes; y++)
-			for (x = 0; x < bounds.rowbytes; x++)
-				if (bounds.visited[y * bounds.rowbytes + x])
-				{
-					if (y < miny) miny = y;
-					if (y > maxy) maxy = y;
-					if (x < minx) minx = x;
-					if (x > maxx) maxx = x;
-				}
-		
-		if (maxy - miny > maxx - minx)
-			bounds.failed = (maxy - miny > max1 || maxx - minx > max2);
+object_run_add(object_run_list *list, uint32 y, uint32 x0, uint32 x1)
+{
+	object_run *run;
+	
+	/* grow the list as needed */
+	if (list->count == list->alloc)
+	{
+		uint32 newalloc = (list->alloc == 0) ? 4096 : list->alloc * 2;
+		object_run *newrun = _TIFFrealloc(list->run, newalloc * sizeof(*newrun));
+		if (newrun == NULL)
+			return -1;
+		list->run = newrun;
+		list->alloc = newalloc;
+	}
+	
+	/* each run starts out as its own component */
+	run = &list->run[list->count];
+	run->parent = list->count++;
+	run->y = run->miny = run->maxy = y;
+	run->x0 = run->minx = x0;
+	run->x1 = x1;
+	run->maxx = x1 - 1;
+	run->pixels = x1 - x0;
+	return 0;
+}
+
+static int
+object_run_list_add_row(object_run_list *list, const bilevel_image *image, uint32 y)
+{
+	const uint8 *row = image->pixels + y * image->rowbytes;
+	uint32 x = 0, start;
+	
+	/* find each run of black pixels: its first black pixel, then the next white one */
+	while ((start = bits->find_pixel(row, x, image->width, 1)) < image->width)
+	{
+		x = bits->find_pixel(row, start, image->width, 0);
+		if (object_run_add(list, y, start, x) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+object_run_list_link_rows(object_run_list *list, uint32 prevstart, uint32 prevend, uint32 curstart, uint32 curend)
+{
+	uint32 i = prevstart, j = curstart;
+	
+	/* walk both rows' runs in step, joining any that share a column */
+	while (i < prevend && j < curend)
+	{
+		if (list->run[i].x0 < list->run[j].x1 && list->run[j].x0 < list->run[i].x1)
+			object_run_union(list, i, j);
+		if (list->run[i].x1 <= list->run[j].x1)
+			i++;
 		else
-			bounds.failed = (maxx - minx > max1 || maxy - miny > max2);
+			j++;
+	}
+}
+
+static int
+object_is_speck(const object_run *root)
+{
+	uint32 width = root->maxx - root->minx;
+	uint32 height = root->maxy - root->miny;
+	
+	/* small in the long direction and thin in the short one */
+	if (height > width)
+		return (height <= SPECK_MAX_LONG && width <= SPECK_MAX_SHORT);
+	return (width <= SPECK_MAX_LONG && height <= SPECK_MAX_SHORT);
+}
+
+static void
+clear_run(bilevel_image *image, uint32 y, uint32 x0, uint32 x1)
+{
+	uint8 *row = image->pixels + y * image->rowbytes;
+	uint32 x;
+	
+	for (x = x0; x < x1 && (x % 8) != 0; x++)
+		row[x / 8] &= ~(0x80 >> (x % 8));
+	for ( ; x + 8 <= x1; x += 8)
+		row[x / 8] = 0;
+	for ( ; x < x1; x++)
+		row[x / 8] &= ~(0x80 >> (x % 8));
+}
+
+typedef struct clean_band_data clean_band_data;
+struct clean_band_data
+{
+	bilevel_image *image;
+	uint32		firstrow;
+	uint32		lastrow;
+	object_run_list list;
+	uint32		firstrowend;
+	uint32		lastrowstart;
+	const object_run_list *merged;
+	uint32		offset;
+	int			erase;
+	int			error;
+	worker_progress *progress;
+	HANDLE		event;
+};
+
+static int
+object_run_list_label(object_run_list *list, const bilevel_image *image, uint32 firstrow, uint32 lastrow, uint32 *firstrowend, uint32 *lastrowstart, worker_progress *progress)
+{
+	uint32 y, prevstart = 0, prevend = 0;
+	
+	/* label 4-connected objects a row of runs at a time, linking each row to the one above */
+	*firstrowend = *lastrowstart = 0;
+	for (y = firstrow; y < lastrow; y++)
+	{
+		uint32 curstart = list->count;
+		if (object_run_list_add_row(list, image, y) != 0)
+			return -1;
+		object_run_list_link_rows(list, prevstart, prevend, curstart, list->count);
+		prevstart = curstart;
+		prevend = list->count;
+		if (y == firstrow)
+			*firstrowend = list->count;
+		progress_update(progress, y + 1 - firstrow);
 	}
 	
-	free(bounds.visited);
+	/* remember where the last row starts so the band below can link to it */
+	*lastrowstart = prevstart;
+	return 0;
+}
+
+static void
+clean_band(clean_band_data *band)
+{
+	const object_run_list *merged = band->merged;
+	uint32 i;
+	
+	/* first pass labels the band on its own */
+	if (!band->erase)
+		band->error = object_run_list_label(&band->list, band->image, band->firstrow, band->lastrow, &band->firstrowend, &band->lastrowstart, band->progress);
 	
-	return bounds.failed;
+	/* second pass erases the band's runs whose (flattened) root is a speck */
+	else
+	{
+		for (i = band->offset; i < band->offset + band->list.count; i++)
+		{
+			if (object_is_speck(&merged->run[merged->run[i].parent]))
+				clear_run(band->image, merged->run[i].y, merged->run[i].x0, merged->run[i].x1);
+			progress_update(band->progress, i + 1 - band->offset);
+		}
+	}
+}
+
+static DWORD WINAPI
+clean_band_worker(LPVOID param)
+{
+	clean_band_data *band = param;
+	clean_band(band);
+	SetEvent(band->event);
+	return 0;
 }
 
 static void
-erase_object(bilevel_image *image, int y, int x)
+run_clean_bands(clean_band_data *bands, int bandcount, int erase)
 {
-	clear_pixel(image, y, x);
-	if (get_pixel(image, y-1, x)) erase_object(image, y-1, x);
-	if (get_pixel(image, y+1, x)) erase_object(image, y+1, x);
-	if (get_pixel(image, y, x-1)) erase_object(image, y, x-1);
-	if (get_pixel(image, y, x+1)) erase_object(image, y, x+1);
+	int band;
+	
+	/* queue all bands but the first, which we do ourselves, then wait for the rest */
+	for (band = 0; band < bandcount; band++)
+	{
+		bands[band].erase = erase;
+		if (band != 0)
+		{
+			bands[band].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			QueueUserWorkItem(clean_band_worker, &bands[band], WT_EXECUTEDEFAULT);
+		}
+	}
+	clean_band(&bands[0]);
+	for (band = 1; band < bandcount; band++)
+	{
+		WaitForSingleObject(bands[band].event, INFINITE);
+		CloseHandle(bands[band].event);
+	}
 }
 
 static void
-bilevel_image_clean(bilevel_image *image, char *status)
+bilevel_image_clean(bilevel_image *image, worker_progress *progress)
 {
-	int x, y;
+	clean_band_data bands[MAX_ROTATE_BANDS];
+	object_run_list merged = { NULL, 0, 0 };
+	int bandcount, band;
+	uint32 i, y, bandrows;
 	
-	/* first despeckle */
-	for (y = 0; y < image->length; y++)
+	/* pick the number of bands; each gets at least MIN_CLEAN_ROWS rows */
+	bandcount = idle_band_threads() + 1;
+	if (bandcount > MAX_ROTATE_BANDS)
+		bandcount = MAX_ROTATE_BANDS;
+	if (bandcount > image->length / MIN_CLEAN_ROWS)
+		bandcount = image->length / MIN_CLEAN_ROWS;
+	if (bandcount < 1)
+		bandcount = 1;
+	
+	/* label each band independently; the first band, which runs on this thread, reports progress */
+	bandrows = (image->length + bandcount - 1) / bandcount;
+	memset(bands, 0, sizeof(bands));
+	for (band = 0, y = 0; band < bandcount && y < image->length; band++, y += bandrows)
 	{
-		sprintf(status, "Despeckle scanning (%d)...", y);
-		for (x = 0; x < image->width; x++)
-			if (get_pixel(image, y, x))
-			{
-				/* find extent of object; skip if any pixels to the left or above because
-				   we already did them */
-				if (get_pixel(image, y, x-1) || get_pixel(image, y-1, x))
-					continue;
-		sprintf(status, "Checking (%d,%d)...", y, x);
-				if (!get_object_max_dim(image, y, x, 8, 3))
-				{
-		sprintf(status, "Erasing (%d,%d)...", y, x);
-					erase_object(image, y, x);
-				}
-			}
+		bands[band].image = image;
+		bands[band].firstrow = y;
+		bands[band].lastrow = (image->length - y < bandrows) ? image->length : (y + bandrows);
+		bands[band].merged = &merged;
+	}
+	bandcount = band;
+	bands[0].progress = progress;
+	progress_set(progress, STAGE_DESPECKLE_SCAN, bands[0].lastrow - bands[0].firstrow, 0);
+	run_clean_bands(bands, bandcount, FALSE);
+	
+	/* gather the bands into one list, shifting each band's parent links by its offset */
+	for (band = 0; band < bandcount; band++)
+	{
+		if (bands[band].error)
+		{
+			fprintf(stderr, "bilevel_image_clean: Out of memory tracking %d runs\n", bands[band].list.count);
+			goto done;
+		}
+		bands[band].offset = merged.count;
+		merged.count += bands[band].list.count;
+	}
+	if (bandcount == 1)
+		merged.run = bands[0].list.run;
+	else
+	{
+		merged.run = _TIFFmalloc((merged.count > 0 ? merged.count : 1) * sizeof(*merged.run));
+		if (merged.run == NULL)
+		{
+			fprintf(stderr, "bilevel_image_clean: Out of memory merging %d runs\n", merged.count);
+			goto done;
+		}
+		for (band = 0; band < bandcount; band++)
+		{
+			object_run *dst = merged.run + bands[band].offset;
+			memcpy(dst, bands[band].list.run, bands[band].list.count * sizeof(*dst));
+			for (i = 0; i < bands[band].list.count; i++)
+				dst[i].parent += bands[band].offset;
+		}
+		
+		/* join objects that cross each seam */
+		progress_stage(progress, STAGE_DESPECKLE_MERGE);
+		for (band = 1; band < bandcount; band++)
+			object_run_list_link_rows(&merged, bands[band - 1].offset + bands[band - 1].lastrowstart, bands[band].offset,
+					bands[band].offset, bands[band].offset + bands[band].firstrowend);
 	}
+	
+	/* parents always point at lower indices, so one forward pass points every run straight at its root */
+	for (i = 0; i < merged.count; i++)
+		merged.run[i].parent = merged.run[merged.run[i].parent].parent;
+	
+	/* erase every run whose object is a speck, again a band at a time */
+	progress_set(progress, STAGE_DESPECKLE_ERASE, bands[0].list.count, 0);
+	run_clean_bands(bands, bandcount, TRUE);
+
+done:
+	if (merged.run != NULL && bandcount > 1)
+		_TIFFfree(merged.run);
+	for (band = 0; band < bandcount; band++)
+		if (bands[band].list.run != NULL)
+			_TIFFfree(bands[band].list.run);
 }
 
-static bilevel_image *
-bilevel_image_rotate(const bilevel_image *image, double angle)
+static void
+rotate_params_init(rotate_params *params, uint32 width, uint32 length, double angle)
 {
-	long long dxdx, dydx, dxdy, dydy;
-	long long srcstartx, srcstarty;
 	double sinval, cosval;
-	bilevel_image *result;
-	long dstx, dsty;
 	
 	/* convert angle to rotation matrix */
 	sinval = sin(angle * M_PI / 180.0);
 	cosval = cos(angle * M_PI / 180.0);
-	dxdx = (long long)(cosval * (double)(1ll << 32));
-	dydx = (long long)(-sinval * (double)(1ll << 32));
-	dxdy = -dydx;
-	dydy = dxdx;
+	params->dxdx = (long long)(cosval * (double)(1ll << 32));
+	params->dydx = (long long)(-sinval * (double)(1ll << 32));
+	params->dxdy = -params->dydx;
+	params->dydy = params->dxdx;
 
 	/* pick starting source x,y such that we remain centered */
-	srcstartx = ((long long)(image->width / 2) * (double)(1ll << 32)) - dxdx * (image->width / 2) - dxdy * (image->length / 2);
-	srcstarty = ((long long)(image->length / 2) * (double)(1ll << 32)) - dydx * (image->width / 2) - dydy * (image->length / 2);
+	params->srcstartx = ((long long)(width / 2) * (double)(1ll << 32)) - params->dxdx * (width / 2) - params->dxdy * (length / 2);
+	params->srcstarty = ((long long)(length / 2) * (double)(1ll << 32)) - params->dydx * (width / 2) - params->dydy * (length / 2);
+}
 
-	/* allocate memory for the destination image */
-	result = bilevel_image_alloc(0, 0, image);
-	if (result == NULL)
+static void
+bilevel_image_rotate_row(const bilevel_image *image, const rotate_params *params, long dsty, long dstx, uint32 width, uint8 *dstrow, uint32 dstbit)
+{
+	long long srcx = params->srcstartx + dsty * params->dxdy + dstx * params->dxdx;
+	long long srcy = params->srcstarty + dsty * params->dydy + dstx * params->dydx;
+	uint32 x;
+	
+	/* iterate over destination pixels, ORing them into the (cleared) row starting at dstbit */
+	for (x = dstbit; x < dstbit + width; x++)
 	{
-		fprintf(stderr, "bilevel_image_rotate: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
-		return NULL;
+		if (get_pixel(image, srcy >> 32, srcx >> 32))
+			dstrow[x / 8] |= 0x80 >> (x % 8);
+		
+		/* advance source in both X and Y */
+		srcx += params->dxdx;
+		srcy += params->dydx;
 	}
+}
+
+static uint32
+gray_image_get_pixel(const gray_image *image, long y, long x)
+{
+	/* outside the image is white */
+	if (y < 0 || x < 0 || y >= (long)image->length || x >= (long)image->width)
+		return 0xff;
+	return image->pixels[y * image->width + x];
+}
+
+static void
+gray_image_rotate_row(const gray_image *image, const rotate_params *params, long dsty, long dstx, uint32 width, uint8 *dstrow)
+{
+	/* sample positions are pixel corners; back off half a pixel so we interpolate between pixel centers */
+	long long srcx = params->srcstartx + dsty * params->dxdy + dstx * params->dxdx - (1ll << 31);
+	long long srcy = params->srcstarty + dsty * params->dydy + dstx * params->dydx - (1ll << 31);
+	uint32 x = 0;
 	
-	/* iterate over the destination */
-	for (dsty = 0; dsty < result->length; dsty++)
+#ifdef __SSE2__
+	/* 8 pixels at a time: gather the 2x2 neighborhoods, then blend in 16-bit lanes with 8-bit weights */
+	for ( ; x + 8 <= width; x += 8)
 	{
-		long long srcx = srcstartx + dsty * dxdy;
-		long long srcy = srcstarty + dsty * dydy;
+		uint16 p00[8], p01[8], p10[8], p11[8], fx[8], fy[8];
+		__m128i a, b, c, d, wx, wy, one, top, bottom;
+		int i;
 		
-		/* iterate over destination rows */
-		for (dstx = 0; dstx < result->width; dstx++)
+		for (i = 0; i < 8; i++)
 		{
-			/* if we're in range, count black pixel runs */
-			if (get_pixel(image, srcy >> 32, srcx >> 32))
-				set_pixel(result, dsty, dstx);
-			
-			/* advance source in both X and Y */
-			srcx += dxdx;
-			srcy += dydx;
+			long sx = (long)(srcx >> 32), sy = (long)(srcy >> 32);
+			fx[i] = (uint16)((srcx >> 24) & 0xff);
+			fy[i] = (uint16)((srcy >> 24) & 0xff);
+			if (sx >= 0 && sy >= 0 && sx + 1 < (long)image->width && sy + 1 < (long)image->length)
+			{
+				const uint8 *src = image->pixels + sy * image->width + sx;
+				p00[i] = src[0];
+				p01[i] = src[1];
+				p10[i] = src[image->width];
+				p11[i] = src[image->width + 1];
+			}
+			else
+			{
+				p00[i] = gray_image_get_pixel(image, sy, sx);
+				p01[i] = gray_image_get_pixel(image, sy, sx + 1);
+				p10[i] = gray_image_get_pixel(image, sy + 1, sx);
+				p11[i] = gray_image_get_pixel(image, sy + 1, sx + 1);
+			}
+			srcx += params->dxdx;
+			srcy += params->dydx;
 		}
+		a = _mm_loadu_si128((const __m128i *)p00);
+		b = _mm_loadu_si128((const __m128i *)p01);
+		c = _mm_loadu_si128((const __m128i *)p10);
+		d = _mm_loadu_si128((const __m128i *)p11);
+		wx = _mm_loadu_si128((const __m128i *)fx);
+		wy = _mm_loadu_si128((const __m128i *)fy);
+		one = _mm_set1_epi16(256);
+		
+		/* the products stay under 65536, so unsigned 16-bit lanes are enough */
+		top = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(a, _mm_sub_epi16(one, wx)), _mm_mullo_epi16(b, wx)), 8);
+		bottom = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(c, _mm_sub_epi16(one, wx)), _mm_mullo_epi16(d, wx)), 8);
+		top = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, _mm_sub_epi16(one, wy)), _mm_mullo_epi16(bottom, wy)), 8);
+		_mm_storel_epi64((__m128i *)(dstrow + x), _mm_packus_epi16(top, top));
+	}
+#endif
+	
+	/* iterate over the remaining destination pixels */
+	for ( ; x < width; x++)
+	{
+		long sx = (long)(srcx >> 32), sy = (long)(srcy >> 32);
+		uint32 fx = (uint32)((srcx >> 24) & 0xff);
+		uint32 fy = (uint32)((srcy >> 24) & 0xff);
+		uint32 top, bottom;
+		
+		/* blend the 2x2 neighborhood, truncating the same way the vector path does */
+		top = (gray_image_get_pixel(image, sy, sx) * (256 - fx) + gray_image_get_pixel(image, sy, sx + 1) * fx) >> 8;
+		bottom = (gray_image_get_pixel(image, sy + 1, sx) * (256 - fx) + gray_image_get_pixel(image, sy + 1, sx + 1) * fx) >> 8;
+		dstrow[x] = (uint8)((top * (256 - fy) + bottom * fy) >> 8);
+		
+		/* advance source in both X and Y */
+		srcx += params->dxdx;
+		srcy += params->dydx;
 	}
-	return result;
 }
 
-static DWORD WINAPI
-bilevel_image_auto_rotate_worker(LPVOID param)
+typedef struct band_worker_data band_worker_data;
+struct band_worker_data
 {
-	rotate_worker_data *data = param;
-	data->score = bilevel_image_rotate_score(data->image, data->angle);
-	SetEvent(data->event);
-	return 0;
+	const bilevel_image *image;
+	const gray_image *gray;
+	const rotate_params *params;
+	long		dsty;
+	uint32		rows;
+	long		dstx;
+	uint32		width;
+	uint8 *		dstrows;
+	uint32		rowbytes;
+	uint32		dstbit;
+	HANDLE		event;
+};
+
+static void
+rotate_band(const band_worker_data *data)
+{
+	uint32 y;
+	
+	for (y = 0; y < data->rows; y++)
+	{
+		if (data->gray != NULL)
+			gray_image_rotate_row(data->gray, data->params, data->dsty + y, data->dstx, data->width, data->dstrows + y * data->rowbytes);
+		else
+			bilevel_image_rotate_row(data->image, data->params, data->dsty + y, data->dstx, data->width, data->dstrows + y * data->rowbytes, data->dstbit);
+	}
+}
+
+static DWORD WINAPI
+rotate_band_worker(LPVOID param)
+{
+	band_worker_data *data = param;
+	rotate_band(data);
+	SetEvent(data->event);
+	return 0;
+}
+
+static int
+idle_band_threads(void)
+{
+	SYSTEM_INFO sysinfo;
+	image_worker_data *worker;
+	int waiting = 0, running = 0, idle;
+	
+	/* count pages still waiting for a thread and pages being worked on right now */
+	for (worker = workerlist; worker != NULL; worker = worker->next)
+		if (!worker->done)
+		{
+			if (worker->threadid == 0)
+				waiting++;
+			else
+				running++;
+		}
+	
+	/* only split a page when the waiting pages outnumber the idle threads less than 2:1 */
+	GetSystemInfo(&sysinfo);
+	idle = (int)sysinfo.dwNumberOfProcessors - running;
+	return (idle > 0 && waiting < 2 * idle) ? idle : 0;
+}
+
+static void
+rotate_rows(const bilevel_image *image, const gray_image *gray, const rotate_params *params, long dsty, uint32 rows, long dstx, uint32 width, uint8 *dstrows, uint32 rowbytes, uint32 dstbit)
+{
+	band_worker_data bands[MAX_ROTATE_BANDS];
+	int bandcount, band;
+	uint32 y, bandrows;
+	
+	/* pick the number of bands; each thread gets at least MIN_BAND_ROWS rows */
+	bandcount = idle_band_threads() + 1;
+	if (bandcount > MAX_ROTATE_BANDS)
+		bandcount = MAX_ROTATE_BANDS;
+	if (bandcount > rows / MIN_BAND_ROWS)
+		bandcount = rows / MIN_BAND_ROWS;
+	if (bandcount < 1)
+		bandcount = 1;
+	
+	/* queue all bands but the first, which we render ourselves; the destination rows are disjoint so no locking is needed */
+	bandrows = (rows + bandcount - 1) / bandcount;
+	for (band = 0, y = 0; band < bandcount && y < rows; band++, y += bandrows)
+	{
+		bands[band].image = image;
+		bands[band].gray = gray;
+		bands[band].params = params;
+		bands[band].dsty = dsty + y;
+		bands[band].rows = (rows - y < bandrows) ? (rows - y) : bandrows;
+		bands[band].dstx = dstx;
+		bands[band].width = width;
+		bands[band].dstrows = dstrows + y * rowbytes;
+		bands[band].rowbytes = rowbytes;
+		bands[band].dstbit = dstbit;
+		bands[band].event = NULL;
+		if (band != 0)
+		{
+			bands[band].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			QueueUserWorkItem(rotate_band_worker, &bands[band], WT_EXECUTEDEFAULT);
+		}
+	}
+	bandcount = band;
+	if (bandcount > 0)
+		rotate_band(&bands[0]);
+	
+	/* wait for the rest */
+	for (band = 1; band < bandcount; band++)
+	{
+		WaitForSingleObject(bands[band].event, INFINITE);
+		CloseHandle(bands[band].event);
+	}
+}
+
+static void
+bilevel_image_rotate_rows(const bilevel_image *image, const rotate_params *params, long dsty, uint32 rows, long dstx, uint32 width, uint8 *dstrows, uint32 rowbytes, uint32 dstbit)
+{
+	rotate_rows(image, NULL, params, dsty, rows, dstx, width, dstrows, rowbytes, dstbit);
+}
+
+static gray_image *
+gray_image_rotate(const gray_image *image, double angle)
+{
+	rotate_params params;
+	gray_image *result;
+	
+	/* allocate memory for the destination image */
+	result = gray_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "gray_image_rotate: Out of memory allocating gray %dx%d\n", image->width, image->length);
+		return NULL;
+	}
+	
+	/* render it in bands like the bilevel image */
+	rotate_params_init(&params, image->width, image->length, angle);
+	rotate_rows(NULL, image, &params, 0, result->length, 0, result->width, result->pixels, result->width, 0);
+	return result;
+}
+
+static bilevel_image *
+bilevel_image_rotate_nearest(const bilevel_image *image, double angle)
+{
+	rotate_params params;
+	bilevel_image *result;
+	
+	/* allocate memory for the destination image */
+	result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
+		return NULL;
+	}
+	
+	/* iterate over the destination */
+	rotate_params_init(&params, image->width, image->length, angle);
+	bilevel_image_rotate_rows(image, &params, 0, result->length, 0, result->width, result->pixels, result->rowbytes, 0);
+	return result;
+}
+
+static bilevel_image *
+bilevel_image_rotate_shear(const bilevel_image *image, double angle)
+{
+	bilevel_image *result;
+	
+	/* allocate memory for the destination image */
+	result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate_shear: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
+		return NULL;
+	}
+	if (shear_rotate(result->pixels, image->pixels, image->width, image->length, image->rowbytes, angle) != 0)
+	{
+		bilevel_image_free(result);
+		return NULL;
+	}
+	return result;
+}
+
+static double
+bilevel_image_rotate_check(const bilevel_image *image, const bilevel_image *rotated, double angle)
+{
+	const uint8 *refrows[3], *rotrows[3];
+	uint32 bytes = rotated->rowbytes;
+	uint32 stray = 0, black = 0;
+	rotate_params params;
+	uint8 *rowbuf;
+	long y, row;
+	int r;
+	
+	/* allocate three rows of nearest-neighbor reference output and a scratch row */
+	rowbuf = _TIFFmalloc(4 * bytes);
+	if (rowbuf == NULL)
+		return 1.0;
+	
+	/* at every 16th row, count black pixels that either rotation has with no black within a pixel in the
+	   other; the two round differently, so edges shifting by a pixel don't count against the shear */
+	rotate_params_init(&params, image->width, image->length, angle);
+	for (y = 0; y < rotated->length; y += 16)
+	{
+		for (r = 0; r < 3; r++)
+		{
+			row = y + r - 1;
+			refrows[r] = rotrows[r] = NULL;
+			if (row < 0 || row >= rotated->length)
+				continue;
+			memset(rowbuf + r * bytes, 0, bytes);
+			bilevel_image_rotate_row(image, &params, row, 0, rotated->width, rowbuf + r * bytes, 0);
+			refrows[r] = rowbuf + r * bytes;
+			rotrows[r] = rotated->pixels + row * bytes;
+		}
+		stray += shear_stray_pixels(rotrows[1], refrows, bytes, rowbuf + 3 * bytes);
+		stray += shear_stray_pixels(refrows[1], rotrows, bytes, rowbuf + 3 * bytes);
+		black += bits->popcount(refrows[1], bytes);
+	}
+	_TIFFfree(rowbuf);
+	
+	/* return the stray pixels as a fraction of the black ones */
+	return (black == 0) ? (stray != 0) : ((double)stray / (double)black);
+}
+
+static bilevel_image *
+bilevel_image_rotate(const bilevel_image *image, double angle)
+{
+	bilevel_image *result;
+	
+	/* prefer the shear rotation as long as it gets no more than a sliver of the page visibly wrong */
+	if (shear_tolerance > 0)
+	{
+		result = bilevel_image_rotate_shear(image, angle);
+		if (result != NULL && bilevel_image_rotate_check(image, result, angle) <= shear_tolerance)
+			return result;
+		if (result != NULL)
+			bilevel_image_free(result);
+	}
+	return bilevel_image_rotate_nearest(image, angle);
+}
+
+typedef struct morph_band_data morph_band_data;
+struct morph_band_data
+{
+	const bilevel_image *src;
+	bilevel_image *dst;
+	uint32		firstrow;
+	uint32		lastrow;
+	int			erode;
+	int			vertical;
+	uint32		size;
+	int			error;
+	HANDLE		event;
+};
+
+static long
+morph_start(int erode, uint32 size)
+{
+	/* erosion looks at [x - size/2, ...]; dilation uses the reflected element so open and close behave */
+	return erode ? -(long)(size / 2) : -(long)(size - 1 - size / 2);
+}
+
+static void
+morph_band_horizontal(morph_band_data *band)
+{
+	const bilevel_image *src = band->src;
+	uint32 words = (src->rowbytes + 7) / 8;
+	uint32 extwords = words + (band->size + 63) / 64;
+	uint32 y, x, span;
+	uint64 *row, *temp;
+	
+	/* allocate a pair of word rows, with room for the element to hang off the right edge */
+	row = _TIFFmalloc(2 * extwords * sizeof(uint64));
+	if (row == NULL)
+	{
+		band->error = TRUE;
+		return;
+	}
+	temp = row + extwords;
+	
+	for (y = band->firstrow; y < band->lastrow; y++)
+	{
+		uint8 *dstrow = band->dst->pixels + y * band->dst->rowbytes;
+		
+		/* line the row up so bit x holds the pixel at the left end of x's window */
+		row_load_words(row, src->pixels + y * src->rowbytes, src->rowbytes);
+		bits->shift_words(temp, extwords, row, words, morph_start(band->erode, band->size));
+		
+		/* combine shifted copies, doubling the covered span each time until bit x covers the whole window */
+		for (span = 1; span < band->size; span *= 2)
+		{
+			uint32 step = (span * 2 <= band->size) ? span : (band->size - span);
+			bits->shift_words(row, extwords, temp, extwords, step);
+			for (x = 0; x < extwords; x++)
+				temp[x] = band->erode ? (temp[x] & row[x]) : (temp[x] | row[x]);
+			if (step != span)
+				break;
+		}
+		
+		/* store it, dropping anything in the row padding */
+		row_store_words(dstrow, temp, src->rowbytes);
+		if (src->width % 8 != 0)
+			dstrow[src->rowbytes - 1] &= 0xff << (8 - src->width % 8);
+	}
+	_TIFFfree(row);
+}
+
+static void
+morph_band_vertical(morph_band_data *band)
+{
+	const bilevel_image *src = band->src;
+	long start = morph_start(band->erode, band->size);
+	uint32 y, i;
+	
+	for (y = band->firstrow; y < band->lastrow; y++)
+	{
+		uint8 *dstrow = band->dst->pixels + y * band->dst->rowbytes;
+		long first = (long)y + start;
+		long last = first + (long)band->size;
+		
+		/* eroding past the top or bottom leaves nothing; dilating just ignores the missing rows */
+		if (band->erode && (first < 0 || last > (long)src->length))
+			continue;
+		if (first < 0)
+			first = 0;
+		if (last > (long)src->length)
+			last = src->length;
+		
+		/* AND or OR together the rows under the element */
+		memcpy(dstrow, src->pixels + first * src->rowbytes, src->rowbytes);
+		for (i = first + 1; i < last; i++)
+		{
+			if (band->erode)
+				bits->row_and(dstrow, src->pixels + i * src->rowbytes, src->rowbytes);
+			else
+				bits->row_or(dstrow, src->pixels + i * src->rowbytes, src->rowbytes);
+		}
+	}
+}
+
+static DWORD WINAPI
+morph_band_worker(LPVOID param)
+{
+	morph_band_data *band = param;
+	if (band->vertical)
+		morph_band_vertical(band);
+	else
+		morph_band_horizontal(band);
+	SetEvent(band->event);
+	return 0;
+}
+
+static bilevel_image *
+bilevel_image_morph_pass(bilevel_image *image, int erode, int vertical, uint32 size)
+{
+	morph_band_data bands[MAX_ROTATE_BANDS];
+	bilevel_image *result;
+	int bandcount, band, error = FALSE;
+	uint32 y, bandrows;
+	
+	/* a 1-pixel element changes nothing */
+	if (size <= 1)
+		return image;
+	
+	/* allocate memory for the destination image */
+	result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_morph_pass: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
+		bilevel_image_free(image);
+		return NULL;
+	}
+	
+	/* pick the number of bands; each thread gets at least MIN_BAND_ROWS rows */
+	bandcount = idle_band_threads() + 1;
+	if (bandcount > MAX_ROTATE_BANDS)
+		bandcount = MAX_ROTATE_BANDS;
+	if (bandcount > image->length / MIN_BAND_ROWS)
+		bandcount = image->length / MIN_BAND_ROWS;
+	if (bandcount < 1)
+		bandcount = 1;
+	
+	/* queue all bands but the first, which we do ourselves; each band writes only its own rows */
+	bandrows = (image->length + bandcount - 1) / bandcount;
+	for (band = 0, y = 0; band < bandcount && y < image->length; band++, y += bandrows)
+	{
+		bands[band].src = image;
+		bands[band].dst = result;
+		bands[band].firstrow = y;
+		bands[band].lastrow = (image->length - y < bandrows) ? image->length : (y + bandrows);
+		bands[band].erode = erode;
+		bands[band].vertical = vertical;
+		bands[band].size = size;
+		bands[band].error = FALSE;
+		bands[band].event = NULL;
+		if (band != 0)
+		{
+			bands[band].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			QueueUserWorkItem(morph_band_worker, &bands[band], WT_EXECUTEDEFAULT);
+		}
+	}
+	bandcount = band;
+	if (vertical)
+		morph_band_vertical(&bands[0]);
+	else
+		morph_band_horizontal(&bands[0]);
+	
+	/* wait for the rest */
+	for (band = 0; band < bandcount; band++)
+	{
+		if (band != 0)
+		{
+			WaitForSingleObject(bands[band].event, INFINITE);
+			CloseHandle(bands[band].event);
+		}
+		error |= bands[band].error;
+	}
+	
+	/* the source is consumed either way */
+	bilevel_image_free(image);
+	if (error)
+	{
+		fprintf(stderr, "bilevel_image_morph_pass: Out of memory allocating row buffers\n");
+		bilevel_image_free(result);
+		return NULL;
+	}
+	return result;
+}
+
+static bilevel_image *
+bilevel_image_morph(bilevel_image *image, int erode, uint32 width, uint32 length)
+{
+	bilevel_image *result;
+	
+	/* a rectangle is a horizontal line followed by a vertical one; the image is consumed even on failure */
+	result = bilevel_image_morph_pass(image, erode, FALSE, width);
+	if (result != NULL)
+		result = bilevel_image_morph_pass(result, erode, TRUE, length);
+	return result;
+}
+
+static bilevel_image *
+bilevel_image_morphology(bilevel_image *image, worker_progress *progress)
+{
+	bilevel_image *result;
+	int op;
+	
+	/* apply each operation in turn; opening is erode then dilate, closing the reverse */
+	for (op = 0; op < morph_count; op++)
+	{
+		morph_op *cur = &morph_ops[op];
+		progress_set(progress, STAGE_MORPHOLOGY, 0, op);
+		result = bilevel_image_morph(image, (cur->op == 'e' || cur->op == 'o'), cur->width, cur->length);
+		if (result != NULL && (cur->op == 'o' || cur->op == 'c'))
+			result = bilevel_image_morph(result, (cur->op == 'c'), cur->width, cur->length);
+		if (result == NULL)
+			return NULL;
+		image = result;
+	}
+	return image;
+}
+
+static DWORD WINAPI
+bilevel_image_auto_rotate_worker(LPVOID param)
+{
+	rotate_worker_data *data = param;
+	data->score = bilevel_image_rotate_score(data->image, data->angle);
+	SetEvent(data->event);
+	return 0;
+}
+
+static double
+bilevel_image_find_angle(const bilevel_image *image, worker_progress *progress)
+{
+	rotate_worker_data left;
+	rotate_worker_data right;
+	rotate_worker_data middle;
+	rotate_worker_data leftmid;
+	rotate_worker_data rightmid;
+	HANDLE eventlist[5];
+	int pass = 0;
+	
+	/* report the current best angle in thousandths of a degree, and the pass */
+	progress_set(progress, STAGE_SCANNING, 16, 0);
+	
+	/* set up the workers */
+	left.image = right.image = middle.image = leftmid.image = rightmid.image = image;
+	eventlist[0] = left.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[1] = right.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[2] = middle.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[3] = leftmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[4] = rightmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	/* scan from -10 .. 10 */	
+	left.angle = -10.0;
+	right.angle = 10.0;
+	
+	/* iterate until we've found the best match within 1/1000th of a degree */
+	while (fabs(right.angle - left.angle) > 0.001)
+	{
+		int count = 0;
+		
+		pass++;
+		if (pass > 1)
+			progress_set(progress, STAGE_SCANNING, 16, (long)floor(middle.angle * 1000.0 + 0.5));
+		progress_update(progress, pass);
+
+		/* on the first pass, we have to compute all 5 */
+		if (pass == 1)
+		{
+			left.angle = -10.0;
+			ResetEvent(left.event);
+			QueueUserWorkItem(bilevel_image_auto_rotate_worker, &left, WT_EXECUTEDEFAULT);
+	
+			right.angle = 10.0;
+			ResetEvent(right.event);
+			QueueUserWorkItem(bilevel_image_auto_rotate_worker, &right, WT_EXECUTEDEFAULT);
+	
+			middle.angle = 10.0;
+			ResetEvent(middle.event);
+			QueueUserWorkItem(bilevel_image_auto_rotate_worker, &middle, WT_EXECUTEDEFAULT);
+		}
+	
+		/* on all passes we compute the remaining 2 */
+		leftmid.angle = (left.angle + middle.angle) / 2.0;
+		ResetEvent(leftmid.event);
+		QueueUserWorkItem(bilevel_image_auto_rotate_worker, &leftmid, WT_EXECUTEDEFAULT);
+
+		rightmid.angle = (right.angle + middle.angle) / 2.0;
+		ResetEvent(rightmid.event);
+		QueueUserWorkItem(bilevel_image_auto_rotate_worker, &rightmid, WT_EXECUTEDEFAULT);
+		
+		/* wait for everyone to be done */
+		WaitForMultipleObjects(5, eventlist, TRUE, INFINITE);
+
+		/* if leftmid is our best candidate, make it the new middle */
+		if (leftmid.score >= left.score && leftmid.score >= middle.score)
+		{
+			right.angle = middle.angle, right.score = middle.score;
+			middle.angle = leftmid.angle, middle.score = leftmid.score;
+		}
+
+		/* if middle is our best candidate, it remains the middle */
+		else if (middle.score >= leftmid.score && middle.score >= rightmid.score)
+		{
+			left.angle = leftmid.angle, left.score = leftmid.score;
+			right.angle = rightmid.angle, right.score = rightmid.score;
+		}
+
+		/* if rightmid is our best candidate, make it the new middle */
+		else if (rightmid.score >= right.score && rightmid.score >= middle.score)
+		{
+			left.angle = middle.angle, left.score = middle.score;
+			middle.angle = rightmid.angle, middle.score = rightmid.score;
+		}
+
+		/* warn about non-convergence */
+		else
+		{
+			progress_set(progress, STAGE_NOT_CONVERGING, 16, 0);
+			progress_update(progress, pass);
+			left.angle = leftmid.angle, left.score = leftmid.score;
+			right.angle = rightmid.angle, right.score = rightmid.score;
+		}
+	}
+	
+	/* free the events */
+	CloseHandle(left.event);
+	CloseHandle(right.event);
+	CloseHandle(middle.event);
+	CloseHandle(leftmid.event);
+	CloseHandle(rightmid.event);
+
+	return middle.angle;
+}
+
+static double
+bilevel_image_edge_angle(const bilevel_image *image, double pixels)
+{
+	uint32 size = (image->width > image->length) ? image->width : image->length;
+	
+	/* angle at which rotating about the center moves the farthest edge by the given number of pixels */
+	return asin(2.0 * pixels / size) * 180.0 / M_PI;
+}
+
+static bilevel_image *
+bilevel_image_reduce_4x(const bilevel_image *image)
+{
+	bilevel_image *result;
+	uint8 *accum;
+	uint32 x, y;
+	
+	/* allocate memory for the destination image and a row accumulator */
+	result = bilevel_image_alloc((image->width + 3) / 4, (image->length + 3) / 4, image);
+	accum = _TIFFmalloc(image->rowbytes);
+	if (result == NULL || accum == NULL)
+	{
+		fprintf(stderr, "bilevel_image_reduce_4x: Out of memory allocating bilevel %dx%d\n", (image->width + 3) / 4, (image->length + 3) / 4);
+		if (result != NULL)
+			bilevel_image_free(result);
+		if (accum != NULL)
+			_TIFFfree(accum);
+		return NULL;
+	}
+	result->xres /= 4;
+	result->yres /= 4;
+	
+	/* iterate over destination rows */
+	for (y = 0; y < result->length; y++)
+	{
+		uint8 *dstrow = result->pixels + y * result->rowbytes;
+		uint32 srcy;
+		
+		/* OR together the 4 source rows that land here */
+		memset(accum, 0, image->rowbytes);
+		for (srcy = y * 4; srcy < y * 4 + 4 && srcy < image->length; srcy++)
+		{
+			const uint8 *srcrow = image->pixels + srcy * image->rowbytes;
+			for (x = 0; x < image->rowbytes; x++)
+				accum[x] |= srcrow[x];
+		}
+		
+		/* each source nibble becomes one destination pixel */
+		for (x = 0; x < result->width; x++)
+			if (accum[x / 2] & ((x & 1) ? 0x0f : 0xf0))
+				dstrow[x / 8] |= 0x80 >> (x % 8);
+	}
+	
+	_TIFFfree(accum);
+	return result;
+}
+
+static uint64
+transpose_8x8(uint64 x)
+{
+	uint64 t;
+	
+	/* swap bits across the diagonal in 1x1, 2x2, then 4x4 blocks (row 0 in the top byte, column 0 in the top bit) */
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaull;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccull;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ull;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+static void
+bilevel_image_transpose_block(const bilevel_image *image, uint32 srcy, uint32 bx, const uint8 **srcrows, bilevel_image *result, int flip)
+{
+	uint64 block = 0;
+	uint32 i, dsty;
+	
+	/* gather one byte column from 8 source rows (missing rows are blank) */
+	for (i = 0; i < 8; i++)
+		block = (block << 8) | ((srcrows[i] != NULL) ? srcrows[i][bx] : 0);
+	if (block == 0)
+		return;
+	block = transpose_8x8(block);
+	
+	/* scatter the transposed bytes to 8 destination rows */
+	for (i = 0; i < 8; i++)
+	{
+		dsty = bx * 8 + i;
+		if (dsty >= image->width)
+			break;
+		if (flip)
+			dsty = image->width - 1 - dsty;
+		result->pixels[dsty * result->rowbytes + srcy / 8] = (uint8)(block >> (56 - 8 * i));
+	}
+}
+
+#ifdef __SSE2__
+static void
+bilevel_image_transpose_block16(const bilevel_image *image, uint32 srcy, uint32 bx, const uint8 **srcrows, bilevel_image *result, int flip)
+{
+	__m128i column;
+	uint32 i, dsty;
+	int mask;
+	
+	/* gather one byte column from 16 source rows, first row in the top byte so movemask puts it in bit 15 */
+	column = _mm_set_epi8(srcrows[0][bx], srcrows[1][bx], srcrows[2][bx], srcrows[3][bx], srcrows[4][bx], srcrows[5][bx], srcrows[6][bx], srcrows[7][bx],
+			srcrows[8][bx], srcrows[9][bx], srcrows[10][bx], srcrows[11][bx], srcrows[12][bx], srcrows[13][bx], srcrows[14][bx], srcrows[15][bx]);
+	
+	/* each movemask pulls out one source column as 16 destination pixels */
+	for (i = 0; i < 8; i++)
+	{
+		dsty = bx * 8 + i;
+		if (dsty >= image->width)
+			break;
+		if (flip)
+			dsty = image->width - 1 - dsty;
+		mask = _mm_movemask_epi8(column);
+		result->pixels[dsty * result->rowbytes + srcy / 8] = (uint8)(mask >> 8);
+		result->pixels[dsty * result->rowbytes + srcy / 8 + 1] = (uint8)mask;
+		column = _mm_slli_epi64(column, 1);
+	}
+}
+#endif
+
+static bilevel_image *
+bilevel_image_rotate_quarter(const bilevel_image *image, int turns)
+{
+	const uint8 *srcrows[16];
+	bilevel_image *result;
+	uint32 x, y, i, srcy, pad;
+	
+	/* allocate memory for the destination image; quarter turns swap the dimensions and resolutions */
+	turns &= 3;
+	if (turns & 1)
+		result = bilevel_image_alloc(image->length, image->width, image);
+	else
+		result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate_quarter: Out of memory allocating bilevel %dx%d\n", image->length, image->width);
+		return NULL;
+	}
+	if (turns & 1)
+	{
+		result->xres = image->yres;
+		result->yres = image->xres;
+	}
+	
+	/* 0: just copy */
+	if (turns == 0)
+		memcpy(result->pixels, image->pixels, image->length * image->rowbytes);
+	
+	/* 180: reverse the row order and the bits within each row, then shift out the padding */
+	else if (turns == 2)
+	{
+		pad = image->rowbytes * 8 - image->width;
+		for (y = 0; y < image->length; y++)
+		{
+			const uint8 *srcrow = image->pixels + (image->length - 1 - y) * image->rowbytes;
+			uint8 *dstrow = result->pixels + y * result->rowbytes;
+			bits->reverse_row(dstrow, srcrow, image->rowbytes);
+			if (pad != 0)
+			{
+				for (x = 0; x + 1 < image->rowbytes; x++)
+					dstrow[x] = (dstrow[x] << pad) | (dstrow[x + 1] >> (8 - pad));
+				dstrow[x] <<= pad;
+			}
+		}
+	}
+	
+	/* 90 clockwise transposes the image read bottom up; 270 transposes it top down and reverses the row order */
+	else
+	{
+		for (y = 0; y < image->length; y += 8)
+		{
+#ifdef __SSE2__
+			/* take 16 rows at a time while they're all there */
+			if ((y % 16) == 0 && y + 16 <= image->length)
+			{
+				for (i = 0; i < 16; i++)
+				{
+					srcy = (turns == 1) ? (image->length - 1 - (y + i)) : (y + i);
+					srcrows[i] = image->pixels + srcy * image->rowbytes;
+				}
+				for (x = 0; x < image->rowbytes; x++)
+					bilevel_image_transpose_block16(image, y, x, srcrows, result, turns == 3);
+				y += 8;
+				continue;
+			}
+#endif
+			for (i = 0; i < 8; i++)
+			{
+				srcy = (turns == 1) ? (image->length - 1 - (y + i)) : (y + i);
+				srcrows[i] = (y + i < image->length) ? (image->pixels + srcy * image->rowbytes) : NULL;
+			}
+			for (x = 0; x < image->rowbytes; x++)
+				bilevel_image_transpose_block(image, y, x, srcrows, result, turns == 3);
+		}
+	}
+	return result;
+}
+
+static gray_image *
+gray_image_rotate_quarter(const gray_image *image, int turns)
+{
+	gray_image *result;
+	uint32 x, y;
+	
+	/* allocate memory for the destination image; quarter turns swap the dimensions and resolutions */
+	turns &= 3;
+	if (turns & 1)
+		result = gray_image_alloc(image->length, image->width, image);
+	else
+		result = gray_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "gray_image_rotate_quarter: Out of memory allocating gray %dx%d\n", image->length, image->width);
+		return NULL;
+	}
+	if (turns & 1)
+	{
+		result->xres = image->yres;
+		result->yres = image->xres;
+	}
+	
+	/* walk the source in order, dropping each sample where the turn puts it */
+	for (y = 0; y < image->length; y++)
+	{
+		const uint8 *src = image->pixels + y * image->width;
+		for (x = 0; x < image->width; x++)
+		{
+			if (turns == 0)
+				result->pixels[y * result->width + x] = src[x];
+			else if (turns == 1)
+				result->pixels[x * result->width + (image->length - 1 - y)] = src[x];
+			else if (turns == 2)
+				result->pixels[(image->length - 1 - y) * result->width + (image->width - 1 - x)] = src[x];
+			else
+				result->pixels[(image->width - 1 - x) * result->width + y] = src[x];
+		}
+	}
+	return result;
 }
 
-static bilevel_image *
-bilevel_image_auto_rotate(const bilevel_image *image, char *status)
+static int
+bilevel_image_is_sideways(const bilevel_image *image)
 {
-	rotate_worker_data left;
-	rotate_worker_data right;
-	rotate_worker_data middle;
-	rotate_worker_data leftmid;
-	rotate_worker_data rightmid;
-	HANDLE eventlist[5];
-	int pass = 0;
+	bilevel_image *preview;
+	long long hsum, vsum;
 	
-	/* set up the workers */
-	left.image = right.image = middle.image = leftmid.image = rightmid.image = image;
-	eventlist[0] = left.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[1] = right.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[2] = middle.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[3] = leftmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[4] = rightmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	/* compare horizontal and vertical run energy on a reduced preview; at 90 degrees the two simply swap places */
+	preview = bilevel_image_reduce_4x(image);
+	if (preview == NULL)
+		return FALSE;
+	bilevel_image_rotate_runs(preview, 0.0, &hsum, &vsum);
+	bilevel_image_free(preview);
+	
+	/* staff lines and rules make upright pages strongly horizontal */
+	return vsum > 2 * hsum;
+}
 
-	/* scan from -10 .. 10 */	
-	left.angle = -10.0;
-	right.angle = 10.0;
+static bilevel_image *
+bilevel_image_orient(bilevel_image *image, worker_progress *progress)
+{
+	bilevel_image *result;
 	
-	/* iterate until we've found the best match within 1/1000th of a degree */
-	while (fabs(right.angle - left.angle) > 0.001)
+	/* in auto mode, only turn pages that look sideways */
+	if (orient_auto)
 	{
-		int count = 0;
-		
-		pass++;
-		sprintf(status, "Scanning for best angle.... %7.3f |%.*s%.*s|", middle.angle, pass, "================", 16-pass, "                ");
+		progress_stage(progress, STAGE_ORIENT_CHECK);
+		if (!bilevel_image_is_sideways(image))
+			return image;
+	}
+	
+	/* turn it, freeing the original either way */
+	progress_stage(progress, STAGE_TURNING);
+	result = bilevel_image_rotate_quarter(image, orient_turns);
+	bilevel_image_free(image);
+	return result;
+}
 
-		/* on the first pass, we have to compute all 5 */
-		if (pass == 1)
-		{
-			left.angle = -10.0;
-			ResetEvent(left.event);
-			QueueUserWorkItem(bilevel_image_auto_rotate_worker, &left, WT_EXECUTEDEFAULT);
+static bilevel_profile *
+bilevel_image_profile(const bilevel_image *image)
+{
+	bilevel_profile *profile;
+	uint64 spread[256];
+	uint64 *lanes;
+	uint32 x, y, k, rowsleft;
 	
-			right.angle = 10.0;
-			ResetEvent(right.event);
-			QueueUserWorkItem(bilevel_image_auto_rotate_worker, &right, WT_EXECUTEDEFAULT);
+	/* allocate the profile with both histograms in one block, plus a word of 8 byte-wide column counters per source byte */
+	profile = _TIFFmalloc(sizeof(*profile) + (image->length + image->rowbytes * 8) * sizeof(uint32));
+	lanes = _TIFFmalloc(image->rowbytes * sizeof(uint64));
+	if (profile == NULL || lanes == NULL)
+	{
+		fprintf(stderr, "bilevel_image_profile: Out of memory allocating profile for %dx%d\n", image->width, image->length);
+		if (profile != NULL)
+			_TIFFfree(profile);
+		if (lanes != NULL)
+			_TIFFfree(lanes);
+		return NULL;
+	}
+	profile->width = image->width;
+	profile->length = image->length;
+	profile->rows = (uint32 *)(profile + 1);
+	profile->columns = profile->rows + image->length;
+	memset(profile->columns, 0, image->rowbytes * 8 * sizeof(uint32));
+	memset(lanes, 0, image->rowbytes * sizeof(uint64));
 	
-			middle.angle = 10.0;
-			ResetEvent(middle.event);
-			QueueUserWorkItem(bilevel_image_auto_rotate_worker, &middle, WT_EXECUTEDEFAULT);
-		}
+	/* spread[b] puts each bit of b in its own byte, leftmost pixel lowest */
+	for (x = 0; x < 256; x++)
+		for (spread[x] = 0, k = 0; k < 8; k++)
+			if (x & (0x80 >> k))
+				spread[x] |= (uint64)1 << (8 * k);
 	
-		/* on all passes we compute the remaining 2 */
-		leftmid.angle = (left.angle + middle.angle) / 2.0;
-		ResetEvent(leftmid.event);
-		QueueUserWorkItem(bilevel_image_auto_rotate_worker, &leftmid, WT_EXECUTEDEFAULT);
-
-		rightmid.angle = (right.angle + middle.angle) / 2.0;
-		ResetEvent(rightmid.event);
-		QueueUserWorkItem(bilevel_image_auto_rotate_worker, &rightmid, WT_EXECUTEDEFAULT);
+	/* one row-major pass: popcount each row for its total and add its bits to the column counters */
+	rowsleft = 255;
+	for (y = 0; y < image->length; y++)
+	{
+		const uint8 *src = image->pixels + y * image->rowbytes;
 		
-		/* wait for everyone to be done */
-		WaitForMultipleObjects(5, eventlist, TRUE, INFINITE);
-
-		/* if leftmid is our best candidate, make it the new middle */
-		if (leftmid.score >= left.score && leftmid.score >= middle.score)
+		profile->rows[y] = bits->popcount(src, image->rowbytes);
+		for (x = 0; x < image->rowbytes; x++)
 		{
-			right.angle = middle.angle, right.score = middle.score;
-			middle.angle = leftmid.angle, middle.score = leftmid.score;
+			/* skip white a word at a time */
+			if (x % 8 == 0 && x + 8 <= image->rowbytes)
+			{
+				uint64 word;
+				memcpy(&word, src + x, sizeof(word));
+				if (word == 0)
+				{
+					x += 7;
+					continue;
+				}
+			}
+			lanes[x] += spread[src[x]];
 		}
-
-		/* if middle is our best candidate, it remains the middle */
-		else if (middle.score >= leftmid.score && middle.score >= rightmid.score)
+		
+		/* the byte counters would overflow after 255 rows, so empty them into the column totals first */
+		if (--rowsleft == 0 || y == image->length - 1)
 		{
-			left.angle = leftmid.angle, left.score = leftmid.score;
-			right.angle = rightmid.angle, right.score = rightmid.score;
+			for (x = 0; x < image->rowbytes; x++)
+				if (lanes[x] != 0)
+				{
+					for (k = 0; k < 8; k++)
+						profile->columns[x * 8 + k] += (uint32)(lanes[x] >> (8 * k)) & 0xff;
+					lanes[x] = 0;
+				}
+			rowsleft = 255;
 		}
+	}
+	_TIFFfree(lanes);
+	return profile;
+}
 
-		/* if rightmid is our best candidate, make it the new middle */
-		else if (rightmid.score >= right.score && rightmid.score >= middle.score)
-		{
-			left.angle = middle.angle, left.score = middle.score;
-			middle.angle = rightmid.angle, middle.score = rightmid.score;
-		}
+static void
+bilevel_profile_free(bilevel_profile *profile)
+{
+	_TIFFfree(profile);
+}
 
-		/* warn about non-convergence */
-		else
-		{
-			sprintf(status, "Results not converging as expected: %lld - %lld - %lld - %lld - %lld", left.score, leftmid.score, middle.score, rightmid.score, right.score);
-			left.angle = leftmid.angle, left.score = leftmid.score;
-			right.angle = rightmid.angle, right.score = rightmid.score;
-		}
-	}
+static void
+bilevel_profile_margins(const bilevel_profile *profile, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+{
+	/* a row or column is content once more than 0.1% of it is black */
+	if (top != NULL)
+		for (*top = 0; *top < profile->length; *top += 1)
+			if (profile->rows[*top] * 1000 > profile->width)
+				break;
+	if (bottom != NULL)
+		for (*bottom = 0; *bottom < profile->length; *bottom += 1)
+			if (profile->rows[profile->length - 1 - *bottom] * 1000 > profile->width)
+				break;
+	if (left != NULL)
+		for (*left = 0; *left < profile->width; *left += 1)
+			if (profile->columns[*left] * 1000 > profile->length)
+				break;
+	if (right != NULL)
+		for (*right = 0; *right < profile->width; *right += 1)
+			if (profile->columns[profile->width - 1 - *right] * 1000 > profile->length)
+				break;
+}
+
+static int
+bilevel_image_is_blank(const bilevel_image *image)
+{
+	bilevel_profile *profile;
+	uint32 top;
 	
-	/* free the events */
-	CloseHandle(left.event);
-	CloseHandle(right.event);
-	CloseHandle(middle.event);
-	CloseHandle(leftmid.event);
-	CloseHandle(rightmid.event);
+	/* blank if no row has enough black to count as content */
+	profile = bilevel_image_profile(image);
+	if (profile == NULL)
+		return FALSE;
+	bilevel_profile_margins(profile, &top, NULL, NULL, NULL);
+	bilevel_profile_free(profile);
+	return (top == image->length);
+}
 
-	return bilevel_image_rotate(image, middle.angle);
+static int
+bilevel_image_is_straight(const bilevel_image *image)
+{
+	bilevel_image *preview;
+	long long score;
+	double angle;
+	int straight;
+	
+	/* on a 4x reduced preview, see if skewing one pixel either way scores worse than leaving it alone */
+	preview = bilevel_image_reduce_4x(image);
+	if (preview == NULL)
+		return FALSE;
+	angle = bilevel_image_edge_angle(preview, 1.0);
+	score = bilevel_image_rotate_score(preview, 0.0);
+	straight = (score >= bilevel_image_rotate_score(preview, -angle) && score >= bilevel_image_rotate_score(preview, angle));
+	bilevel_image_free(preview);
+	
+	/* if so, confirm at full resolution that nothing beyond half an edge pixel scores better */
+	if (straight)
+	{
+		angle = bilevel_image_edge_angle(image, 0.5);
+		score = bilevel_image_rotate_score(image, 0.0);
+		straight = (score >= bilevel_image_rotate_score(image, -angle) && score >= bilevel_image_rotate_score(image, angle));
+	}
+	return straight;
 }
 
 static int
@@ -788,7 +2518,7 @@ build_worker_list(char *files[], int count)
 			(*workerlist_tailptr)->filename = name;
 			(*workerlist_tailptr)->name = fullname;
 			(*workerlist_tailptr)->index = index;
-			strcpy((*workerlist_tailptr)->status, "Loading...");
+			progress_stage(&(*workerlist_tailptr)->progress, STAGE_LOADING);
 
 			/* add to the list */
 			workerlist_tailptr = &(*workerlist_tailptr)->next;
@@ -798,6 +2528,176 @@ build_worker_list(char *files[], int count)
 	return 0;
 }
 
+static void
+progress_format(const worker_progress *progress, char *text, size_t size)
+{
+	worker_progress copy;
+	
+	/* take a consistent snapshot, then format it here rather than in the workers */
+	progress_read(progress, &copy);
+	switch (copy.stage)
+	{
+		case STAGE_SCANNING:
+			snprintf(text, size, "Scanning for best angle.... %7.3f |%.*s%.*s|", copy.arg / 1000.0, (int)copy.value, "================", 16 - (int)copy.value, "                ");
+			break;
+
+		case STAGE_NOT_CONVERGING:
+			snprintf(text, size, "Results not converging as expected on pass %u", copy.value);
+			break;
+
+		case STAGE_MORPHOLOGY:
+			snprintf(text, size, "Morphology %c%dx%d...", morph_ops[copy.arg].op, morph_ops[copy.arg].width, morph_ops[copy.arg].length);
+			break;
+
+		case STAGE_MESSAGE:
+			snprintf(text, size, "%s", copy.message);
+			break;
+
+		default:
+			if (copy.total != 0)
+				snprintf(text, size, "%s %3u%%", stage_text[copy.stage], (unsigned)(100.0 * copy.value / copy.total));
+			else
+				snprintf(text, size, "%s", stage_text[copy.stage]);
+			break;
+	}
+}
+
+static void
+write_queue_add(image_worker_data *data)
+{
+	LARGE_INTEGER now;
+	
+	/* append to the queue and wake the writers */
+	progress_stage(&data->progress, STAGE_WRITE_QUEUED);
+	data->writing = TRUE;
+	data->writenext = NULL;
+	QueryPerformanceCounter(&now);
+	EnterCriticalSection(&writesect);
+	data->writequeued = now.QuadPart;
+	*writetail = data;
+	writetail = &data->writenext;
+	writedepth++;
+	writedepthsum += writedepth;
+	if (writedepth > writemaxdepth)
+		writemaxdepth = writedepth;
+	SetEvent(writeevent);
+	LeaveCriticalSection(&writesect);
+}
+
+static DWORD WINAPI
+writer_thread(LPVOID param)
+{
+	image_worker_data *data;
+	LARGE_INTEGER start, end;
+	int closing, result;
+	
+	for (;;)
+	{
+		/* take the oldest page, or sleep until there is one; stop once the queue is closed and empty */
+		EnterCriticalSection(&writesect);
+		data = writehead;
+		closing = writeclosing;
+		if (data != NULL)
+		{
+			writehead = data->writenext;
+			if (writehead == NULL)
+				writetail = &writehead;
+			writedepth--;
+		}
+		else if (!closing)
+			ResetEvent(writeevent);
+		LeaveCriticalSection(&writesect);
+		if (data == NULL)
+		{
+			if (closing)
+				break;
+			WaitForSingleObject(writeevent, INFINITE);
+			continue;
+		}
+		
+		/* the backup, open, write and close all happen here, off the workers; take the page's
+		   thread id meanwhile so libtiff errors are reported against it */
+		QueryPerformanceCounter(&start);
+		progress_stage(&data->progress, STAGE_WRITING);
+		data->threadid = GetCurrentThreadId();
+		result = bilevel_image_save_image(data);
+		data->threadid = -1;
+		pageout_encoded_free(data->encoded);
+		data->encoded = NULL;
+		QueryPerformanceCounter(&end);
+		
+		/* on failure, leave any error libtiff gave up on the page's status line */
+		if (result == 0)
+			progress_stage(&data->progress, STAGE_DONE);
+		else
+		{
+			if (data->progress.stage != STAGE_MESSAGE)
+				progress_stage(&data->progress, STAGE_ERROR);
+			data->error = TRUE;
+		}
+		
+		EnterCriticalSection(&writesect);
+		writecount++;
+		writewaitsum += start.QuadPart - data->writequeued;
+		if (start.QuadPart - data->writequeued > writewaitmax)
+			writewaitmax = start.QuadPart - data->writequeued;
+		writetimesum += end.QuadPart - start.QuadPart;
+		if (end.QuadPart - start.QuadPart > writetimemax)
+			writetimemax = end.QuadPart - start.QuadPart;
+		LeaveCriticalSection(&writesect);
+		data->writing = FALSE;
+	}
+	SetEvent((HANDLE)param);
+	return 0;
+}
+
+static void
+write_queue_start(void)
+{
+	int writer;
+	
+	InitializeCriticalSection(&writesect);
+	writeevent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	for (writer = 0; writer < writercount; writer++)
+	{
+		writerdone[writer] = CreateEvent(NULL, TRUE, FALSE, NULL);
+		QueueUserWorkItem(writer_thread, writerdone[writer], WT_EXECUTELONGFUNCTION);
+	}
+}
+
+static void
+write_queue_finish(void)
+{
+	int writer;
+	
+	/* let the writers drain the queue and exit */
+	EnterCriticalSection(&writesect);
+	writeclosing = TRUE;
+	SetEvent(writeevent);
+	LeaveCriticalSection(&writesect);
+	for (writer = 0; writer < writercount; writer++)
+	{
+		WaitForSingleObject(writerdone[writer], INFINITE);
+		CloseHandle(writerdone[writer]);
+	}
+	CloseHandle(writeevent);
+}
+
+static void
+report_write_metrics(void)
+{
+	LARGE_INTEGER frequency;
+	double ms;
+	
+	if (writecount == 0)
+		return;
+	QueryPerformanceFrequency(&frequency);
+	ms = 1000.0 / (double)frequency.QuadPart;
+	printf("%d pages written by %d writers, queue depth %.1f average, %d max\n", writecount, writercount, (double)writedepthsum / writecount, writemaxdepth);
+	printf("write latency: %.1f ms average, %.1f ms max in the queue; %.1f ms average, %.1f ms max writing\n",
+			writewaitsum * ms / writecount, writewaitmax * ms, writetimesum * ms / writecount, writetimemax * ms);
+}
+
 static int
 queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back)
 {
@@ -809,6 +2709,7 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 	for (worker = workerlist; worker != NULL; worker = worker->next)
 	{
 		worker->done = worker->error = FALSE;
+		worker->threadid = 0;
 		QueueUserWorkItem(callback, worker, WT_EXECUTEDEFAULT);
 	}
 
@@ -833,7 +2734,8 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 		for (worker = workerlist; worker != NULL; worker = worker->next)
 		{
 			char namebuf[30];
-			if (!worker->done)
+			char status[100];
+			if (!worker->done || worker->writing)
 				alldone = FALSE;
 			if (worker->error)
 				errorcount++;
@@ -846,7 +2748,8 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 			}
 			else
 				strcpy(namebuf, worker->name);
-			printf("%20.20s: %-59.59s\n", namebuf, worker->status);
+			progress_format(&worker->progress, status, sizeof(status));
+			printf("%20.20s: %-59.59s\n", namebuf, status);
 		}
 		
 		/* on error, just bail */
@@ -865,12 +2768,17 @@ rotate_image(PVOID param)
 {
 	image_worker_data *data = param;
 	bilevel_image *tempimage;
+	gray_image *tempgray;
+	double angle;
+	int rotateit;
+	int turned = FALSE;
+	int result;
 	
 	/* set the thread id */
 	data->threadid = GetCurrentThreadId();
 
 	/* load the image */
-	data->image = bilevel_image_load(data->filename, data->index);
+	data->image = bilevel_image_load(data->filename, data->index, graytoo ? &data->gray : NULL);
 	if (data->image == NULL)
 	{
 		data->error = TRUE;
@@ -879,26 +2787,166 @@ rotate_image(PVOID param)
 
 	/* clean the image */
 	if (cleanit)
-		bilevel_image_clean(data->image, data->status);
+		bilevel_image_clean(data->image, &data->progress);
+	
+	/* fix the orientation */
+	if (orient_turns != 0)
+	{
+		tempimage = bilevel_image_orient(data->image, &data->progress);
+		turned = (tempimage != data->image);
+		data->image = tempimage;
+		if (data->image == NULL)
+		{
+			if (data->gray != NULL)
+				gray_image_free(data->gray);
+			data->gray = NULL;
+			data->error = TRUE;
+			goto done;
+		}
+		
+		/* turn the gray copy to match */
+		if (turned && data->gray != NULL)
+		{
+			tempgray = gray_image_rotate_quarter(data->gray, orient_turns);
+			gray_image_free(data->gray);
+			data->gray = tempgray;
+		}
+	}
 	
-	/* rotate the image */
-	tempimage = bilevel_image_auto_rotate(data->image, data->status);
-	bilevel_image_free(data->image);
-	data->image = tempimage;
+	/* apply any morphology */
+	if (morph_count != 0)
+	{
+		data->image = bilevel_image_morphology(data->image, &data->progress);
+		if (data->image == NULL)
+		{
+			if (data->gray != NULL)
+				gray_image_free(data->gray);
+			data->gray = NULL;
+			progress_stage(&data->progress, STAGE_ERROR);
+			data->error = TRUE;
+			goto done;
+		}
+	}
+	
+	/* cheaply check for an image that is blank or already straight before searching for the best angle */
+	progress_stage(&data->progress, STAGE_CHECKING);
+	if (bilevel_image_is_blank(data->image) || bilevel_image_is_straight(data->image))
+		angle = 0.0;
+	else
+		angle = bilevel_image_find_angle(data->image, &data->progress);
+	rotateit = (fabs(angle) >= bilevel_image_edge_angle(data->image, 0.5));
+	
+	/* rotate and save the gray copy first, so it's gone before the bilevel image is rotated */
+	if (data->gray != NULL)
+	{
+		if (rotateit)
+		{
+			progress_stage(&data->progress, STAGE_ROTATING_GRAY);
+			tempgray = gray_image_rotate(data->gray, angle);
+			gray_image_free(data->gray);
+			data->gray = tempgray;
+		}
+		progress_stage(&data->progress, STAGE_SAVING_GRAY);
+		result = (data->gray != NULL) ? gray_image_save_image(data) : -1;
+		if (data->gray != NULL)
+			gray_image_free(data->gray);
+		data->gray = NULL;
+		if (result != 0)
+		{
+			progress_stage(&data->progress, STAGE_ERROR);
+			goto done;
+		}
+	}
+	
+	/* rotate the image if it would move the edges by at least half a pixel; when streaming, the rotation happens while saving */
+	data->angle = 0.0;
+	if (rotateit)
+	{
+		if (streamit)
+			data->angle = angle;
+		else
+		{
+			tempimage = bilevel_image_rotate(data->image, angle);
+			bilevel_image_free(data->image);
+			data->image = tempimage;
+		}
+	}
+	
+	/* otherwise, if we didn't clean, turn or filter, try to keep the original compressed data */
+	else if (!cleanit && !turned && morph_count == 0)
+	{
+		progress_stage(&data->progress, STAGE_COPYING);
+		result = bilevel_image_copy_original(data);
+		if (result <= 0)
+		{
+			progress_stage(&data->progress, (result == 0) ? STAGE_DONE : STAGE_ERROR);
+			goto done;
+		}
+	}
 
-	/* save ther result */
-	strcpy(data->status, "Saving...");
+	/* encode the result and hand it to the writers */
+	if (writercount != 0)
+	{
+		progress_stage(&data->progress, STAGE_ENCODING);
+		if (bilevel_image_encode(data) != 0)
+			progress_stage(&data->progress, STAGE_ERROR);
+		else
+			write_queue_add(data);
+		goto done;
+	}
+
+	/* or save ther result right here */
+	progress_stage(&data->progress, STAGE_SAVING);
 	if (bilevel_image_save_image(data) != 0)
-		strcpy(data->status, "Error!");
+		progress_stage(&data->progress, STAGE_ERROR);
 	else
-		strcpy(data->status, "Done.");
+		progress_stage(&data->progress, STAGE_DONE);
 
 done:
-	data->threadid = -1;
+	bilevel_image_release_spare();
+	
+	/* once the page is queued, its thread id belongs to the writer that saves it */
+	if (!data->writing)
+		data->threadid = -1;
 	data->done = TRUE;
 	return 0;
 }
 
+static int
+parse_morph_ops(char *ops)
+{
+	char *op;
+	
+	/* comma-separated list of e/d/o/c followed by WxH */
+	morph_count = 0;
+	for (op = strtok(ops, ","); op != NULL; op = strtok(NULL, ","))
+	{
+		char *end;
+		if (morph_count == MAX_MORPH_OPS || op[0] == 0 || strchr("edoc", op[0]) == NULL)
+			return -1;
+		morph_ops[morph_count].op = op[0];
+		morph_ops[morph_count].width = strtoul(op + 1, &end, 10);
+		if (*end != 'x')
+			return -1;
+		morph_ops[morph_count].length = strtoul(end + 1, &end, 10);
+		if (*end != 0 || morph_ops[morph_count].width == 0 || morph_ops[morph_count].length == 0)
+			return -1;
+		morph_count++;
+	}
+	return 0;
+}
+
+static void
+report_page_faults(void)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	
+	/* page faults mostly come from touching freshly allocated page memory */
+	counters.cb = sizeof(counters);
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		printf("%lu page faults, %lu KB peak working set\n", (unsigned long)counters.PageFaultCount, (unsigned long)(counters.PeakWorkingSetSize / 1024));
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -909,16 +2957,59 @@ main(int argc, char* argv[])
 	char *xptr;
 
 	InitializeCriticalSection(&critsect);
+	bit_kernels_init();
+	spareslot = TlsAlloc();
 
 	/* parse arguments */
-	while ((c = getopt(argc, argv, "l")) != -1)
+	while ((c = getopt(argc, argv, "glm:o:sS:t:w:")) != -1)
 	{
 		switch (c)
 		{
+			case 'g':
+				graytoo = 1;
+				break;
+
 			case 'l':
 				cleanit = 1;
 				break;
 
+			case 'm':
+				if (parse_morph_ops(optarg) != 0)
+					usage();
+				break;
+
+			case 'o':
+				if (strncmp(optarg, "auto", 4) == 0)
+				{
+					orient_auto = 1;
+					optarg += 4;
+				}
+				orient_turns = (*optarg != 0) ? atoi(optarg) : 90;
+				if (orient_turns != 90 && orient_turns != 270 && (orient_turns != 180 || orient_auto))
+					usage();
+				orient_turns /= 90;
+				break;
+
+			case 's':
+				streamit = 1;
+				break;
+
+			case 'S':
+				if (atoi(optarg) < 1)
+					usage();
+				pageout_strip_rows = atoi(optarg);
+				break;
+
+			case 't':
+				shear_tolerance = atof(optarg) / 100.0;
+				break;
+
+			case 'w':
+				writercount = atoi(optarg);
+				if (writercount < 0 || writercount > MAX_WRITERS)
+					usage();
+				break;
+
 			case '?':
 				usage();
 				break;
@@ -939,10 +3030,17 @@ main(int argc, char* argv[])
 	if (build_worker_list(&argv[optind], argc - optind) != 0)
 		return -1;
 
-	/* rotate each image and compute the inner margins if cropping */
+	/* rotate each image, with the writers saving pages as the workers finish them */
+	write_queue_start();
 	if (queue_and_wait_for_workers(rotate_image, FALSE) != 0)
+	{
+		write_queue_finish();
 		return -1;
+	}
+	write_queue_finish();
 	
+	report_write_metrics();
+	report_page_faults();
 	return (0);
 }
 
@@ -950,7 +3048,16 @@ main(int argc, char* argv[])
 char* stuff[] = {
 "usage: tiffalign [options] input.tif [input2.tif [input3.tif [...]]]",
 "where options are:",
+" -g                also save gray pages as 8-bit name-gray.tif, rotated smoothly",
 " -l                clean the TIFF",
+" -m op[,op...]     morphology before deskewing: e/d/o/c (erode/dilate/open/close)",
+"                   with a WxH rectangle, e.g. c9x1 to close gaps in staff lines",
+" -o turn           turn pages by 90, 180 or 270 degrees clockwise first",
+" -o auto[270]      turn only pages that look sideways (by 90 unless given)",
+" -s                stream rotated rows to the encoder (less memory, always samples)",
+" -S rows           write G4 strips of this many rows, encoded in parallel",
+" -t pct            max % of black pixels fast rotation may misplace (default 2, 0 = sample)",
+" -w writers        threads writing the files behind the workers (default 2, 0 = none)",
 NULL
 };
 
@@ -10,8 +10,11 @@
 #endif
 
 #include <windows.h>
+#include <psapi.h>
 
 #include "tiffio.h"
+#include "bitkernels.h"
+#include "pageout.h"
 
 typedef struct bilevel_image bilevel_image;
 struct bilevel_image
@@ -23,10 +26,23 @@ struct bilevel_image
 	float	xres;
 	float	yres;
 	uint16	resunit;
+	uint16	bitspersample;
 	uint16	rowbytes;
+	uint32	capacity;
 	uint8	pixels[1];
 };
 
+typedef struct worker_progress worker_progress;
+struct worker_progress
+{
+	volatile LONG	sequence;
+	volatile uint32	stage;
+	volatile uint32	total;
+	volatile long	arg;
+	volatile uint32	value;
+	char		message[100];
+};
+
 typedef struct image_worker_data image_worker_data;
 struct image_worker_data
 {
@@ -39,30 +55,108 @@ struct image_worker_data
 	volatile uint32 done;
 	volatile uint32 error;
 	bilevel_image *target;
+	int			finalindex;
 	int			lefthalf;
 	int			backpair;
-	char 		status[100];
+	worker_progress progress;
 };
 
 static CRITICAL_SECTION critsect;
+static DWORD spareslot = TLS_OUT_OF_INDEXES;
+static uint32 *rgbabuffer = NULL;
+static uint32 rgbabuffersize = 0;
 
 static image_worker_data *workerlist = NULL;
 static int workercount = 0;
 
 static float target_resolution = 600;
+static int area_threshold = 0;
+static int gray_output = 0;
 static float target_scale = 1.0f;
 static uint32 targetwidth = 0;
 static uint32 targetlength = 0;
 static int flipping = 0;
 
+/* progress stages, indexing stage_text */
+#define STAGE_LOADING			0
+#define STAGE_SCALING			1
+#define STAGE_ENCODING			2
+#define STAGE_DONE				3
+#define STAGE_MESSAGE			4
+
+static const char *stage_text[] =
+{
+	"Loading...", "Scaling...", "Encoding...", "Done", ""
+};
+
 static int pagecount;
 static bilevel_image **finalpage;
+static pageout_encoded **encodedpage;
+static volatile LONG *pagewriters;
 
 
 static	void usage(void);
 
 #define FACTOR(val, size)  ((val < size / 6 || val > 5 * size / 6) ? 1 : 3)
 
+static void
+progress_set(worker_progress *progress, uint32 stage, uint32 total, long arg)
+{
+	/* an odd sequence number tells the reporter an update is under way */
+	InterlockedIncrement(&progress->sequence);
+	progress->stage = stage;
+	progress->total = total;
+	progress->arg = arg;
+	progress->value = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_stage(worker_progress *progress, uint32 stage)
+{
+	progress_set(progress, stage, 0, 0);
+}
+
+static void
+progress_update(worker_progress *progress, uint32 value)
+{
+	/* a single aligned store, cheap enough for inner loops; the reporter reads it unlocked */
+	if (progress != NULL)
+		progress->value = value;
+}
+
+static void
+progress_message(worker_progress *progress, const char *format, va_list args)
+{
+	InterlockedIncrement(&progress->sequence);
+	vsnprintf(progress->message, sizeof(progress->message), format, args);
+	progress->stage = STAGE_MESSAGE;
+	progress->total = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_read(const worker_progress *progress, worker_progress *copy)
+{
+	LONG sequence;
+	
+	/* retry until no update overlapped our copy */
+	do
+	{
+		sequence = progress->sequence;
+		MemoryBarrier();
+		copy->stage = progress->stage;
+		copy->total = progress->total;
+		copy->arg = progress->arg;
+		memcpy(copy->message, progress->message, sizeof(copy->message));
+		MemoryBarrier();
+	} while ((sequence & 1) != 0 || sequence != progress->sequence);
+	copy->message[sizeof(copy->message) - 1] = 0;
+	copy->value = progress->value;
+	if (copy->value > copy->total)
+		copy->value = copy->total;
+}
+
 static void
 warning_handler(const char *module, const char *format, va_list args)
 {
@@ -93,7 +187,7 @@ warning_handler_ext(thandle_t handle, const char *module, const char *format, va
 	/* if we found one, output a warning */
 //	if (worker != NULL)
 //		printf(format, args);
-//		vsnprintf(worker->status, sizeof(worker->status), format, args);
+//		progress_message(&worker->progress, format, args);
 }
 
 static void
@@ -114,7 +208,7 @@ error_handler_ext(thandle_t handle, const char *module, const char *format, va_l
 	/* if we found one, output an error */
 	if (worker != NULL)
 //		printf(format, args);
-		vsnprintf(worker->status, sizeof(worker->status), format, args);
+		progress_message(&worker->progress, format, args);
 }
 
 static bilevel_image *
@@ -122,6 +216,7 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 {
 	uint16 rowbytes = (width + 7) / 8;
 	bilevel_image *image;
+	uint32 capacity;
 	
 	/* borrow width/height from clone if not specified */
 	if (clonefrom != NULL)
@@ -130,17 +225,35 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 		if (length == 0) length = clonefrom->length;
 	}
 	
-	/* allocate memory for the image */
+	/* reuse this thread's spare image if it's big enough, otherwise allocate memory for the image */
 	rowbytes = (width + 7) / 8;
-	image = _TIFFmalloc(sizeof(*image) + length * rowbytes);
-	if (image == NULL)
-		return NULL;
+	image = (spareslot != TLS_OUT_OF_INDEXES) ? TlsGetValue(spareslot) : NULL;
+	if (image != NULL)
+	{
+		TlsSetValue(spareslot, NULL);
+		if (image->capacity < length * rowbytes)
+		{
+			_TIFFfree(image);
+			image = NULL;
+		}
+	}
+	if (image != NULL)
+		capacity = image->capacity;
+	else
+	{
+		capacity = length * rowbytes;
+		image = _TIFFmalloc(sizeof(*image) + capacity);
+		if (image == NULL)
+			return NULL;
+	}
 	
 	/* clear to 0 and fill in the basics */
 	memset(image, 0, sizeof(*image) + length * rowbytes);
 	image->width = width;
 	image->length = length;
+	image->bitspersample = 1;
 	image->rowbytes = rowbytes;
+	image->capacity = capacity;
 	
 	/* clone remaining fields */
 	if (clonefrom != NULL)
@@ -157,7 +270,50 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 static void
 bilevel_image_free(bilevel_image *image)
 {
-	_TIFFfree(image);
+	bilevel_image *spare;
+	
+	/* keep the larger of this and the current spare around for the next stage on this thread */
+	if (spareslot != TLS_OUT_OF_INDEXES && image != NULL)
+	{
+		spare = TlsGetValue(spareslot);
+		if (spare == NULL || spare->capacity < image->capacity)
+		{
+			TlsSetValue(spareslot, image);
+			image = spare;
+		}
+	}
+	if (image != NULL)
+		_TIFFfree(image);
+}
+
+/* free this thread's spare; it only pays off between the stages of one page, and a pool thread
+   may not see another page for a long time */
+static void
+bilevel_image_release_spare(void)
+{
+	bilevel_image *spare;
+	
+	if (spareslot != TLS_OUT_OF_INDEXES)
+	{
+		spare = TlsGetValue(spareslot);
+		TlsSetValue(spareslot, NULL);
+		if (spare != NULL)
+			_TIFFfree(spare);
+	}
+}
+
+static uint32 *
+get_rgba_buffer(uint32 bytes)
+{
+	/* loads are serialized by the critical section, so they all share one buffer that only ever grows */
+	if (bytes > rgbabuffersize)
+	{
+		if (rgbabuffer != NULL)
+			_TIFFfree(rgbabuffer);
+		rgbabuffer = _TIFFmalloc(bytes);
+		rgbabuffersize = (rgbabuffer != NULL) ? bytes : 0;
+	}
+	return rgbabuffer;
 }
 
 static bilevel_image *
@@ -204,10 +360,11 @@ bilevel_image_load(const char *name, int index)
 
 	/* allocate RGBA buffer */
 EnterCriticalSection(&critsect);
-	rgba = _TIFFmalloc(width * length * 4);
+	rgba = get_rgba_buffer(width * length * 4);
 	if (rgba == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating RGBA %dx%d\n", name, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 
@@ -215,6 +372,7 @@ EnterCriticalSection(&critsect);
 	if (TIFFReadRGBAImageOriented(in, width, length, rgba, ORIENTATION_TOPLEFT, 1) == 0)
 	{
 		fprintf(stderr, "%s: Error reading image\n", name);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	
@@ -223,6 +381,7 @@ EnterCriticalSection(&critsect);
 	if (image == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating bilevel %dx%d\n", name, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	image->name = name;
@@ -249,8 +408,6 @@ EnterCriticalSection(&critsect);
 		}
 	}
 
-	/* free memory */
-	_TIFFfree(rgba);
 LeaveCriticalSection(&critsect);
 	TIFFClose(in);
 	return image;
@@ -258,65 +415,298 @@ LeaveCriticalSection(&critsect);
 error:
 	if (image != NULL)
 		bilevel_image_free(image);
-	if (rgba != NULL)
-		_TIFFfree(rgba);
 	if (in != NULL)
 		TIFFClose(in);
 	return NULL;
 }
 
+/* compress a final page and let its pixels go */
+static int
+bilevel_image_encode_page(int index)
+{
+	bilevel_image *image = finalpage[index];
+	pageout_page page;
+	
+	memset(&page, 0, sizeof(page));
+	page.width = image->width;
+	page.length = image->length;
+	page.bitspersample = image->bitspersample;
+	page.orientation = image->orientation;
+	page.xres = image->xres;
+	page.yres = image->yres;
+	page.resunit = image->resunit;
+	page.pixels = image->pixels;
+	page.rowbytes = image->rowbytes;
+	encodedpage[index] = pageout_encode_page(&page);
+	if (encodedpage[index] == NULL)
+		return -1;
+	bilevel_image_free(image);
+	finalpage[index] = NULL;
+	return 0;
+}
+
 static int
 bilevel_image_save_images(const char *name)
 {
-	TIFF *out;
-	uint32 y;
+	pageout_file *out;
 	int page;
 	
-	out = TIFFOpen(name, "w");
+	out = pageout_open(name);
 	if (out == NULL)
 		return -1;
 
+	/* the workers have compressed their pages already, so this is just appending them in order */
 	for (page = 0; page < pagecount; page++)
 	{
-		bilevel_image *image = finalpage[page];
-
-		TIFFSetField(out, TIFFTAG_IMAGEWIDTH, image->width);
-		TIFFSetField(out, TIFFTAG_IMAGELENGTH, image->length);
-		TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 1);
-		TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
-		TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-		TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_CCITTFAX4);
-		TIFFSetField(out, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
-		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
-		TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, image->length);
-		if (image->orientation != 0) TIFFSetField(out, TIFFTAG_ORIENTATION, image->orientation);
-		if (image->xres != 0) TIFFSetField(out, TIFFTAG_XRESOLUTION, image->xres);
-		if (image->yres != 0) TIFFSetField(out, TIFFTAG_YRESOLUTION, image->yres);
-		if (image->resunit != 0) TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, image->resunit);
-
-		for (y = 0; y < image->length; y++)
-			if (TIFFWriteScanline(out, (tdata_t)(image->pixels + y * image->rowbytes), y, 0) < 0)
-				goto error;
-
-		if (TIFFWriteDirectory(out) == 0)
+		/* except for pages no input landed on */
+		if (encodedpage[page] == NULL && bilevel_image_encode_page(page) != 0)
 			goto error;
+		if (pageout_append(out, encodedpage[page]) != 0)
+			goto error;
+		pageout_encoded_free(encodedpage[page]);
+		encodedpage[page] = NULL;
 	}
 
-	TIFFClose(out);
+	if (pageout_close(out) != 0)
+	{
+		remove(name);
+		return -1;
+	}
 	return 0;
 
 error:
-	TIFFClose(out);
+	pageout_close(out);
 	remove(name);
 	return -1;
 }
 
 static void
-bilevel_image_scale_to_target(const bilevel_image *srcimage, bilevel_image *target, uint32 targetleft, uint32 targettop, uint32 targetwidth, uint32 targetlength, int flip)
+scale_row_mapped(uint8 *dst, const uint8 *src, const uint32 *srccol, uint32 width)
+{
+	uint32 x, pix = 0;
+	
+	/* gather one source pixel per destination pixel, storing each byte as it fills */
+	for (x = 0; x < width; x++)
+	{
+		pix = (pix << 1) | ((src[srccol[x] >> 3] >> (~srccol[x] & 7)) & 1);
+		if ((x & 7) == 7)
+			*dst++ = pix;
+	}
+	if (width & 7)
+		*dst = pix << (8 - (width & 7));
+}
+
+static void
+scale_row_double(uint8 *dst, const uint8 *src, uint32 srcbytes)
+{
+	uint32 x;
+	
+	/* every source pixel becomes two */
+	for (x = 0; x < srcbytes; x++)
+	{
+		uint32 pix = src[x];
+		pix = (pix | (pix << 4)) & 0x0f0f;
+		pix = (pix | (pix << 2)) & 0x3333;
+		pix = (pix | (pix << 1)) & 0x5555;
+		pix |= pix << 1;
+		dst[2 * x] = pix >> 8;
+		dst[2 * x + 1] = pix;
+	}
+}
+
+static void
+scale_row_halve(uint8 *dst, const uint8 *src, uint32 srcbytes)
+{
+	uint32 x;
+	
+	/* keep the second pixel of every pair, which is where the sample points fall */
+	for (x = 0; 2 * x < srcbytes; x++)
+	{
+		uint32 pix = src[2 * x] << 8;
+		if (2 * x + 1 < srcbytes)
+			pix |= src[2 * x + 1];
+		pix &= 0x5555;
+		pix = (pix | (pix >> 1)) & 0x3333;
+		pix = (pix | (pix >> 2)) & 0x0f0f;
+		pix = (pix | (pix >> 4)) & 0x00ff;
+		dst[x] = pix;
+	}
+}
+
+static void
+byte_or_atomic(uint8 *dst, uint8 value)
+{
+	/* OR the byte in place, so bits another worker sets in it at the same time survive */
+	if (value != 0)
+		InterlockedOr8((char volatile *)dst, (char)value);
+}
+
+static void
+row_or_shifted(uint8 *dst, const uint8 *src, uint32 width, int shift)
 {
-	uint32 scaledwidth, scaledlength;
+	uint32 bytes = (width + 7) / 8;
+	uint32 dstbytes = (shift + width + 7) / 8;
+	uint32 x;
+	
+	/* OR a row whose padding bits are clear into dst, starting shift pixels into the first byte; the end
+	   bytes can hold pixels from the other half of the sheet, which another worker may be filling, so
+	   those go through an atomic OR and everything in between is ours alone */
+	if (shift == 0)
+	{
+		byte_or_atomic(dst, src[0]);
+		if (bytes > 2)
+			bits->row_or(dst + 1, src + 1, bytes - 2);
+		if (bytes > 1)
+			byte_or_atomic(dst + bytes - 1, src[bytes - 1]);
+		return;
+	}
+	for (x = 0; x < dstbytes; x++)
+	{
+		uint8 pix = ((x < bytes) ? (src[x] >> shift) : 0) | ((x > 0) ? (uint8)(src[x - 1] << (8 - shift)) : 0);
+		if (x == 0 || x == dstbytes - 1)
+			byte_or_atomic(dst + x, pix);
+		else
+			dst[x] |= pix;
+	}
+}
+
+static void
+bilevel_image_area_scale(const bilevel_image *srcimage, bilevel_image *target, uint32 targetleft, uint32 targettop, uint32 scaledwidth, uint32 scaledlength, int flip, worker_progress *progress)
+{
+	uint32 srcbytes = (srcimage->width + 7) / 8;
+	uint32 scaledbytes = (scaledwidth + 7) / 8;
+	uint32 lastfirst = ~0, lastend = 0;
+	uint32 *boxes;
+	uint64 *lanes;
+	const uint16 *columns;
+	uint8 *scaledrow;
+	uint64 spread[16];
+	uint32 x, y, i, k;
+	int black = FALSE;
+	
+	/* allocate memory: a box per destination column, and two words of four 16-bit column counters per source byte */
+	boxes = _TIFFmalloc(2 * scaledwidth * sizeof(uint32));
+	lanes = _TIFFmalloc(2 * srcbytes * sizeof(uint64));
+	scaledrow = _TIFFmalloc(scaledbytes);
+	if (boxes == NULL || lanes == NULL || scaledrow == NULL)
+	{
+		fprintf(stderr, "bilevel_image_area_scale: Out of memory allocating column counters\n");
+		goto done;
+	}
+	columns = (const uint16 *)lanes;
+	
+	/* spread[n] puts each bit of nibble n in its own 16-bit lane, leftmost pixel lowest */
+	for (x = 0; x < 16; x++)
+		for (spread[x] = 0, k = 0; k < 4; k++)
+			if (x & (8 >> k))
+				spread[x] |= (uint64)1 << (16 * k);
+	
+	/* each destination column covers the source columns up to where the next one starts, and at least one */
+	for (x = 0; x < scaledwidth; x++)
+	{
+		uint32 first = (uint64)x * srcimage->width / scaledwidth;
+		uint32 end = (uint64)(x + 1) * srcimage->width / scaledwidth;
+		if (end <= first)
+			end = first + 1;
+		boxes[2 * x] = flip ? srcimage->width - end : first;
+		boxes[2 * x + 1] = flip ? srcimage->width - first : end;
+	}
+	
+	/* iterate over rows */
+	progress_set(progress, STAGE_SCALING, scaledlength, 0);
+	for (y = 0; y < scaledlength; y++)
+	{
+		uint32 first = (uint64)y * srcimage->length / scaledlength;
+		uint32 end = (uint64)(y + 1) * srcimage->length / scaledlength;
+		if (end <= first)
+			end = first + 1;
+		
+		/* count the covered source rows per column, four columns per add; the same rows again reuse the counts */
+		if (first != lastfirst || end != lastend)
+		{
+			memset(lanes, 0, 2 * srcbytes * sizeof(uint64));
+			black = FALSE;
+			for (i = first; i < end; i++)
+			{
+				const uint8 *srcrow = srcimage->pixels + (flip ? srcimage->length - 1 - i : i) * srcimage->rowbytes;
+				for (x = 0; x < srcbytes; x++)
+				{
+					/* skip white a word at a time */
+					if (x % 8 == 0 && x + 8 <= srcbytes)
+					{
+						uint64 word;
+						memcpy(&word, srcrow + x, sizeof(word));
+						if (word == 0)
+						{
+							x += 7;
+							continue;
+						}
+					}
+					if (srcrow[x] != 0)
+					{
+						lanes[2 * x] += spread[srcrow[x] >> 4];
+						lanes[2 * x + 1] += spread[srcrow[x] & 15];
+						black = TRUE;
+					}
+				}
+			}
+			lastfirst = first;
+			lastend = end;
+		}
+		
+		/* white stays white */
+		if (black)
+		{
+			uint32 area, count;
+			
+			/* gray keeps the coverage, 255 for solid black; bilevel thresholds it */
+			if (target->bitspersample == 8)
+			{
+				uint8 *dstrow = target->pixels + (targettop + y) * target->rowbytes + targetleft;
+				for (x = 0; x < scaledwidth; x++)
+				{
+					for (count = 0, k = boxes[2 * x]; k < boxes[2 * x + 1]; k++)
+						count += columns[k];
+					area = (boxes[2 * x + 1] - boxes[2 * x]) * (end - first);
+					dstrow[x] = (count * 255 + area / 2) / area;
+				}
+			}
+			else
+			{
+				memset(scaledrow, 0, scaledbytes);
+				for (x = 0; x < scaledwidth; x++)
+				{
+					for (count = 0, k = boxes[2 * x]; k < boxes[2 * x + 1]; k++)
+						count += columns[k];
+					area = (boxes[2 * x + 1] - boxes[2 * x]) * (end - first);
+					if (count * 100 >= area_threshold * area)
+						scaledrow[x >> 3] |= 0x80 >> (x & 7);
+				}
+				row_or_shifted(target->pixels + (targettop + y) * target->rowbytes + targetleft / 8, scaledrow, scaledwidth, targetleft & 7);
+			}
+		}
+		progress_update(progress, y + 1);
+	}
+
+done:
+	if (boxes != NULL)
+		_TIFFfree(boxes);
+	if (lanes != NULL)
+		_TIFFfree(lanes);
+	if (scaledrow != NULL)
+		_TIFFfree(scaledrow);
+}
+
+static void
+bilevel_image_scale_to_target(const bilevel_image *srcimage, bilevel_image *target, uint32 targetleft, uint32 targettop, uint32 targetwidth, uint32 targetlength, int flip, worker_progress *progress)
+{
+	uint32 scaledwidth, scaledlength, scaledbytes;
 	long long stepx, stepy;
 	long long srcx, srcy;
+	uint32 *srccol = NULL;
+	uint8 *scaledrow = NULL;
+	uint32 lasty = (uint32)-1;
+	int blank = TRUE;
 	uint32 x, y;
 	
 	/* determine where the original image will go */
@@ -331,35 +721,87 @@ bilevel_image_scale_to_target(const bilevel_image *srcimage, bilevel_image *targ
 	targetleft += (targetwidth - scaledwidth) / 2;
 	targettop += (targetlength - scaledlength) / 2;
 	
+	/* area coverage replaces point sampling, as long as no box is too tall for the 16-bit column counters */
+	if ((area_threshold != 0 || target->bitspersample == 8) && srcimage->length / scaledlength < 65535)
+	{
+		bilevel_image_area_scale(srcimage, target, targetleft, targettop, scaledwidth, scaledlength, flip, progress);
+		return;
+	}
+	
 	/* compute the x step */
 	stepx = ((long long)srcimage->width << 32) / scaledwidth;
 	stepy = ((long long)srcimage->length << 32) / scaledlength;
 	
+	/* each scaled row is built here before it is ORed into place; the 2x kernel can run a byte over */
+	scaledbytes = (scaledwidth + 7) / 8;
+	scaledrow = _TIFFmalloc(scaledbytes + 2);
+	if (scaledrow == NULL)
+	{
+		fprintf(stderr, "bilevel_image_scale_to_target: Out of memory allocating row buffer\n");
+		goto done;
+	}
+	
+	/* exact 2x and 1/2x have their own kernels; anything else maps each column to its source once per page */
+	if (flip || (stepx != (1ll << 31) && stepx != (2ll << 32)))
+	{
+		srccol = _TIFFmalloc(scaledwidth * sizeof(uint32));
+		if (srccol == NULL)
+		{
+			fprintf(stderr, "bilevel_image_scale_to_target: Out of memory allocating column map\n");
+			goto done;
+		}
+		srcx = stepx / 2;
+		for (x = 0; x < scaledwidth; x++)
+		{
+			uint32 curx = srcx >> 32;
+			srccol[x] = flip ? srcimage->width - 1 - curx : curx;
+			srcx += stepx;
+		}
+	}
+	
 	/* iterate over rows */
+	progress_set(progress, STAGE_SCALING, scaledlength, 0);
 	srcy = stepy / 2;
 	for (y = 0; y < scaledlength; y++)
 	{
 		uint32 cury = srcy >> 32;
-		const uint8 *srcrow;
-		uint8 *dstrow = target->pixels + (targettop + y) * target->rowbytes;
 
+		/* build a scaled row only when we move onto a new source row; repeats reuse it */
 		if (flip) cury = srcimage->length - 1 - cury;
-		srcrow = srcimage->pixels + cury * srcimage->rowbytes;
-		
-		/* iterate over columns */
-		srcx = stepx / 2;
-		for (x = 0; x < scaledwidth; x++)
+		if (cury != lasty)
 		{
-			uint32 curx = srcx >> 32;
-			if (flip) curx = srcimage->width - 1 - curx;
-			srcx += stepx;
-			if (srcrow[curx >> 3] & (0x80 >> (curx & 7)))
-				dstrow[(targetleft + x) >> 3] |= 0x80 >> ((targetleft + x) & 7);
+			const uint8 *srcrow;
+
+			srcrow = srcimage->pixels + cury * srcimage->rowbytes;
+			blank = (bits->find_pixel(srcrow, 0, srcimage->width, 1) >= srcimage->width);
+			if (!blank)
+			{
+				if (srccol != NULL)
+					scale_row_mapped(scaledrow, srcrow, srccol, scaledwidth);
+				else if (stepx == (1ll << 31))
+					scale_row_double(scaledrow, srcrow, (srcimage->width + 7) / 8);
+				else
+					scale_row_halve(scaledrow, srcrow, (srcimage->width + 7) / 8);
+				if (scaledwidth & 7)
+					scaledrow[scaledbytes - 1] &= 0xff << (8 - (scaledwidth & 7));
+			}
+			lasty = cury;
 		}
 		
+		/* all-white rows add nothing to the target */
+		if (!blank)
+			row_or_shifted(target->pixels + (targettop + y) * target->rowbytes + targetleft / 8, scaledrow, scaledwidth, targetleft & 7);
+		
 		/* advance in Y */
 		srcy += stepy;
+		progress_update(progress, y + 1);
 	}
+
+done:
+	if (srccol != NULL)
+		_TIFFfree(srccol);
+	if (scaledrow != NULL)
+		_TIFFfree(scaledrow);
 }
 
 static int
@@ -409,7 +851,7 @@ build_worker_list(char *files[], int count)
 			(*workerlist_tailptr)->filename = name;
 			(*workerlist_tailptr)->name = fullname;
 			(*workerlist_tailptr)->index = index;
-			strcpy((*workerlist_tailptr)->status, "Loading...");
+			progress_stage(&(*workerlist_tailptr)->progress, STAGE_LOADING);
 
 			/* add to the list */
 			workerlist_tailptr = &(*workerlist_tailptr)->next;
@@ -419,6 +861,28 @@ build_worker_list(char *files[], int count)
 	return 0;
 }
 
+static void
+progress_format(const worker_progress *progress, char *text, size_t size)
+{
+	worker_progress copy;
+	
+	/* take a consistent snapshot, then format it here rather than in the workers */
+	progress_read(progress, &copy);
+	switch (copy.stage)
+	{
+		case STAGE_MESSAGE:
+			snprintf(text, size, "%s", copy.message);
+			break;
+
+		default:
+			if (copy.total != 0)
+				snprintf(text, size, "%s %3u%%", stage_text[copy.stage], (unsigned)(100.0 * copy.value / copy.total));
+			else
+				snprintf(text, size, "%s", stage_text[copy.stage]);
+			break;
+	}
+}
+
 static int
 queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back)
 {
@@ -454,6 +918,7 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 		for (worker = workerlist; worker != NULL; worker = worker->next)
 		{
 			char namebuf[30];
+			char status[100];
 			if (!worker->done)
 				alldone = FALSE;
 			if (worker->error)
@@ -467,7 +932,8 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 			}
 			else
 				strcpy(namebuf, worker->name);
-			printf("%20.20s: %-59.59s\n", namebuf, worker->status);
+			progress_format(&worker->progress, status, sizeof(status));
+			printf("%20.20s: %-59.59s\n", namebuf, status);
 		}
 		
 		/* on error, just bail */
@@ -501,7 +967,6 @@ scale_image(PVOID param)
 	}
 	
 	/* scale to the target */
-	strcpy(data->status, "Scaling...");
 	xoffs = data->backpair ? (data->target->width - width) : 0;
 	xoffs += data->lefthalf ? 0 : width / 2;
 	yoffs = 0;
@@ -509,10 +974,24 @@ scale_image(PVOID param)
 		yoffs = data->target->length - yoffs - height;
 	if (data->backpair && flipping)
 		xoffs = data->target->width - xoffs - width / 2;
-	bilevel_image_scale_to_target(data->image, data->target, xoffs, yoffs, width / 2, height, data->backpair && flipping);
-	strcpy(data->status, "Done");
+	bilevel_image_scale_to_target(data->image, data->target, xoffs, yoffs, width / 2, height, data->backpair && flipping, &data->progress);
+	bilevel_image_free(data->image);
+	data->image = NULL;
+	
+	/* the last worker to finish a sheet compresses it */
+	if (InterlockedDecrement(&pagewriters[data->finalindex]) == 0)
+	{
+		progress_stage(&data->progress, STAGE_ENCODING);
+		if (bilevel_image_encode_page(data->finalindex) != 0)
+		{
+			data->error = TRUE;
+			goto done;
+		}
+	}
+	progress_stage(&data->progress, STAGE_DONE);
 
 done:
+	bilevel_image_release_spare();
 	data->threadid = -1;
 	data->done = TRUE;
 	return 0;
@@ -529,11 +1008,21 @@ allocate_and_assign_pages(void)
 	pagecount = imagecount / 2;
 	finalpage = _TIFFmalloc(sizeof(bilevel_image *) * pagecount);
 	memset(finalpage, 0, sizeof(bilevel_image *) * pagecount);
+	encodedpage = _TIFFmalloc(sizeof(pageout_encoded *) * pagecount);
+	memset(encodedpage, 0, sizeof(pageout_encoded *) * pagecount);
+	pagewriters = _TIFFmalloc(sizeof(LONG) * pagecount);
+	memset((void *)pagewriters, 0, sizeof(LONG) * pagecount);
 
 	/* allocate the pages */	
 	for (page = 0; page < pagecount; page++)
 	{
-		finalpage[page] = bilevel_image_alloc(targetwidth * 2, targetlength, NULL);
+		/* gray pages keep a byte per pixel in the same structure */
+		finalpage[page] = bilevel_image_alloc(gray_output ? targetwidth * 16 : targetwidth * 2, targetlength, NULL);
+		if (gray_output)
+		{
+			finalpage[page]->width = targetwidth * 2;
+			finalpage[page]->bitspersample = 8;
+		}
 		finalpage[page]->orientation = ORIENTATION_TOPLEFT;
 		finalpage[page]->xres = target_resolution;
 		finalpage[page]->yres = target_resolution;
@@ -547,12 +1036,25 @@ allocate_and_assign_pages(void)
 	{
 		int finalindex = (page < pagecount) ? page : (pagecount * 2 - 1 - page);
 		worker->target = finalpage[finalindex];
+		worker->finalindex = finalindex;
+		pagewriters[finalindex]++;
 		worker->lefthalf = page & 1;
 		worker->backpair = finalindex & 1;
 		page++;
 	}
 }
 
+static void
+report_page_faults(void)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	
+	/* page faults mostly come from touching freshly allocated page memory */
+	counters.cb = sizeof(counters);
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		printf("%lu page faults, %lu KB peak working set\n", (unsigned long)counters.PageFaultCount, (unsigned long)(counters.PeakWorkingSetSize / 1024));
+}
+
 int
 main(int argc, char* argv[])
 {
@@ -563,9 +1065,11 @@ main(int argc, char* argv[])
 	char *xptr;
 	
 	InitializeCriticalSection(&critsect);
+	bit_kernels_init();
+	spareslot = TlsAlloc();
 
 	/* parse arguments */
-	while ((c = getopt(argc, argv, "fs:r:")) != -1)
+	while ((c = getopt(argc, argv, "a:gfs:S:r:")) != -1)
 	{
 		switch (c)
 		{
@@ -584,6 +1088,24 @@ main(int argc, char* argv[])
 				printf("Flipping vertically\n");
 				break;
 
+			case 'a':
+				area_threshold = atoi(optarg);
+				if (area_threshold < 1 || area_threshold > 100)
+					usage();
+				printf("Scaling by area coverage, black at %d%%\n", area_threshold);
+				break;
+			
+			case 'g':
+				gray_output = 1;
+				printf("Writing 8-bit gray\n");
+				break;
+
+			case 'S':
+				if (atoi(optarg) < 1)
+					usage();
+				pageout_strip_rows = atoi(optarg);
+				break;
+
 			case '?':
 				usage();
 				break;
@@ -620,16 +1142,20 @@ main(int argc, char* argv[])
 	if (bilevel_image_save_images(argv[argc - 1]))
 		return -1;
 
+	report_page_faults();
 	return (0);
 }
 
 
 char* stuff[] = {
-"usage: tiffbook [options] input.tif [input2.tif [...]] output.tif",
+"usage: tiffbook [options] input.tif [input2.tif [...]] output.tif|output.pdf",
 "where options are:",
 " -r dpi	output resolution in dpi",
 " -s pct	output scale factor as a percentage",
 " -f		flip vertical orientation",
+" -a pct	shrink by area coverage, black where pct% or more of the source is black",
+" -g		shrink by area coverage to 8-bit gray",
+" -S rows	write G4 strips of this many rows, encoded in parallel",
 NULL
 };
 
@@ -10,8 +10,15 @@
 #endif
 
 #include <windows.h>
+#include <psapi.h>
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
 
 #include "tiffio.h"
+#include "bitkernels.h"
+#include "pageout.h"
+#include "shear.h"
 
 typedef struct bilevel_image bilevel_image;
 struct bilevel_image
@@ -24,9 +31,45 @@ struct bilevel_image
 	float	yres;
 	uint16	resunit;
 	uint16	rowbytes;
+	uint32	capacity;
 	uint8	pixels[1];
 };
 
+typedef struct bilevel_profile bilevel_profile;
+struct bilevel_profile
+{
+	uint32	width;
+	uint32	length;
+	uint32	*rows;
+	uint32	*columns;
+};
+
+typedef struct bilevel_view bilevel_view;
+struct bilevel_view
+{
+	const bilevel_image *parent;
+	long	left;
+	long	top;
+	uint32	width;
+	uint32	length;
+};
+
+typedef struct rotate_params rotate_params;
+struct rotate_params
+{
+	long long	dxdx, dydx;
+	long long	dxdy, dydy;
+	long long	srcstartx, srcstarty;
+};
+
+typedef struct morph_op morph_op;
+struct morph_op
+{
+	char		op;
+	uint32		width;
+	uint32		length;
+};
+
 typedef struct rotate_worker_data rotate_worker_data;
 struct rotate_worker_data
 {
@@ -36,6 +79,17 @@ struct rotate_worker_data
 	long long 	score;
 };
 
+typedef struct worker_progress worker_progress;
+struct worker_progress
+{
+	volatile LONG	sequence;
+	volatile uint32	stage;
+	volatile uint32	total;
+	volatile long	arg;
+	volatile uint32	value;
+	char		message[100];
+};
+
 typedef struct image_worker_data image_worker_data;
 struct image_worker_data
 {
@@ -45,51 +99,154 @@ struct image_worker_data
 	int			index;
 	DWORD		threadid;
 	bilevel_image *image;
+	bilevel_view view;
+	pageout_encoded *encoded;
+	volatile uint32 queued;
+	uint32		ready;
 	volatile uint32 done;
 	volatile uint32 error;
+	double		angle;
 	uint32		left;
 	uint32		right;
 	uint32		top;
 	uint32		bottom;
-	char 		status[100];
+	worker_progress progress;
 };
 
+#define MIN_BAND_ROWS 16
+#define MAX_ROTATE_BANDS 64
+#define MIN_CLEAN_ROWS 128
+#define MAX_MORPH_OPS 16
+
 static CRITICAL_SECTION critsect;
+static DWORD spareslot = TLS_OUT_OF_INDEXES;
+static uint32 *rgbabuffer = NULL;
+static uint32 rgbabuffersize = 0;
 
 static image_worker_data *workerlist = NULL;
 static int workercount = 0;
 
+/* when nothing needs every page first, pages go out in order as soon as they and all the
+   pages before them are encoded; only stream_window pages are let in at once, so memory
+   stays the same however long the document is */
+static CRITICAL_SECTION streamsect;
+static pageout_file *stream_file = NULL;
+static image_worker_data **stream_pages = NULL;
+static LPTHREAD_START_ROUTINE stream_callback;
+static int stream_next = 0;
+static int stream_queued = 0;
+static int stream_window = 0;
+static int stream_writing = FALSE;
+static float stream_xres, stream_yres;
+
+/* the largest input resolution, read up front, and whether every input page has square pixels */
+static float input_xres = 0;
+static float input_yres = 0;
+static int input_square = TRUE;
+
 static uint32 median_width, median_length;
 static uint32 cropwidth = 0;
 static uint32 croplength = 0;
 static int cleanit = 0;
+static double shear_tolerance = SHEAR_DEFAULT_TOLERANCE;
 static int norotate = 0;
 
-static const uint8 popcount[256] =
-{
-	0,1,1,2,1,2,2,3, 1,2,2,3,2,3,3,4,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-
-	1,2,2,3,2,3,3,4, 2,3,3,4,3,4,4,5,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	2,3,3,4,3,4,4,5, 3,4,4,5,4,5,5,6,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	3,4,4,5,4,5,5,6, 4,5,5,6,5,6,6,7,
-	4,5,5,6,5,6,6,7, 5,6,6,7,6,7,7,8
+static int orient_turns = 0;
+static int orient_auto = 0;
+
+static morph_op morph_ops[MAX_MORPH_OPS];
+static int morph_count = 0;
+
+/* progress stages, indexing stage_text */
+#define STAGE_QUEUED			0
+#define STAGE_LOADING			1
+#define STAGE_DESPECKLE_SCAN	2
+#define STAGE_DESPECKLE_MERGE	3
+#define STAGE_DESPECKLE_ERASE	4
+#define STAGE_ORIENT_CHECK		5
+#define STAGE_TURNING			6
+#define STAGE_MORPHOLOGY		7
+#define STAGE_SCANNING			8
+#define STAGE_NOT_CONVERGING	9
+#define STAGE_MARGINS			10
+#define STAGE_WAITING			11
+#define STAGE_CROPPING			12
+#define STAGE_ENCODING			13
+#define STAGE_DONE				14
+#define STAGE_MESSAGE			15
+
+static const char *stage_text[] =
+{
+	"Queued...", "Loading...", "Despeckle scanning...", "Despeckle merging...", "Erasing specks...",
+	"Checking orientation...", "Turning...", "Morphology...", "Scanning for best angle....",
+	"Results not converging as expected", "Computing Margins...", "Waiting...", "Cropping...",
+	"Encoding...", "Done", ""
 };
+
 	
 static	void usage(void);
+static	int idle_band_threads(void);
 
 #define FACTOR(val, size)  ((val < size / 6 || val > 5 * size / 6) ? 1 : 3)
 
+static void
+progress_set(worker_progress *progress, uint32 stage, uint32 total, long arg)
+{
+	/* an odd sequence number tells the reporter an update is under way */
+	InterlockedIncrement(&progress->sequence);
+	progress->stage = stage;
+	progress->total = total;
+	progress->arg = arg;
+	progress->value = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_stage(worker_progress *progress, uint32 stage)
+{
+	progress_set(progress, stage, 0, 0);
+}
+
+static void
+progress_update(worker_progress *progress, uint32 value)
+{
+	/* a single aligned store, cheap enough for inner loops; the reporter reads it unlocked */
+	if (progress != NULL)
+		progress->value = value;
+}
+
+static void
+progress_message(worker_progress *progress, const char *format, va_list args)
+{
+	InterlockedIncrement(&progress->sequence);
+	vsnprintf(progress->message, sizeof(progress->message), format, args);
+	progress->stage = STAGE_MESSAGE;
+	progress->total = 0;
+	InterlockedIncrement(&progress->sequence);
+}
+
+static void
+progress_read(const worker_progress *progress, worker_progress *copy)
+{
+	LONG sequence;
+	
+	/* retry until no update overlapped our copy */
+	do
+	{
+		sequence = progress->sequence;
+		MemoryBarrier();
+		copy->stage = progress->stage;
+		copy->total = progress->total;
+		copy->arg = progress->arg;
+		memcpy(copy->message, progress->message, sizeof(copy->message));
+		MemoryBarrier();
+	} while ((sequence & 1) != 0 || sequence != progress->sequence);
+	copy->message[sizeof(copy->message) - 1] = 0;
+	copy->value = progress->value;
+	if (copy->value > copy->total)
+		copy->value = copy->total;
+}
+
 static void
 warning_handler(const char *module, const char *format, va_list args)
 {
@@ -120,7 +277,7 @@ warning_handler_ext(thandle_t handle, const char *module, const char *format, va
 	/* if we found one, output a warning */
 //	if (worker != NULL)
 //		printf(format, args);
-//		vsnprintf(worker->status, sizeof(worker->status), format, args);
+//		progress_message(&worker->progress, format, args);
 }
 
 static void
@@ -141,7 +298,7 @@ error_handler_ext(thandle_t handle, const char *module, const char *format, va_l
 	/* if we found one, output an error */
 	if (worker != NULL)
 //		printf(format, args);
-		vsnprintf(worker->status, sizeof(worker->status), format, args);
+		progress_message(&worker->progress, format, args);
 }
 
 inline int
@@ -173,6 +330,7 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 {
 	uint16 rowbytes = (width + 7) / 8;
 	bilevel_image *image;
+	uint32 capacity;
 	
 	/* borrow width/height from clone if not specified */
 	if (clonefrom != NULL)
@@ -181,17 +339,34 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 		if (length == 0) length = clonefrom->length;
 	}
 	
-	/* allocate memory for the image */
+	/* reuse this thread's spare image if it's big enough, otherwise allocate memory for the image */
 	rowbytes = (width + 7) / 8;
-	image = _TIFFmalloc(sizeof(*image) + length * rowbytes);
-	if (image == NULL)
-		return NULL;
+	image = (spareslot != TLS_OUT_OF_INDEXES) ? TlsGetValue(spareslot) : NULL;
+	if (image != NULL)
+	{
+		TlsSetValue(spareslot, NULL);
+		if (image->capacity < length * rowbytes)
+		{
+			_TIFFfree(image);
+			image = NULL;
+		}
+	}
+	if (image != NULL)
+		capacity = image->capacity;
+	else
+	{
+		capacity = length * rowbytes;
+		image = _TIFFmalloc(sizeof(*image) + capacity);
+		if (image == NULL)
+			return NULL;
+	}
 	
 	/* clear to 0 and fill in the basics */
 	memset(image, 0, sizeof(*image) + length * rowbytes);
 	image->width = width;
 	image->length = length;
 	image->rowbytes = rowbytes;
+	image->capacity = capacity;
 	
 	/* clone remaining fields */
 	if (clonefrom != NULL)
@@ -208,7 +383,50 @@ bilevel_image_alloc(uint32 width, uint32 length, const bilevel_image *clonefrom)
 static void
 bilevel_image_free(bilevel_image *image)
 {
-	_TIFFfree(image);
+	bilevel_image *spare;
+	
+	/* keep the larger of this and the current spare around for the next stage on this thread */
+	if (spareslot != TLS_OUT_OF_INDEXES && image != NULL)
+	{
+		spare = TlsGetValue(spareslot);
+		if (spare == NULL || spare->capacity < image->capacity)
+		{
+			TlsSetValue(spareslot, image);
+			image = spare;
+		}
+	}
+	if (image != NULL)
+		_TIFFfree(image);
+}
+
+/* free this thread's spare; it only pays off between the stages of one page, and a pool thread
+   may not see another page for a long time */
+static void
+bilevel_image_release_spare(void)
+{
+	bilevel_image *spare;
+	
+	if (spareslot != TLS_OUT_OF_INDEXES)
+	{
+		spare = TlsGetValue(spareslot);
+		TlsSetValue(spareslot, NULL);
+		if (spare != NULL)
+			_TIFFfree(spare);
+	}
+}
+
+static uint32 *
+get_rgba_buffer(uint32 bytes)
+{
+	/* loads are serialized by the critical section, so they all share one buffer that only ever grows */
+	if (bytes > rgbabuffersize)
+	{
+		if (rgbabuffer != NULL)
+			_TIFFfree(rgbabuffer);
+		rgbabuffer = _TIFFmalloc(bytes);
+		rgbabuffersize = (rgbabuffer != NULL) ? bytes : 0;
+	}
+	return rgbabuffer;
 }
 
 static bilevel_image *
@@ -255,10 +473,11 @@ bilevel_image_load(const char *name, int index)
 
 	/* allocate RGBA buffer */
 EnterCriticalSection(&critsect);
-	rgba = _TIFFmalloc(width * length * 4);
+	rgba = get_rgba_buffer(width * length * 4);
 	if (rgba == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating RGBA %dx%d\n", name, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 
@@ -266,6 +485,7 @@ EnterCriticalSection(&critsect);
 	if (TIFFReadRGBAImageOriented(in, width, length, rgba, ORIENTATION_TOPLEFT, 1) == 0)
 	{
 		fprintf(stderr, "%s: Error reading image\n", name);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	
@@ -274,6 +494,7 @@ EnterCriticalSection(&critsect);
 	if (image == NULL)
 	{
 		fprintf(stderr, "%s: Out of memory allocating bilevel %dx%d\n", name, width, length);
+		LeaveCriticalSection(&critsect);
 		goto error;
 	}
 	image->name = name;
@@ -309,8 +530,6 @@ EnterCriticalSection(&critsect);
 				set_pixel(image, y, x);
 		}
 
-	/* free memory */
-	_TIFFfree(rgba);
 LeaveCriticalSection(&critsect);
 	TIFFClose(in);
 	return image;
@@ -318,64 +537,134 @@ LeaveCriticalSection(&critsect);
 error:
 	if (image != NULL)
 		bilevel_image_free(image);
-	if (rgba != NULL)
-		_TIFFfree(rgba);
 	if (in != NULL)
 		TIFFClose(in);
 	return NULL;
 }
 
+static void
+bilevel_view_init(bilevel_view *view, const bilevel_image *parent, long left, long top, uint32 width, uint32 length)
+{
+	view->parent = parent;
+	view->left = left;
+	view->top = top;
+	view->width = width;
+	view->length = length;
+}
+
+static const uint8 *
+bilevel_view_row(const bilevel_view *view, uint32 y, uint8 *buffer)
+{
+	const bilevel_image *parent = view->parent;
+	uint32 bytes = (view->width + 7) / 8;
+	long srcy = view->top + (long)y;
+	long srcx = (view->left >= 0) ? view->left / 8 : -((7 - view->left) / 8);
+	int shift = view->left - srcx * 8;
+	const uint8 *srcrow;
+	uint32 x;
+
+	/* rows above or below the parent are white */
+	if (srcy < 0 || srcy >= (long)parent->length)
+	{
+		memset(buffer, 0, bytes);
+		return buffer;
+	}
+	srcrow = parent->pixels + srcy * parent->rowbytes;
+	
+	/* a byte-aligned row that lies within the parent is used in place */
+	if (shift == 0 && srcx >= 0 && srcx + bytes <= parent->rowbytes)
+		return srcrow + srcx;
+	
+	/* otherwise shift it into the buffer, with white beyond the parent's edges */
+	for (x = 0; x < bytes; x++, srcx++)
+	{
+		uint8 hipix = (srcx >= 0 && srcx < (long)parent->rowbytes) ? srcrow[srcx] : 0;
+		uint8 lopix = (srcx + 1 >= 0 && srcx + 1 < (long)parent->rowbytes) ? srcrow[srcx + 1] : 0;
+		buffer[x] = (hipix << shift) | (lopix >> (8 - shift));
+	}
+	return buffer;
+}
+
+static void
+bilevel_view_fill(const void *param, uint32 y, uint32 rows, uint8 *dst)
+{
+	const bilevel_view *view = param;
+	uint32 rowbytes = (view->width + 7) / 8;
+	const uint8 *src;
+	uint32 i;
+	
+	/* rows the view can't hand out in place are assembled right where they go */
+	for (i = 0; i < rows; i++, dst += rowbytes)
+	{
+		src = bilevel_view_row(view, y + i, dst);
+		if (src != dst)
+			memcpy(dst, src, rowbytes);
+	}
+}
+
+/* compress the final view of a page and let its pixels go */
 static int
-bilevel_image_save_images(const char *name, const image_worker_data *worklist)
+bilevel_view_encode(image_worker_data *data)
 {
-	TIFF *out;
-	uint32 y;
+	const bilevel_view *view = &data->view;
+	const bilevel_image *image = view->parent;
+	pageout_page page;
+	
+	progress_stage(&data->progress, STAGE_ENCODING);
+	memset(&page, 0, sizeof(page));
+	page.width = view->width;
+	page.length = view->length;
+	page.bitspersample = 1;
+	page.orientation = image->orientation;
+	page.xres = image->xres;
+	page.yres = image->yres;
+	page.resunit = image->resunit;
+	page.fill = bilevel_view_fill;
+	page.param = view;
+	data->encoded = pageout_encode_page(&page);
+	if (data->encoded == NULL)
+		return -1;
+	bilevel_image_free(data->image);
+	data->image = NULL;
+	return 0;
+}
+
+static int
+bilevel_image_save_images(const char *name, image_worker_data *worklist)
+{
+	pageout_file *out;
 	
-	out = TIFFOpen(name, "w");
+	out = pageout_open(name);
 	if (out == NULL)
 		return -1;
 
+	/* the workers have compressed their pages already, so this is just appending them in order */
 	for ( ; worklist != NULL; worklist = worklist->next)
 	{
-		bilevel_image *image = worklist->image;
-
-		TIFFSetField(out, TIFFTAG_IMAGEWIDTH, image->width);
-		TIFFSetField(out, TIFFTAG_IMAGELENGTH, image->length);
-		TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 1);
-		TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
-		TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-		TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_CCITTFAX4);
-		TIFFSetField(out, TIFFTAG_FILLORDER, FILLORDER_MSB2LSB);
-		TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISWHITE);
-		TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, image->length);
-		if (image->orientation != 0) TIFFSetField(out, TIFFTAG_ORIENTATION, image->orientation);
-		if (image->xres != 0) TIFFSetField(out, TIFFTAG_XRESOLUTION, image->xres);
-		if (image->yres != 0) TIFFSetField(out, TIFFTAG_YRESOLUTION, image->yres);
-		if (image->resunit != 0) TIFFSetField(out, TIFFTAG_RESOLUTIONUNIT, image->resunit);
-
-		for (y = 0; y < image->length; y++)
-			if (TIFFWriteScanline(out, (tdata_t)(image->pixels + y * image->rowbytes), y, 0) < 0)
-				goto error;
-
-		if (TIFFWriteDirectory(out) == 0)
+		if (pageout_append(out, worklist->encoded) != 0)
 			goto error;
+		pageout_encoded_free(worklist->encoded);
+		worklist->encoded = NULL;
 	}
 
-	TIFFClose(out);
+	if (pageout_close(out) != 0)
+	{
+		remove(name);
+		return -1;
+	}
 	return 0;
 
 error:
-	TIFFClose(out);
+	pageout_close(out);
 	remove(name);
 	return -1;
 }
 
-static long long
-bilevel_image_rotate_score(const bilevel_image *image, double angle)
+static void
+bilevel_image_rotate_runs(const bilevel_image *image, double angle, long long *hsum, long long *vsum)
 {
 	long long dxdx, dydx, dxdy, dydy;
 	long long srcstartx, srcstarty;
-	long long summary = 0;
 	double sinval, cosval;
 	long dstx, dsty;
 	uint32 *vrun;
@@ -393,11 +682,12 @@ bilevel_image_rotate_score(const bilevel_image *image, double angle)
 	srcstarty = ((long long)(image->length / 2) * (double)(1ll << 32)) - dydx * (image->width / 2) - dydy * (image->length / 2);
 
 	/* allocate memory to track vertical runs */
+	*hsum = *vsum = 0;
 	vrun = _TIFFmalloc(image->width * sizeof(uint32));
 	if (vrun == NULL)
 	{
-		fprintf(stderr, "bilevel_image_rotate_score: Out of memory allocating vrun for rotation\n");
-		return 0;
+		fprintf(stderr, "bilevel_image_rotate_runs: Out of memory allocating vrun for rotation\n");
+		return;
 	}
 	memset(vrun, 0, image->width * sizeof(uint32));
 
@@ -424,8 +714,8 @@ bilevel_image_rotate_score(const bilevel_image *image, double angle)
 			/* otherwise, end the current run and update the vertical runs as well for this column */
 			else
 			{
-				summary += FACTOR(dsty, image->length) * run * run + 
-							FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
+				*hsum += FACTOR(dsty, image->length) * run * run;
+				*vsum += FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
 				run = 0;
 				vrun[dstx] = 0;
 			}
@@ -436,217 +726,860 @@ bilevel_image_rotate_score(const bilevel_image *image, double angle)
 		}
 		
 		/* account for any runs off the end */
-		summary += FACTOR(dsty, image->length) * run * run;
+		*hsum += FACTOR(dsty, image->length) * run * run;
 	}
 
 	/* account for any runs off the bottom */	
 	for (dstx = 0; dstx < image->width; dstx++)
-		summary += FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
+		*vsum += FACTOR(dstx, image->width) * vrun[dstx] * vrun[dstx];
 
-	/* free memory and return the result */
+	/* free memory */
 	_TIFFfree(vrun);
-	return summary;
 }
 
+static long long
+bilevel_image_rotate_score(const bilevel_image *image, double angle)
+{
+	long long hsum, vsum;
+	
+	/* the score is the combined horizontal and vertical run energy */
+	bilevel_image_rotate_runs(image, angle, &hsum, &vsum);
+	return hsum + vsum;
+}
+
+typedef struct object_run object_run;
+struct object_run
+{
+	uint32		parent;
+	uint32		y;
+	uint32		x0, x1;
+	uint32		minx, maxx;
+	uint32		miny, maxy;
+	uint32		pixels;
+};
+
 typedef struct
 {
-	uint8 *visited;
-	int max;
-	int rowbytes;
-	int failed;
-	int xorigin, yorigin;
-} object_bounds;
+	object_run *run;
+	uint32		count;
+	uint32		alloc;
+} object_run_list;
 
-static void
-get_object_max_dim_r(bilevel_image *image, int dy, int dx, object_bounds *bounds)
+#define SPECK_MAX_LONG		8
+#define SPECK_MAX_SHORT		3
+
+static uint32
+object_run_find(object_run_list *list, uint32 index)
 {
-	int x, y;
-	if (bounds->failed || dy < -bounds->max || dx < -bounds->max || dy > bounds->max || dx > bounds->max)
+	/* walk up to the root, halving the path as we go */
+	while (list->run[index].parent != index)
 	{
-		bounds->failed = 1;
-		return;
+		list->run[index].parent = list->run[list->run[index].parent].parent;
+		index = list->run[index].parent;
 	}
-	if (bounds->visited[dy * bounds->rowbytes + dx])
+	return index;
+}
+
+static void
+object_run_union(object_run_list *list, uint32 a, uint32 b)
+{
+	object_run *root;
+	
+	/* find both roots; the lower index wins so roots stay in scan order */
+	a = object_run_find(list, a);
+	b = object_run_find(list, b);
+	if (a == b)
 		return;
-	bounds->visited[dy * bounds->rowbytes + dx] = 1;
-	x = bounds->xorigin + dx;
-	y = bounds->yorigin + dy;
-	if (get_pixel(image, y-1, x)) get_object_max_dim_r(image, dy-1, dx, bounds);
-	if (get_pixel(image, y+1, x)) get_object_max_dim_r(image, dy+1, dx, bounds);
-	if (get_pixel(image, y, x-1)) get_object_max_dim_r(image, dy, dx-1, bounds);
-	if (get_pixel(image, y, x+1)) get_object_max_dim_r(image, dy, dx+1, bounds);
+	if (b < a)
+	{
+		uint32 temp = a;
+		a = b;
+		b = temp;
+	}
+	
+	/* merge the bounds and pixel count into the surviving root */
+	list->run[b].parent = a;
+	root = &list->run[a];
+	if (list->run[b].minx < root->minx) root->minx = list->run[b].minx;
+	if (list->run[b].maxx > root->maxx) root->maxx = list->run[b].maxx;
+	if (list->run[b].miny < root->miny) root->miny = list->run[b].miny;
+	if (list->run[b].maxy > root->maxy) root->maxy = list->run[b].maxy;
+	root->pixels += list->run[b].pixels;
 }
 
 static int
-get_object_max_dim(bilevel_image *image, int y, int x, int max1, int max2)
-{
-	object_bounds bounds;
-	
-	bounds.max = max1;
-	bounds.rowbytes = 2 * (max1 + 1) + 1;
-	bounds.failed = 0;
-	bounds.xorigin = x;
-	bounds.yorigin = y;
-	bounds.visited = malloc(bounds.rowbytes * bounds.rowbytes);
-	memset(bounds.visited, 0, bounds.rowbytes * bounds.rowbytes);
-
-	bounds.visited += max1 * bounds.rowbytes + max1;
-	get_object_max_dim_r(image, 0, 0, &bounds);
-	bounds.visited -= max1 * bounds.rowbytes + max1;
-	
-	if (!bounds.failed)
-	{
-		int miny, maxy, minx, maxx, x, y;
-		miny = minx = bounds.rowbytes;
-		maxy = maxx = -1;
-		for (y = 0; y < bounds.rowbytes; y++)
-			for (x = 0; x < bounds.rowbytes; x++)
-				if (bounds.visited[y * bounds.rowbytes + x])
-				{
-					if (y < miny) miny = y;
-					if (y > maxy) maxy = y;
-					if (x < minx) minx = x;
-					if (x > maxx) maxx = x;
-				}
-		
-		if (maxy - miny > maxx - minx)
-			bounds.failed = (maxy - miny > max1 || maxx - minx > max2);
-		else
-			bounds.failed = (maxx - minx > max1 || maxy - miny > max2);
-	}
+object_run_add(object_run_list *list, uint32 y, uint32 x0, uint32 x1)
+{
+	object_run *run;
 	
-	free(bounds.visited);
+	/* grow the list as needed */
+	if (list->count == list->alloc)
+	{
+		uint32 newalloc = (list->alloc == 0) ? 4096 : list->alloc * 2;
+		object_run *newrun = _TIFFrealloc(list->run, newalloc * sizeof(*newrun));
+		if (newrun == NULL)
+			return -1;
+		list->run = newrun;
+		list->alloc = newalloc;
+	}
 	
-	return bounds.failed;
+	/* each run starts out as its own component */
+	run = &list->run[list->count];
+	run->parent = list->count++;
+	run->y = run->miny = run->maxy = y;
+	run->x0 = run->minx = x0;
+	run->x1 = x1;
+	run->maxx = x1 - 1;
+	run->pixels = x1 - x0;
+	return 0;
 }
 
-static void
-erase_object(bilevel_image *image, int y, int x)
+static int
+object_run_list_add_row(object_run_list *list, const bilevel_image *image, uint32 y)
 {
-	clear_pixel(image, y, x);
-	if (get_pixel(image, y-1, x)) erase_object(image, y-1, x);
-	if (get_pixel(image, y+1, x)) erase_object(image, y+1, x);
-	if (get_pixel(image, y, x-1)) erase_object(image, y, x-1);
-	if (get_pixel(image, y, x+1)) erase_object(image, y, x+1);
+	const uint8 *row = image->pixels + y * image->rowbytes;
+	uint32 x = 0, start;
+	
+	/* find each run of black pixels: its first black pixel, then the next white one */
+	while ((start = bits->find_pixel(row, x, image->width, 1)) < image->width)
+	{
+		x = bits->find_pixel(row, start, image->width, 0);
+		if (object_run_add(list, y, start, x) != 0)
+			return -1;
+	}
+	return 0;
 }
 
 static void
-bilevel_image_clean(bilevel_image *image, char *status)
+object_run_list_link_rows(object_run_list *list, uint32 prevstart, uint32 prevend, uint32 curstart, uint32 curend)
 {
-	int x, y;
+	uint32 i = prevstart, j = curstart;
 	
-	/* first despeckle */
-	for (y = 0; y < image->length; y++)
+	/* walk both rows' runs in step, joining any that share a column */
+	while (i < prevend && j < curend)
 	{
-		sprintf(status, "Despeckle scanning (%d)...", y);
-		for (x = 0; x < image->width; x++)
-			if (get_pixel(image, y, x))
-			{
-				/* find extent of object; skip if any pixels to the left or above because
-				   we already did them */
-				if (get_pixel(image, y, x-1) || get_pixel(image, y-1, x))
-					continue;
-		sprintf(status, "Checking (%d,%d)...", y, x);
-				if (!get_object_max_dim(image, y, x, 8, 3))
-				{
-		sprintf(status, "Erasing (%d,%d)...", y, x);
-					erase_object(image, y, x);
-				}
-			}
+		if (list->run[i].x0 < list->run[j].x1 && list->run[j].x0 < list->run[i].x1)
+			object_run_union(list, i, j);
+		if (list->run[i].x1 <= list->run[j].x1)
+			i++;
+		else
+			j++;
 	}
 }
 
-static bilevel_image *
-bilevel_image_rotate(const bilevel_image *image, double angle)
+static int
+object_is_speck(const object_run *root)
 {
-	long long dxdx, dydx, dxdy, dydy;
-	long long srcstartx, srcstarty;
-	double sinval, cosval;
-	bilevel_image *result;
-	long dstx, dsty;
+	uint32 width = root->maxx - root->minx;
+	uint32 height = root->maxy - root->miny;
 	
-	/* convert angle to rotation matrix */
-	sinval = sin(angle * M_PI / 180.0);
-	cosval = cos(angle * M_PI / 180.0);
-	dxdx = (long long)(cosval * (double)(1ll << 32));
-	dydx = (long long)(-sinval * (double)(1ll << 32));
-	dxdy = -dydx;
-	dydy = dxdx;
+	/* small in the long direction and thin in the short one */
+	if (height > width)
+		return (height <= SPECK_MAX_LONG && width <= SPECK_MAX_SHORT);
+	return (width <= SPECK_MAX_LONG && height <= SPECK_MAX_SHORT);
+}
 
-	/* pick starting source x,y such that we remain centered */
-	srcstartx = ((long long)(image->width / 2) * (double)(1ll << 32)) - dxdx * (image->width / 2) - dxdy * (image->length / 2);
-	srcstarty = ((long long)(image->length / 2) * (double)(1ll << 32)) - dydx * (image->width / 2) - dydy * (image->length / 2);
+static void
+clear_run(bilevel_image *image, uint32 y, uint32 x0, uint32 x1)
+{
+	uint8 *row = image->pixels + y * image->rowbytes;
+	uint32 x;
+	
+	for (x = x0; x < x1 && (x % 8) != 0; x++)
+		row[x / 8] &= ~(0x80 >> (x % 8));
+	for ( ; x + 8 <= x1; x += 8)
+		row[x / 8] = 0;
+	for ( ; x < x1; x++)
+		row[x / 8] &= ~(0x80 >> (x % 8));
+}
 
-	/* allocate memory for the destination image */
-	result = bilevel_image_alloc(0, 0, image);
-	if (result == NULL)
+typedef struct clean_band_data clean_band_data;
+struct clean_band_data
+{
+	bilevel_image *image;
+	uint32		firstrow;
+	uint32		lastrow;
+	object_run_list list;
+	uint32		firstrowend;
+	uint32		lastrowstart;
+	const object_run_list *merged;
+	uint32		offset;
+	int			erase;
+	int			error;
+	worker_progress *progress;
+	HANDLE		event;
+};
+
+static int
+object_run_list_label(object_run_list *list, const bilevel_image *image, uint32 firstrow, uint32 lastrow, uint32 *firstrowend, uint32 *lastrowstart, worker_progress *progress)
+{
+	uint32 y, prevstart = 0, prevend = 0;
+	
+	/* label 4-connected objects a row of runs at a time, linking each row to the one above */
+	*firstrowend = *lastrowstart = 0;
+	for (y = firstrow; y < lastrow; y++)
 	{
-		fprintf(stderr, "bilevel_image_rotate: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
-		return NULL;
+		uint32 curstart = list->count;
+		if (object_run_list_add_row(list, image, y) != 0)
+			return -1;
+		object_run_list_link_rows(list, prevstart, prevend, curstart, list->count);
+		prevstart = curstart;
+		prevend = list->count;
+		if (y == firstrow)
+			*firstrowend = list->count;
+		progress_update(progress, y + 1 - firstrow);
 	}
 	
-	/* iterate over the destination */
-	for (dsty = 0; dsty < result->length; dsty++)
+	/* remember where the last row starts so the band below can link to it */
+	*lastrowstart = prevstart;
+	return 0;
+}
+
+static void
+clean_band(clean_band_data *band)
+{
+	const object_run_list *merged = band->merged;
+	uint32 i;
+	
+	/* first pass labels the band on its own */
+	if (!band->erase)
+		band->error = object_run_list_label(&band->list, band->image, band->firstrow, band->lastrow, &band->firstrowend, &band->lastrowstart, band->progress);
+	
+	/* second pass erases the band's runs whose (flattened) root is a speck */
+	else
 	{
-		long long srcx = srcstartx + dsty * dxdy;
-		long long srcy = srcstarty + dsty * dydy;
-		
-		/* iterate over destination rows */
-		for (dstx = 0; dstx < result->width; dstx++)
+		for (i = band->offset; i < band->offset + band->list.count; i++)
 		{
-			/* if we're in range, count black pixel runs */
-			if (get_pixel(image, srcy >> 32, srcx >> 32))
-				set_pixel(result, dsty, dstx);
-			
-			/* advance source in both X and Y */
-			srcx += dxdx;
-			srcy += dydx;
+			if (object_is_speck(&merged->run[merged->run[i].parent]))
+				clear_run(band->image, merged->run[i].y, merged->run[i].x0, merged->run[i].x1);
+			progress_update(band->progress, i + 1 - band->offset);
 		}
 	}
-	return result;
 }
 
 static DWORD WINAPI
-bilevel_image_auto_rotate_worker(LPVOID param)
+clean_band_worker(LPVOID param)
 {
-	rotate_worker_data *data = param;
-	data->score = bilevel_image_rotate_score(data->image, data->angle);
-	SetEvent(data->event);
+	clean_band_data *band = param;
+	clean_band(band);
+	SetEvent(band->event);
 	return 0;
 }
 
-static bilevel_image *
-bilevel_image_auto_rotate(const bilevel_image *image, char *status)
+static void
+run_clean_bands(clean_band_data *bands, int bandcount, int erase)
 {
-	rotate_worker_data left;
-	rotate_worker_data right;
-	rotate_worker_data middle;
-	rotate_worker_data leftmid;
-	rotate_worker_data rightmid;
-	HANDLE eventlist[5];
-	int pass = 0;
+	int band;
 	
-	/* set up the workers */
-	left.image = right.image = middle.image = leftmid.image = rightmid.image = image;
-	eventlist[0] = left.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[1] = right.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[2] = middle.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[3] = leftmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
-	eventlist[4] = rightmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	/* queue all bands but the first, which we do ourselves, then wait for the rest */
+	for (band = 0; band < bandcount; band++)
+	{
+		bands[band].erase = erase;
+		if (band != 0)
+		{
+			bands[band].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			QueueUserWorkItem(clean_band_worker, &bands[band], WT_EXECUTEDEFAULT);
+		}
+	}
+	clean_band(&bands[0]);
+	for (band = 1; band < bandcount; band++)
+	{
+		WaitForSingleObject(bands[band].event, INFINITE);
+		CloseHandle(bands[band].event);
+	}
+}
 
-	/* scan from -10 .. 10 */	
-	left.angle = -10.0;
-	right.angle = 10.0;
+static void
+bilevel_image_clean(bilevel_image *image, worker_progress *progress)
+{
+	clean_band_data bands[MAX_ROTATE_BANDS];
+	object_run_list merged = { NULL, 0, 0 };
+	int bandcount, band;
+	uint32 i, y, bandrows;
 	
-	/* iterate until we've found the best match within 1/1000th of a degree */
-	while (fabs(right.angle - left.angle) > 0.001)
+	/* pick the number of bands; each gets at least MIN_CLEAN_ROWS rows */
+	bandcount = idle_band_threads() + 1;
+	if (bandcount > MAX_ROTATE_BANDS)
+		bandcount = MAX_ROTATE_BANDS;
+	if (bandcount > image->length / MIN_CLEAN_ROWS)
+		bandcount = image->length / MIN_CLEAN_ROWS;
+	if (bandcount < 1)
+		bandcount = 1;
+	
+	/* label each band independently; the first band, which runs on this thread, reports progress */
+	bandrows = (image->length + bandcount - 1) / bandcount;
+	memset(bands, 0, sizeof(bands));
+	for (band = 0, y = 0; band < bandcount && y < image->length; band++, y += bandrows)
 	{
-		int count = 0;
-		
-		pass++;
-		sprintf(status, "Scanning for best angle.... %7.3f |%.*s%.*s|", middle.angle, pass, "================", 16-pass, "                ");
-
-		/* on the first pass, we have to compute all 5 */
+		bands[band].image = image;
+		bands[band].firstrow = y;
+		bands[band].lastrow = (image->length - y < bandrows) ? image->length : (y + bandrows);
+		bands[band].merged = &merged;
+	}
+	bandcount = band;
+	bands[0].progress = progress;
+	progress_set(progress, STAGE_DESPECKLE_SCAN, bands[0].lastrow - bands[0].firstrow, 0);
+	run_clean_bands(bands, bandcount, FALSE);
+	
+	/* gather the bands into one list, shifting each band's parent links by its offset */
+	for (band = 0; band < bandcount; band++)
+	{
+		if (bands[band].error)
+		{
+			fprintf(stderr, "bilevel_image_clean: Out of memory tracking %d runs\n", bands[band].list.count);
+			goto done;
+		}
+		bands[band].offset = merged.count;
+		merged.count += bands[band].list.count;
+	}
+	if (bandcount == 1)
+		merged.run = bands[0].list.run;
+	else
+	{
+		merged.run = _TIFFmalloc((merged.count > 0 ? merged.count : 1) * sizeof(*merged.run));
+		if (merged.run == NULL)
+		{
+			fprintf(stderr, "bilevel_image_clean: Out of memory merging %d runs\n", merged.count);
+			goto done;
+		}
+		for (band = 0; band < bandcount; band++)
+		{
+			object_run *dst = merged.run + bands[band].offset;
+			memcpy(dst, bands[band].list.run, bands[band].list.count * sizeof(*dst));
+			for (i = 0; i < bands[band].list.count; i++)
+				dst[i].parent += bands[band].offset;
+		}
+		
+		/* join objects that cross each seam */
+		progress_stage(progress, STAGE_DESPECKLE_MERGE);
+		for (band = 1; band < bandcount; band++)
+			object_run_list_link_rows(&merged, bands[band - 1].offset + bands[band - 1].lastrowstart, bands[band].offset,
+					bands[band].offset, bands[band].offset + bands[band].firstrowend);
+	}
+	
+	/* parents always point at lower indices, so one forward pass points every run straight at its root */
+	for (i = 0; i < merged.count; i++)
+		merged.run[i].parent = merged.run[merged.run[i].parent].parent;
+	
+	/* erase every run whose object is a speck, again a band at a time */
+	progress_set(progress, STAGE_DESPECKLE_ERASE, bands[0].list.count, 0);
+	run_clean_bands(bands, bandcount, TRUE);
+
+done:
+	if (merged.run != NULL && bandcount > 1)
+		_TIFFfree(merged.run);
+	for (band = 0; band < bandcount; band++)
+		if (bands[band].list.run != NULL)
+			_TIFFfree(bands[band].list.run);
+}
+
+static void
+rotate_params_init(rotate_params *params, uint32 width, uint32 length, double angle)
+{
+	double sinval, cosval;
+	
+	/* convert angle to rotation matrix */
+	sinval = sin(angle * M_PI / 180.0);
+	cosval = cos(angle * M_PI / 180.0);
+	params->dxdx = (long long)(cosval * (double)(1ll << 32));
+	params->dydx = (long long)(-sinval * (double)(1ll << 32));
+	params->dxdy = -params->dydx;
+	params->dydy = params->dxdx;
+
+	/* pick starting source x,y such that we remain centered */
+	params->srcstartx = ((long long)(width / 2) * (double)(1ll << 32)) - params->dxdx * (width / 2) - params->dxdy * (length / 2);
+	params->srcstarty = ((long long)(length / 2) * (double)(1ll << 32)) - params->dydx * (width / 2) - params->dydy * (length / 2);
+}
+
+static void
+bilevel_image_rotate_row(const bilevel_image *image, const rotate_params *params, long dsty, long dstx, uint32 width, uint8 *dstrow, uint32 dstbit)
+{
+	long long srcx = params->srcstartx + dsty * params->dxdy + dstx * params->dxdx;
+	long long srcy = params->srcstarty + dsty * params->dydy + dstx * params->dydx;
+	uint32 x;
+	
+	/* iterate over destination pixels, ORing them into the (cleared) row starting at dstbit */
+	for (x = dstbit; x < dstbit + width; x++)
+	{
+		if (get_pixel(image, srcy >> 32, srcx >> 32))
+			dstrow[x / 8] |= 0x80 >> (x % 8);
+		
+		/* advance source in both X and Y */
+		srcx += params->dxdx;
+		srcy += params->dydx;
+	}
+}
+
+typedef struct band_worker_data band_worker_data;
+struct band_worker_data
+{
+	const bilevel_image *image;
+	const rotate_params *params;
+	long		dsty;
+	uint32		rows;
+	long		dstx;
+	uint32		width;
+	uint8 *		dstrows;
+	uint32		rowbytes;
+	uint32		dstbit;
+	HANDLE		event;
+};
+
+static DWORD WINAPI
+bilevel_image_rotate_band_worker(LPVOID param)
+{
+	band_worker_data *data = param;
+	uint32 y;
+	
+	for (y = 0; y < data->rows; y++)
+		bilevel_image_rotate_row(data->image, data->params, data->dsty + y, data->dstx, data->width, data->dstrows + y * data->rowbytes, data->dstbit);
+	SetEvent(data->event);
+	return 0;
+}
+
+static int
+idle_band_threads(void)
+{
+	SYSTEM_INFO sysinfo;
+	image_worker_data *worker;
+	int waiting = 0, running = 0, idle;
+	
+	/* count pages still waiting for a thread and pages being worked on right now */
+	for (worker = workerlist; worker != NULL; worker = worker->next)
+		if (worker->queued && !worker->done)
+		{
+			if (worker->threadid == 0)
+				waiting++;
+			else
+				running++;
+		}
+	
+	/* only split a page when the waiting pages outnumber the idle threads less than 2:1 */
+	GetSystemInfo(&sysinfo);
+	idle = (int)sysinfo.dwNumberOfProcessors - running;
+	return (idle > 0 && waiting < 2 * idle) ? idle : 0;
+}
+
+static void
+bilevel_image_rotate_rows(const bilevel_image *image, const rotate_params *params, long dsty, uint32 rows, long dstx, uint32 width, uint8 *dstrows, uint32 rowbytes, uint32 dstbit)
+{
+	band_worker_data bands[MAX_ROTATE_BANDS];
+	int bandcount, band;
+	uint32 y, bandrows;
+	
+	/* pick the number of bands; each thread gets at least MIN_BAND_ROWS rows */
+	bandcount = idle_band_threads() + 1;
+	if (bandcount > MAX_ROTATE_BANDS)
+		bandcount = MAX_ROTATE_BANDS;
+	if (bandcount > rows / MIN_BAND_ROWS)
+		bandcount = rows / MIN_BAND_ROWS;
+	
+	/* not worth splitting; render the rows here */
+	if (bandcount <= 1)
+	{
+		for (y = 0; y < rows; y++)
+			bilevel_image_rotate_row(image, params, dsty + y, dstx, width, dstrows + y * rowbytes, dstbit);
+		return;
+	}
+	
+	/* queue all bands but the first, which we render ourselves; the destination rows are disjoint so no locking is needed */
+	bandrows = (rows + bandcount - 1) / bandcount;
+	for (band = 0, y = 0; band < bandcount && y < rows; band++, y += bandrows)
+	{
+		bands[band].image = image;
+		bands[band].params = params;
+		bands[band].dsty = dsty + y;
+		bands[band].rows = (rows - y < bandrows) ? (rows - y) : bandrows;
+		bands[band].dstx = dstx;
+		bands[band].width = width;
+		bands[band].dstrows = dstrows + y * rowbytes;
+		bands[band].rowbytes = rowbytes;
+		bands[band].dstbit = dstbit;
+		bands[band].event = NULL;
+		if (band != 0)
+		{
+			bands[band].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			QueueUserWorkItem(bilevel_image_rotate_band_worker, &bands[band], WT_EXECUTEDEFAULT);
+		}
+	}
+	bandcount = band;
+	for (y = 0; y < bands[0].rows; y++)
+		bilevel_image_rotate_row(image, params, bands[0].dsty + y, dstx, width, bands[0].dstrows + y * rowbytes, dstbit);
+	
+	/* wait for the rest */
+	for (band = 1; band < bandcount; band++)
+	{
+		WaitForSingleObject(bands[band].event, INFINITE);
+		CloseHandle(bands[band].event);
+	}
+}
+
+static bilevel_image *
+bilevel_image_rotate_nearest(const bilevel_image *image, double angle)
+{
+	rotate_params params;
+	bilevel_image *result;
+	
+	/* allocate memory for the destination image */
+	result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
+		return NULL;
+	}
+	
+	/* iterate over the destination */
+	rotate_params_init(&params, image->width, image->length, angle);
+	bilevel_image_rotate_rows(image, &params, 0, result->length, 0, result->width, result->pixels, result->rowbytes, 0);
+	return result;
+}
+
+static bilevel_image *
+bilevel_image_rotate_shear(const bilevel_image *image, double angle)
+{
+	bilevel_image *result;
+	
+	/* allocate memory for the destination image */
+	result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate_shear: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
+		return NULL;
+	}
+	if (shear_rotate(result->pixels, image->pixels, image->width, image->length, image->rowbytes, angle) != 0)
+	{
+		bilevel_image_free(result);
+		return NULL;
+	}
+	return result;
+}
+
+static double
+bilevel_image_rotate_check(const bilevel_image *image, const bilevel_image *rotated, double angle)
+{
+	const uint8 *refrows[3], *rotrows[3];
+	uint32 bytes = rotated->rowbytes;
+	uint32 stray = 0, black = 0;
+	rotate_params params;
+	uint8 *rowbuf;
+	long y, row;
+	int r;
+	
+	/* allocate three rows of nearest-neighbor reference output and a scratch row */
+	rowbuf = _TIFFmalloc(4 * bytes);
+	if (rowbuf == NULL)
+		return 1.0;
+	
+	/* at every 16th row, count black pixels that either rotation has with no black within a pixel in the
+	   other; the two round differently, so edges shifting by a pixel don't count against the shear */
+	rotate_params_init(&params, image->width, image->length, angle);
+	for (y = 0; y < rotated->length; y += 16)
+	{
+		for (r = 0; r < 3; r++)
+		{
+			row = y + r - 1;
+			refrows[r] = rotrows[r] = NULL;
+			if (row < 0 || row >= rotated->length)
+				continue;
+			memset(rowbuf + r * bytes, 0, bytes);
+			bilevel_image_rotate_row(image, &params, row, 0, rotated->width, rowbuf + r * bytes, 0);
+			refrows[r] = rowbuf + r * bytes;
+			rotrows[r] = rotated->pixels + row * bytes;
+		}
+		stray += shear_stray_pixels(rotrows[1], refrows, bytes, rowbuf + 3 * bytes);
+		stray += shear_stray_pixels(refrows[1], rotrows, bytes, rowbuf + 3 * bytes);
+		black += bits->popcount(refrows[1], bytes);
+	}
+	_TIFFfree(rowbuf);
+	
+	/* return the stray pixels as a fraction of the black ones */
+	return (black == 0) ? (stray != 0) : ((double)stray / (double)black);
+}
+
+static bilevel_image *
+bilevel_image_rotate(const bilevel_image *image, double angle)
+{
+	bilevel_image *result;
+	
+	/* prefer the shear rotation as long as it gets no more than a sliver of the page visibly wrong */
+	if (shear_tolerance > 0)
+	{
+		result = bilevel_image_rotate_shear(image, angle);
+		if (result != NULL && bilevel_image_rotate_check(image, result, angle) <= shear_tolerance)
+			return result;
+		if (result != NULL)
+			bilevel_image_free(result);
+	}
+	return bilevel_image_rotate_nearest(image, angle);
+}
+
+typedef struct morph_band_data morph_band_data;
+struct morph_band_data
+{
+	const bilevel_image *src;
+	bilevel_image *dst;
+	uint32		firstrow;
+	uint32		lastrow;
+	int			erode;
+	int			vertical;
+	uint32		size;
+	int			error;
+	HANDLE		event;
+};
+
+static long
+morph_start(int erode, uint32 size)
+{
+	/* erosion looks at [x - size/2, ...]; dilation uses the reflected element so open and close behave */
+	return erode ? -(long)(size / 2) : -(long)(size - 1 - size / 2);
+}
+
+static void
+morph_band_horizontal(morph_band_data *band)
+{
+	const bilevel_image *src = band->src;
+	uint32 words = (src->rowbytes + 7) / 8;
+	uint32 extwords = words + (band->size + 63) / 64;
+	uint32 y, x, span;
+	uint64 *row, *temp;
+	
+	/* allocate a pair of word rows, with room for the element to hang off the right edge */
+	row = _TIFFmalloc(2 * extwords * sizeof(uint64));
+	if (row == NULL)
+	{
+		band->error = TRUE;
+		return;
+	}
+	temp = row + extwords;
+	
+	for (y = band->firstrow; y < band->lastrow; y++)
+	{
+		uint8 *dstrow = band->dst->pixels + y * band->dst->rowbytes;
+		
+		/* line the row up so bit x holds the pixel at the left end of x's window */
+		row_load_words(row, src->pixels + y * src->rowbytes, src->rowbytes);
+		bits->shift_words(temp, extwords, row, words, morph_start(band->erode, band->size));
+		
+		/* combine shifted copies, doubling the covered span each time until bit x covers the whole window */
+		for (span = 1; span < band->size; span *= 2)
+		{
+			uint32 step = (span * 2 <= band->size) ? span : (band->size - span);
+			bits->shift_words(row, extwords, temp, extwords, step);
+			for (x = 0; x < extwords; x++)
+				temp[x] = band->erode ? (temp[x] & row[x]) : (temp[x] | row[x]);
+			if (step != span)
+				break;
+		}
+		
+		/* store it, dropping anything in the row padding */
+		row_store_words(dstrow, temp, src->rowbytes);
+		if (src->width % 8 != 0)
+			dstrow[src->rowbytes - 1] &= 0xff << (8 - src->width % 8);
+	}
+	_TIFFfree(row);
+}
+
+static void
+morph_band_vertical(morph_band_data *band)
+{
+	const bilevel_image *src = band->src;
+	long start = morph_start(band->erode, band->size);
+	uint32 y, i;
+	
+	for (y = band->firstrow; y < band->lastrow; y++)
+	{
+		uint8 *dstrow = band->dst->pixels + y * band->dst->rowbytes;
+		long first = (long)y + start;
+		long last = first + (long)band->size;
+		
+		/* eroding past the top or bottom leaves nothing; dilating just ignores the missing rows */
+		if (band->erode && (first < 0 || last > (long)src->length))
+			continue;
+		if (first < 0)
+			first = 0;
+		if (last > (long)src->length)
+			last = src->length;
+		
+		/* AND or OR together the rows under the element */
+		memcpy(dstrow, src->pixels + first * src->rowbytes, src->rowbytes);
+		for (i = first + 1; i < last; i++)
+		{
+			if (band->erode)
+				bits->row_and(dstrow, src->pixels + i * src->rowbytes, src->rowbytes);
+			else
+				bits->row_or(dstrow, src->pixels + i * src->rowbytes, src->rowbytes);
+		}
+	}
+}
+
+static DWORD WINAPI
+morph_band_worker(LPVOID param)
+{
+	morph_band_data *band = param;
+	if (band->vertical)
+		morph_band_vertical(band);
+	else
+		morph_band_horizontal(band);
+	SetEvent(band->event);
+	return 0;
+}
+
+static bilevel_image *
+bilevel_image_morph_pass(bilevel_image *image, int erode, int vertical, uint32 size)
+{
+	morph_band_data bands[MAX_ROTATE_BANDS];
+	bilevel_image *result;
+	int bandcount, band, error = FALSE;
+	uint32 y, bandrows;
+	
+	/* a 1-pixel element changes nothing */
+	if (size <= 1)
+		return image;
+	
+	/* allocate memory for the destination image */
+	result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_morph_pass: Out of memory allocating bilevel %dx%d\n", image->width, image->length);
+		bilevel_image_free(image);
+		return NULL;
+	}
+	
+	/* pick the number of bands; each thread gets at least MIN_BAND_ROWS rows */
+	bandcount = idle_band_threads() + 1;
+	if (bandcount > MAX_ROTATE_BANDS)
+		bandcount = MAX_ROTATE_BANDS;
+	if (bandcount > image->length / MIN_BAND_ROWS)
+		bandcount = image->length / MIN_BAND_ROWS;
+	if (bandcount < 1)
+		bandcount = 1;
+	
+	/* queue all bands but the first, which we do ourselves; each band writes only its own rows */
+	bandrows = (image->length + bandcount - 1) / bandcount;
+	for (band = 0, y = 0; band < bandcount && y < image->length; band++, y += bandrows)
+	{
+		bands[band].src = image;
+		bands[band].dst = result;
+		bands[band].firstrow = y;
+		bands[band].lastrow = (image->length - y < bandrows) ? image->length : (y + bandrows);
+		bands[band].erode = erode;
+		bands[band].vertical = vertical;
+		bands[band].size = size;
+		bands[band].error = FALSE;
+		bands[band].event = NULL;
+		if (band != 0)
+		{
+			bands[band].event = CreateEvent(NULL, TRUE, FALSE, NULL);
+			QueueUserWorkItem(morph_band_worker, &bands[band], WT_EXECUTEDEFAULT);
+		}
+	}
+	bandcount = band;
+	if (vertical)
+		morph_band_vertical(&bands[0]);
+	else
+		morph_band_horizontal(&bands[0]);
+	
+	/* wait for the rest */
+	for (band = 0; band < bandcount; band++)
+	{
+		if (band != 0)
+		{
+			WaitForSingleObject(bands[band].event, INFINITE);
+			CloseHandle(bands[band].event);
+		}
+		error |= bands[band].error;
+	}
+	
+	/* the source is consumed either way */
+	bilevel_image_free(image);
+	if (error)
+	{
+		fprintf(stderr, "bilevel_image_morph_pass: Out of memory allocating row buffers\n");
+		bilevel_image_free(result);
+		return NULL;
+	}
+	return result;
+}
+
+static bilevel_image *
+bilevel_image_morph(bilevel_image *image, int erode, uint32 width, uint32 length)
+{
+	bilevel_image *result;
+	
+	/* a rectangle is a horizontal line followed by a vertical one; the image is consumed even on failure */
+	result = bilevel_image_morph_pass(image, erode, FALSE, width);
+	if (result != NULL)
+		result = bilevel_image_morph_pass(result, erode, TRUE, length);
+	return result;
+}
+
+static bilevel_image *
+bilevel_image_morphology(bilevel_image *image, worker_progress *progress)
+{
+	bilevel_image *result;
+	int op;
+	
+	/* apply each operation in turn; opening is erode then dilate, closing the reverse */
+	for (op = 0; op < morph_count; op++)
+	{
+		morph_op *cur = &morph_ops[op];
+		progress_set(progress, STAGE_MORPHOLOGY, 0, op);
+		result = bilevel_image_morph(image, (cur->op == 'e' || cur->op == 'o'), cur->width, cur->length);
+		if (result != NULL && (cur->op == 'o' || cur->op == 'c'))
+			result = bilevel_image_morph(result, (cur->op == 'c'), cur->width, cur->length);
+		if (result == NULL)
+			return NULL;
+		image = result;
+	}
+	return image;
+}
+
+static DWORD WINAPI
+bilevel_image_auto_rotate_worker(LPVOID param)
+{
+	rotate_worker_data *data = param;
+	data->score = bilevel_image_rotate_score(data->image, data->angle);
+	SetEvent(data->event);
+	return 0;
+}
+
+static double
+bilevel_image_find_angle(const bilevel_image *image, worker_progress *progress)
+{
+	rotate_worker_data left;
+	rotate_worker_data right;
+	rotate_worker_data middle;
+	rotate_worker_data leftmid;
+	rotate_worker_data rightmid;
+	HANDLE eventlist[5];
+	int pass = 0;
+	
+	/* report the current best angle in thousandths of a degree, and the pass */
+	progress_set(progress, STAGE_SCANNING, 16, 0);
+	
+	/* set up the workers */
+	left.image = right.image = middle.image = leftmid.image = rightmid.image = image;
+	eventlist[0] = left.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[1] = right.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[2] = middle.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[3] = leftmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+	eventlist[4] = rightmid.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	/* scan from -10 .. 10 */	
+	left.angle = -10.0;
+	right.angle = 10.0;
+	
+	/* iterate until we've found the best match within 1/1000th of a degree */
+	while (fabs(right.angle - left.angle) > 0.001)
+	{
+		int count = 0;
+		
+		pass++;
+		if (pass > 1)
+			progress_set(progress, STAGE_SCANNING, 16, (long)floor(middle.angle * 1000.0 + 0.5));
+		progress_update(progress, pass);
+
+		/* on the first pass, we have to compute all 5 */
 		if (pass == 1)
 		{
 			left.angle = -10.0;
@@ -695,141 +1628,470 @@ bilevel_image_auto_rotate(const bilevel_image *image, char *status)
 			middle.angle = rightmid.angle, middle.score = rightmid.score;
 		}
 
-		/* warn about non-convergence */
-		else
-		{
-			sprintf(status, "Results not converging as expected: %lld - %lld - %lld - %lld - %lld", left.score, leftmid.score, middle.score, rightmid.score, right.score);
-			left.angle = leftmid.angle, left.score = leftmid.score;
-			right.angle = rightmid.angle, right.score = rightmid.score;
-		}
-	}
+		/* warn about non-convergence */
+		else
+		{
+			progress_set(progress, STAGE_NOT_CONVERGING, 16, 0);
+			progress_update(progress, pass);
+			left.angle = leftmid.angle, left.score = leftmid.score;
+			right.angle = rightmid.angle, right.score = rightmid.score;
+		}
+	}
+	
+	/* free the events */
+	CloseHandle(left.event);
+	CloseHandle(right.event);
+	CloseHandle(middle.event);
+	CloseHandle(leftmid.event);
+	CloseHandle(rightmid.event);
+
+	return middle.angle;
+}
+
+static bilevel_image *
+bilevel_image_auto_rotate(const bilevel_image *image, worker_progress *progress)
+{
+	return bilevel_image_rotate(image, bilevel_image_find_angle(image, progress));
+}
+
+static bilevel_image *
+bilevel_image_rotate_crop(const bilevel_image *image, double angle, int left, int top, uint32 width, uint32 length)
+{
+	rotate_params params;
+	bilevel_image *result;
+	long startx, endx, starty, endy;
+	
+	/* allocate memory for the destination image */
+	result = bilevel_image_alloc(width, length, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate_crop: Out of memory allocating bilevel %dx%d\n", width, length);
+		return NULL;
+	}
+	
+	/* only the part of the window inside the rotated image's bounds gets rendered */
+	startx = (left < 0) ? 0 : left;
+	endx = (long)left + width;
+	if (endx > (long)image->width)
+		endx = image->width;
+	
+	/* likewise for the rows */
+	starty = (top < 0) ? -top : 0;
+	endy = (long)image->length - top;
+	if (endy > (long)length)
+		endy = length;
+	
+	/* render the window straight from the source */
+	rotate_params_init(&params, image->width, image->length, angle);
+	if (startx < endx && starty < endy)
+		bilevel_image_rotate_rows(image, &params, top + starty, endy - starty, startx, endx - startx, result->pixels + starty * result->rowbytes, result->rowbytes, startx - left);
+	return result;
+}
+
+static bilevel_profile *
+bilevel_image_profile(const bilevel_image *image)
+{
+	bilevel_profile *profile;
+	uint64 spread[256];
+	uint64 *lanes;
+	uint32 x, y, k, rowsleft;
+	
+	/* allocate the profile with both histograms in one block, plus a word of 8 byte-wide column counters per source byte */
+	profile = _TIFFmalloc(sizeof(*profile) + (image->length + image->rowbytes * 8) * sizeof(uint32));
+	lanes = _TIFFmalloc(image->rowbytes * sizeof(uint64));
+	if (profile == NULL || lanes == NULL)
+	{
+		fprintf(stderr, "bilevel_image_profile: Out of memory allocating profile for %dx%d\n", image->width, image->length);
+		if (profile != NULL)
+			_TIFFfree(profile);
+		if (lanes != NULL)
+			_TIFFfree(lanes);
+		return NULL;
+	}
+	profile->width = image->width;
+	profile->length = image->length;
+	profile->rows = (uint32 *)(profile + 1);
+	profile->columns = profile->rows + image->length;
+	memset(profile->columns, 0, image->rowbytes * 8 * sizeof(uint32));
+	memset(lanes, 0, image->rowbytes * sizeof(uint64));
+	
+	/* spread[b] puts each bit of b in its own byte, leftmost pixel lowest */
+	for (x = 0; x < 256; x++)
+		for (spread[x] = 0, k = 0; k < 8; k++)
+			if (x & (0x80 >> k))
+				spread[x] |= (uint64)1 << (8 * k);
+	
+	/* one row-major pass: popcount each row for its total and add its bits to the column counters */
+	rowsleft = 255;
+	for (y = 0; y < image->length; y++)
+	{
+		const uint8 *src = image->pixels + y * image->rowbytes;
+		
+		profile->rows[y] = bits->popcount(src, image->rowbytes);
+		for (x = 0; x < image->rowbytes; x++)
+		{
+			/* skip white a word at a time */
+			if (x % 8 == 0 && x + 8 <= image->rowbytes)
+			{
+				uint64 word;
+				memcpy(&word, src + x, sizeof(word));
+				if (word == 0)
+				{
+					x += 7;
+					continue;
+				}
+			}
+			lanes[x] += spread[src[x]];
+		}
+		
+		/* the byte counters would overflow after 255 rows, so empty them into the column totals first */
+		if (--rowsleft == 0 || y == image->length - 1)
+		{
+			for (x = 0; x < image->rowbytes; x++)
+				if (lanes[x] != 0)
+				{
+					for (k = 0; k < 8; k++)
+						profile->columns[x * 8 + k] += (uint32)(lanes[x] >> (8 * k)) & 0xff;
+					lanes[x] = 0;
+				}
+			rowsleft = 255;
+		}
+	}
+	_TIFFfree(lanes);
+	return profile;
+}
+
+static void
+bilevel_profile_free(bilevel_profile *profile)
+{
+	_TIFFfree(profile);
+}
+
+static void
+bilevel_profile_margins(const bilevel_profile *profile, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+{
+	/* a row or column is content once more than 0.1% of it is black */
+	if (top != NULL)
+		for (*top = 0; *top < profile->length; *top += 1)
+			if (profile->rows[*top] * 1000 > profile->width)
+				break;
+	if (bottom != NULL)
+		for (*bottom = 0; *bottom < profile->length; *bottom += 1)
+			if (profile->rows[profile->length - 1 - *bottom] * 1000 > profile->width)
+				break;
+	if (left != NULL)
+		for (*left = 0; *left < profile->width; *left += 1)
+			if (profile->columns[*left] * 1000 > profile->length)
+				break;
+	if (right != NULL)
+		for (*right = 0; *right < profile->width; *right += 1)
+			if (profile->columns[profile->width - 1 - *right] * 1000 > profile->length)
+				break;
+}
+
+static void
+bilevel_image_compute_margins(const bilevel_image *image, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+{
+	bilevel_profile *profile;
 	
-	/* free the events */
-	CloseHandle(left.event);
-	CloseHandle(right.event);
-	CloseHandle(middle.event);
-	CloseHandle(leftmid.event);
-	CloseHandle(rightmid.event);
-
-	return bilevel_image_rotate(image, middle.angle);
+	/* all four margins come from the row and column profiles */
+	profile = bilevel_image_profile(image);
+	if (profile == NULL)
+	{
+		if (top != NULL) *top = 0;
+		if (left != NULL) *left = 0;
+		if (right != NULL) *right = 0;
+		if (bottom != NULL) *bottom = 0;
+		return;
+	}
+	bilevel_profile_margins(profile, top, left, right, bottom);
+	bilevel_profile_free(profile);
 }
 
 static bilevel_image *
-bilevel_image_crop(const bilevel_image *image, int left, int top, uint32 width, uint32 length)
+bilevel_image_reduce_4x(const bilevel_image *image)
 {
 	bilevel_image *result;
-	int shift = left & 7;
+	uint8 *accum;
 	uint32 x, y;
-
-	/* allocate memory for the destination image */
-	result = bilevel_image_alloc(width, length, image);
-	if (result == NULL)
+	
+	/* allocate memory for the destination image and a row accumulator */
+	result = bilevel_image_alloc((image->width + 3) / 4, (image->length + 3) / 4, image);
+	accum = _TIFFmalloc(image->rowbytes);
+	if (result == NULL || accum == NULL)
 	{
-		fprintf(stderr, "bilevel_image_crop: Out of memory allocating bilevel %dx%d\n", width, length);
+		fprintf(stderr, "bilevel_image_reduce_4x: Out of memory allocating bilevel %dx%d\n", (image->width + 3) / 4, (image->length + 3) / 4);
+		if (result != NULL)
+			bilevel_image_free(result);
+		if (accum != NULL)
+			_TIFFfree(accum);
 		return NULL;
 	}
+	result->xres /= 4;
+	result->yres /= 4;
 	
-	/* iterate over rows */
-	for (y = 0; y < length; y++)
+	/* iterate over destination rows */
+	for (y = 0; y < result->length; y++)
 	{
-		uint32 srcy = top + y;
+		uint8 *dstrow = result->pixels + y * result->rowbytes;
+		uint32 srcy;
 		
-		/* skip any rows that aren't within the source image bounds */
-		if (srcy < image->length)
+		/* OR together the 4 source rows that land here */
+		memset(accum, 0, image->rowbytes);
+		for (srcy = y * 4; srcy < y * 4 + 4 && srcy < image->length; srcy++)
 		{
 			const uint8 *srcrow = image->pixels + srcy * image->rowbytes;
-			uint8 *dstrow = result->pixels + y * result->rowbytes;
-			uint8 lastpix = 0;
-			uint32 srcx;
-			
-			/* grab the first partial pixels if we can */
-			srcx = left >> 3;
-			if (srcx < image->rowbytes)
-				lastpix = srcrow[srcx];
-
-			/* iterate over groups of 8 pixels */
-			for (x = 0; x < width; x += 8)
-			{
-				uint8 newpix = 0;
-
-				/* if we can fetch within the rowbytes, fetch a new batch of pixels */
-				if (++srcx < image->rowbytes)
-					newpix = srcrow[srcx];
-				
-				/* store the shifted values and shift */
-				*dstrow++ = (lastpix << shift) | (newpix >> (8 - shift));
-				lastpix = newpix;
-			}
+			for (x = 0; x < image->rowbytes; x++)
+				accum[x] |= srcrow[x];
 		}
+		
+		/* each source nibble becomes one destination pixel */
+		for (x = 0; x < result->width; x++)
+			if (accum[x / 2] & ((x & 1) ? 0x0f : 0xf0))
+				dstrow[x / 8] |= 0x80 >> (x % 8);
 	}
 	
+	_TIFFfree(accum);
 	return result;
 }
 
-static void
-bilevel_image_compute_margins(const bilevel_image *image, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+static uint64
+transpose_8x8(uint64 x)
 {
-	uint32 x, y;
+	uint64 t;
 	
-	/* trim the top */
-	if (top != NULL)
-		for (*top = 0; *top < image->length; *top += 1)
-		{
-			const uint8 *src = image->pixels + *top * image->rowbytes;
-			uint32 pop = 0;
+	/* swap bits across the diagonal in 1x1, 2x2, then 4x4 blocks (row 0 in the top byte, column 0 in the top bit) */
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaull;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccull;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ull;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
 
-			for (x = 0; x < image->width; x += 8)
-				pop += popcount[*src++];
-			if (pop * 1000 > image->width)
-				break;
-		}
+static void
+bilevel_image_transpose_block(const bilevel_image *image, uint32 srcy, uint32 bx, const uint8 **srcrows, bilevel_image *result, int flip)
+{
+	uint64 block = 0;
+	uint32 i, dsty;
+	
+	/* gather one byte column from 8 source rows (missing rows are blank) */
+	for (i = 0; i < 8; i++)
+		block = (block << 8) | ((srcrows[i] != NULL) ? srcrows[i][bx] : 0);
+	if (block == 0)
+		return;
+	block = transpose_8x8(block);
+	
+	/* scatter the transposed bytes to 8 destination rows */
+	for (i = 0; i < 8; i++)
+	{
+		dsty = bx * 8 + i;
+		if (dsty >= image->width)
+			break;
+		if (flip)
+			dsty = image->width - 1 - dsty;
+		result->pixels[dsty * result->rowbytes + srcy / 8] = (uint8)(block >> (56 - 8 * i));
+	}
+}
 
-	/* trim the bottom */
-	if (bottom != NULL)
-		for (*bottom = 0; *bottom < image->length; *bottom += 1)
-		{
-			const uint8 *src = image->pixels + (image->length - 1 - *bottom) * image->rowbytes;
-			uint32 pop = 0;
+#ifdef __SSE2__
+static void
+bilevel_image_transpose_block16(const bilevel_image *image, uint32 srcy, uint32 bx, const uint8 **srcrows, bilevel_image *result, int flip)
+{
+	__m128i column;
+	uint32 i, dsty;
+	int mask;
+	
+	/* gather one byte column from 16 source rows, first row in the top byte so movemask puts it in bit 15 */
+	column = _mm_set_epi8(srcrows[0][bx], srcrows[1][bx], srcrows[2][bx], srcrows[3][bx], srcrows[4][bx], srcrows[5][bx], srcrows[6][bx], srcrows[7][bx],
+			srcrows[8][bx], srcrows[9][bx], srcrows[10][bx], srcrows[11][bx], srcrows[12][bx], srcrows[13][bx], srcrows[14][bx], srcrows[15][bx]);
+	
+	/* each movemask pulls out one source column as 16 destination pixels */
+	for (i = 0; i < 8; i++)
+	{
+		dsty = bx * 8 + i;
+		if (dsty >= image->width)
+			break;
+		if (flip)
+			dsty = image->width - 1 - dsty;
+		mask = _mm_movemask_epi8(column);
+		result->pixels[dsty * result->rowbytes + srcy / 8] = (uint8)(mask >> 8);
+		result->pixels[dsty * result->rowbytes + srcy / 8 + 1] = (uint8)mask;
+		column = _mm_slli_epi64(column, 1);
+	}
+}
+#endif
 
-			for (x = 0; x < image->width; x += 8)
-				pop += popcount[*src++];
-			if (pop * 1000 > image->width)
-				break;
-		}
+static bilevel_image *
+bilevel_image_rotate_quarter(const bilevel_image *image, int turns)
+{
+	const uint8 *srcrows[16];
+	bilevel_image *result;
+	uint32 x, y, i, srcy, pad;
 	
-	/* trim the left */
-	if (left != NULL)
-		for (*left = 0; *left < image->width; *left += 1)
+	/* allocate memory for the destination image; quarter turns swap the dimensions and resolutions */
+	turns &= 3;
+	if (turns & 1)
+		result = bilevel_image_alloc(image->length, image->width, image);
+	else
+		result = bilevel_image_alloc(0, 0, image);
+	if (result == NULL)
+	{
+		fprintf(stderr, "bilevel_image_rotate_quarter: Out of memory allocating bilevel %dx%d\n", image->length, image->width);
+		return NULL;
+	}
+	if (turns & 1)
+	{
+		result->xres = image->yres;
+		result->yres = image->xres;
+	}
+	
+	/* 0: just copy */
+	if (turns == 0)
+		memcpy(result->pixels, image->pixels, image->length * image->rowbytes);
+	
+	/* 180: reverse the row order and the bits within each row, then shift out the padding */
+	else if (turns == 2)
+	{
+		pad = image->rowbytes * 8 - image->width;
+		for (y = 0; y < image->length; y++)
 		{
-			const uint8 *src = image->pixels + *left / 8;
-			int shift = 7 - (*left % 8);
-			uint32 pop = 0;
-			
-			for (y = 0; y < image->length; y++)
+			const uint8 *srcrow = image->pixels + (image->length - 1 - y) * image->rowbytes;
+			uint8 *dstrow = result->pixels + y * result->rowbytes;
+			bits->reverse_row(dstrow, srcrow, image->rowbytes);
+			if (pad != 0)
 			{
-				pop += (*src >> shift) & 1;
-				src += image->rowbytes;
+				for (x = 0; x + 1 < image->rowbytes; x++)
+					dstrow[x] = (dstrow[x] << pad) | (dstrow[x + 1] >> (8 - pad));
+				dstrow[x] <<= pad;
 			}
-			if (pop * 1000 > image->length)
-				break;
 		}
-
-	/* trim the right */
-	if (right != NULL)
-		for (*right = 0; *right < image->width; *right += 1)
+	}
+	
+	/* 90 clockwise transposes the image read bottom up; 270 transposes it top down and reverses the row order */
+	else
+	{
+		for (y = 0; y < image->length; y += 8)
 		{
-			const uint8 *src = image->pixels + (image->width - 1 - *right) / 8;
-			int shift = 7 - ((image->width - 1 - *right) % 8);
-			uint32 pop = 0;
-			
-			for (y = 0; y < image->length; y++)
+#ifdef __SSE2__
+			/* take 16 rows at a time while they're all there */
+			if ((y % 16) == 0 && y + 16 <= image->length)
+			{
+				for (i = 0; i < 16; i++)
+				{
+					srcy = (turns == 1) ? (image->length - 1 - (y + i)) : (y + i);
+					srcrows[i] = image->pixels + srcy * image->rowbytes;
+				}
+				for (x = 0; x < image->rowbytes; x++)
+					bilevel_image_transpose_block16(image, y, x, srcrows, result, turns == 3);
+				y += 8;
+				continue;
+			}
+#endif
+			for (i = 0; i < 8; i++)
 			{
-				pop += (*src >> shift) & 1;
-				src += image->rowbytes;
+				srcy = (turns == 1) ? (image->length - 1 - (y + i)) : (y + i);
+				srcrows[i] = (y + i < image->length) ? (image->pixels + srcy * image->rowbytes) : NULL;
 			}
-			if (pop * 1000 > image->length)
-				break;
+			for (x = 0; x < image->rowbytes; x++)
+				bilevel_image_transpose_block(image, y, x, srcrows, result, turns == 3);
 		}
+	}
+	return result;
+}
+
+static int
+bilevel_image_is_sideways(const bilevel_image *image)
+{
+	bilevel_image *preview;
+	long long hsum, vsum;
+	
+	/* compare horizontal and vertical run energy on a reduced preview; at 90 degrees the two simply swap places */
+	preview = bilevel_image_reduce_4x(image);
+	if (preview == NULL)
+		return FALSE;
+	bilevel_image_rotate_runs(preview, 0.0, &hsum, &vsum);
+	bilevel_image_free(preview);
+	
+	/* staff lines and rules make upright pages strongly horizontal */
+	return vsum > 2 * hsum;
+}
+
+static bilevel_image *
+bilevel_image_orient(bilevel_image *image, worker_progress *progress)
+{
+	bilevel_image *result;
+	
+	/* in auto mode, only turn pages that look sideways */
+	if (orient_auto)
+	{
+		progress_stage(progress, STAGE_ORIENT_CHECK);
+		if (!bilevel_image_is_sideways(image))
+			return image;
+	}
+	
+	/* turn it, freeing the original either way */
+	progress_stage(progress, STAGE_TURNING);
+	result = bilevel_image_rotate_quarter(image, orient_turns);
+	bilevel_image_free(image);
+	return result;
+}
+
+static uint32
+scale_margin(uint32 margin, uint32 previewsize, uint32 size, int far_edge)
+{
+	long result = (long)margin * 4;
+	
+	/* the last preview pixel may only partly cover the image, so pull the far edge back by the overhang */
+	if (far_edge)
+		result -= (long)previewsize * 4 - size;
+	return (result < 0) ? 0 : (result > size) ? size : result;
+}
+
+static int
+bilevel_image_is_blank(const bilevel_image *image)
+{
+	bilevel_profile *profile;
+	uint32 top;
+	
+	/* blank if no row has enough black to count as content */
+	profile = bilevel_image_profile(image);
+	if (profile == NULL)
+		return FALSE;
+	bilevel_profile_margins(profile, &top, NULL, NULL, NULL);
+	bilevel_profile_free(profile);
+	return (top == image->length);
+}
+
+static void
+bilevel_image_compute_rotated_margins(const bilevel_image *image, double angle, uint32 *top, uint32 *left, uint32 *right, uint32 *bottom)
+{
+	bilevel_image *preview, *rotated;
+	
+	/* without rotation, the margins can be computed directly */
+	if (angle == 0.0)
+	{
+		bilevel_image_compute_margins(image, top, left, right, bottom);
+		return;
+	}
+	
+	/* otherwise, compute them from a rotated 4x reduced preview */
+	*top = *left = *right = *bottom = 0;
+	preview = bilevel_image_reduce_4x(image);
+	if (preview == NULL)
+		return;
+	rotated = bilevel_image_rotate_nearest(preview, angle);
+	if (rotated != NULL)
+	{
+		bilevel_image_compute_margins(rotated, top, left, right, bottom);
+		*top = scale_margin(*top, rotated->length, image->length, FALSE);
+		*left = scale_margin(*left, rotated->width, image->width, FALSE);
+		*right = scale_margin(*right, rotated->width, image->width, TRUE);
+		*bottom = scale_margin(*bottom, rotated->length, image->length, TRUE);
+		bilevel_image_free(rotated);
+	}
+	bilevel_image_free(preview);
 }
 
 static int
@@ -857,8 +2119,21 @@ build_worker_list(char *files[], int count)
 			return -1;
 		}
 
-		/* count images, then close the file */
-		for (numimages = 1; TIFFReadDirectory(in) != 0; numimages++) ;
+		/* count images and note the largest resolution, then close the file */
+		numimages = 0;
+		do
+		{
+			float xres = 0, yres = 0;
+			TIFFGetField(in, TIFFTAG_XRESOLUTION, &xres);
+			TIFFGetField(in, TIFFTAG_YRESOLUTION, &yres);
+			if (xres >= input_xres)
+				input_xres = xres;
+			if (yres >= input_yres)
+				input_yres = yres;
+			if (xres != yres)
+				input_square = FALSE;
+			numimages++;
+		} while (TIFFReadDirectory(in) != 0);
 		TIFFClose(in);
 		
 		/* create workers for all images */
@@ -879,7 +2154,7 @@ build_worker_list(char *files[], int count)
 			(*workerlist_tailptr)->filename = name;
 			(*workerlist_tailptr)->name = fullname;
 			(*workerlist_tailptr)->index = index;
-			strcpy((*workerlist_tailptr)->status, "Loading...");
+			progress_stage(&(*workerlist_tailptr)->progress, STAGE_QUEUED);
 
 			/* add to the list */
 			workerlist_tailptr = &(*workerlist_tailptr)->next;
@@ -889,6 +2164,40 @@ build_worker_list(char *files[], int count)
 	return 0;
 }
 
+static void
+progress_format(const worker_progress *progress, char *text, size_t size)
+{
+	worker_progress copy;
+	
+	/* take a consistent snapshot, then format it here rather than in the workers */
+	progress_read(progress, &copy);
+	switch (copy.stage)
+	{
+		case STAGE_SCANNING:
+			snprintf(text, size, "Scanning for best angle.... %7.3f |%.*s%.*s|", copy.arg / 1000.0, (int)copy.value, "================", 16 - (int)copy.value, "                ");
+			break;
+
+		case STAGE_NOT_CONVERGING:
+			snprintf(text, size, "Results not converging as expected on pass %u", copy.value);
+			break;
+
+		case STAGE_MORPHOLOGY:
+			snprintf(text, size, "Morphology %c%dx%d...", morph_ops[copy.arg].op, morph_ops[copy.arg].width, morph_ops[copy.arg].length);
+			break;
+
+		case STAGE_MESSAGE:
+			snprintf(text, size, "%s", copy.message);
+			break;
+
+		default:
+			if (copy.total != 0)
+				snprintf(text, size, "%s %3u%%", stage_text[copy.stage], (unsigned)(100.0 * copy.value / copy.total));
+			else
+				snprintf(text, size, "%s", stage_text[copy.stage]);
+			break;
+	}
+}
+
 static int
 queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back)
 {
@@ -896,12 +2205,24 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 	image_worker_data *worker;
 	int alldone;
 
-	/* queue all the items with the given callback */	
+	/* queue all the items with the given callback; when streaming, only the first window's worth
+	   go now and the writer lets the rest in as pages go out */
 	for (worker = workerlist; worker != NULL; worker = worker->next)
 	{
 		worker->done = worker->error = FALSE;
+		worker->queued = FALSE;
+		worker->threadid = 0;
+	}
+	EnterCriticalSection(&streamsect);
+	stream_callback = callback;
+	stream_queued = 0;
+	for (worker = workerlist; worker != NULL && (stream_file == NULL || stream_queued < stream_window); worker = worker->next)
+	{
+		worker->queued = TRUE;
 		QueueUserWorkItem(callback, worker, WT_EXECUTEDEFAULT);
+		stream_queued++;
 	}
+	LeaveCriticalSection(&streamsect);
 
 	/* update the status periodically */
 	GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &bufferinfo);
@@ -924,6 +2245,7 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 		for (worker = workerlist; worker != NULL; worker = worker->next)
 		{
 			char namebuf[30];
+			char status[100];
 			if (!worker->done)
 				alldone = FALSE;
 			if (worker->error)
@@ -937,7 +2259,8 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 			}
 			else
 				strcpy(namebuf, worker->name);
-			printf("%20.20s: %-59.59s\n", namebuf, worker->status);
+			progress_format(&worker->progress, status, sizeof(status));
+			printf("%20.20s: %-59.59s\n", namebuf, status);
 		}
 		
 		/* on error, just bail */
@@ -951,6 +2274,57 @@ queue_and_wait_for_workers(LPTHREAD_START_ROUTINE callback, int move_cursor_back
 	return 0;
 }
 
+static int
+stream_page(image_worker_data *data)
+{
+	image_worker_data *page;
+	int first, last, index;
+	int result = 0;
+	
+	/* mark this page ready; if another thread is already writing, it will pick this one up */
+	progress_stage(&data->progress, STAGE_WAITING);
+	EnterCriticalSection(&streamsect);
+	data->ready = TRUE;
+	if (stream_writing)
+	{
+		LeaveCriticalSection(&streamsect);
+		return 0;
+	}
+	stream_writing = TRUE;
+	while (stream_next < workercount && stream_pages[stream_next]->ready)
+	{
+		/* take every page that is now next in line, then write them without holding the lock */
+		first = stream_next;
+		while (stream_next < workercount && stream_pages[stream_next]->ready)
+			stream_next++;
+		last = stream_next;
+		LeaveCriticalSection(&streamsect);
+		for (index = first; index < last; index++)
+		{
+			page = stream_pages[index];
+			page->encoded->page.xres = stream_xres;
+			page->encoded->page.yres = stream_yres;
+			if (pageout_append(stream_file, page->encoded) != 0)
+				result = -1;
+			pageout_encoded_free(page->encoded);
+			page->encoded = NULL;
+			progress_stage(&page->progress, STAGE_DONE);
+		}
+		EnterCriticalSection(&streamsect);
+		
+		/* that frees a slot in the window for each page written */
+		for (index = first; index < last && stream_queued < workercount; index++)
+		{
+			stream_pages[stream_queued]->queued = TRUE;
+			QueueUserWorkItem(stream_callback, stream_pages[stream_queued], WT_EXECUTEDEFAULT);
+			stream_queued++;
+		}
+	}
+	stream_writing = FALSE;
+	LeaveCriticalSection(&streamsect);
+	return result;
+}
+
 static DWORD WINAPI
 rotate_and_compute_margins(PVOID param)
 {
@@ -959,6 +2333,7 @@ rotate_and_compute_margins(PVOID param)
 	
 	/* set the thread id */
 	data->threadid = GetCurrentThreadId();
+	progress_stage(&data->progress, STAGE_LOADING);
 
 	/* load the image */
 	data->image = bilevel_image_load(data->filename, data->index);
@@ -970,25 +2345,70 @@ rotate_and_compute_margins(PVOID param)
 
 	/* clean the image */
 	if (cleanit)
-		bilevel_image_clean(data->image, data->status);
+		bilevel_image_clean(data->image, &data->progress);
+	
+	/* fix the orientation */
+	if (orient_turns != 0)
+	{
+		data->image = bilevel_image_orient(data->image, &data->progress);
+		if (data->image == NULL)
+		{
+			data->error = TRUE;
+			goto done;
+		}
+	}
+	
+	/* apply any morphology */
+	if (morph_count != 0)
+	{
+		data->image = bilevel_image_morphology(data->image, &data->progress);
+		if (data->image == NULL)
+		{
+			data->error = TRUE;
+			goto done;
+		}
+	}
+	
+	/* if cropping, just find the angle and margins; the rotation happens during the crop */
+	data->angle = 0.0;
+	if (cropwidth != 0 && croplength != 0)
+	{
+		if (!norotate && !bilevel_image_is_blank(data->image))
+			data->angle = bilevel_image_find_angle(data->image, &data->progress);
+		progress_stage(&data->progress, STAGE_MARGINS);
+		bilevel_image_compute_rotated_margins(data->image, data->angle, &data->top, &data->left, &data->right, &data->bottom);
+	}
 	
-	/* rotate the image */
-	if (!norotate)
+	/* otherwise, rotate the image unless there is nothing on it */
+	else if (!norotate && !bilevel_image_is_blank(data->image))
 	{
-		tempimage = bilevel_image_auto_rotate(data->image, data->status);
+		tempimage = bilevel_image_auto_rotate(data->image, &data->progress);
 		bilevel_image_free(data->image);
 		data->image = tempimage;
 	}
+	bilevel_view_init(&data->view, data->image, 0, 0, data->image->width, data->image->length);
 	
-	/* compute the margins if cropping */
-	if (cropwidth != 0 && croplength != 0)
+	/* without a crop to come, the page is final */
+	if (cropwidth == 0 || croplength == 0)
 	{
-		strcpy(data->status, "Computing Margins...");
-		bilevel_image_compute_margins(data->image, &data->top, &data->left, &data->right, &data->bottom);
+		if (bilevel_view_encode(data) != 0)
+		{
+			data->error = TRUE;
+			goto done;
+		}
+		if (stream_file != NULL)
+		{
+			if (stream_page(data) != 0)
+				data->error = TRUE;
+		}
+		else
+			progress_stage(&data->progress, STAGE_DONE);
 	}
-	strcpy(data->status, "Waiting...");
+	else
+		progress_stage(&data->progress, STAGE_WAITING);
 
 done:
+	bilevel_image_release_spare();
 	data->threadid = -1;
 	data->done = TRUE;
 	return 0;
@@ -1050,16 +2470,35 @@ crop_image(PVOID param)
 		trimwidth = median_width;
 
 	/* crop it */
-	strcpy(data->status, "Cropping...");
+	progress_stage(&data->progress, STAGE_CROPPING);
 	top = data->top - (int)(croplength - trimlength) / 2;
 	left = data->left - (int)(cropwidth - trimwidth) / 2;
 	
-	tempimage = bilevel_image_crop(data->image, left, top, cropwidth, croplength);
-	bilevel_image_free(data->image);
-	data->image = tempimage;
-	strcpy(data->status, "Done");
+	if (data->angle != 0.0)
+	{
+		tempimage = bilevel_image_rotate_crop(data->image, data->angle, left, top, cropwidth, croplength);
+		if (tempimage == NULL)
+		{
+			data->error = TRUE;
+			goto done;
+		}
+		bilevel_image_free(data->image);
+		data->image = tempimage;
+		bilevel_view_init(&data->view, data->image, 0, 0, cropwidth, croplength);
+	}
+	
+	/* an unrotated crop is just a window onto the loaded image */
+	else
+		bilevel_view_init(&data->view, data->image, left, top, cropwidth, croplength);
+	if (bilevel_view_encode(data) != 0)
+	{
+		data->error = TRUE;
+		goto done;
+	}
+	progress_stage(&data->progress, STAGE_DONE);
 
 done:
+	bilevel_image_release_spare();
 	data->threadid = -1;
 	data->done = TRUE;
 	return 0;
@@ -1072,21 +2511,71 @@ normalize_resolutions(void)
 	float xres = 0;
 	float yres = 0;
 
-	/* find the maximum resolution */
+	/* find the maximum resolution; the pages are encoded by now, but the tags are still open */
 	for (worker = workerlist; worker != NULL; worker = worker->next)
 	{
-		if (worker->image->xres >= xres)
-			xres = worker->image->xres;
-		if (worker->image->yres >= yres)
-			yres = worker->image->yres;
+		if (worker->encoded->page.xres >= xres)
+			xres = worker->encoded->page.xres;
+		if (worker->encoded->page.yres >= yres)
+			yres = worker->encoded->page.yres;
 	}
 	
 	/* then set that value for everyone */
 	for (worker = workerlist; worker != NULL; worker = worker->next)
 	{
-		worker->image->xres = xres;
-		worker->image->yres = yres;
+		worker->encoded->page.xres = xres;
+		worker->encoded->page.yres = yres;
+	}
+}
+
+static int
+parse_morph_ops(char *ops)
+{
+	char *op;
+	
+	/* comma-separated list of e/d/o/c followed by WxH */
+	morph_count = 0;
+	for (op = strtok(ops, ","); op != NULL; op = strtok(NULL, ","))
+	{
+		char *end;
+		if (morph_count == MAX_MORPH_OPS || op[0] == 0 || strchr("edoc", op[0]) == NULL)
+			return -1;
+		morph_ops[morph_count].op = op[0];
+		morph_ops[morph_count].width = strtoul(op + 1, &end, 10);
+		if (*end != 'x')
+			return -1;
+		morph_ops[morph_count].length = strtoul(end + 1, &end, 10);
+		if (*end != 0 || morph_ops[morph_count].width == 0 || morph_ops[morph_count].length == 0)
+			return -1;
+		morph_count++;
 	}
+	return 0;
+}
+
+static void
+report_page_faults(void)
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	
+	/* page faults mostly come from touching freshly allocated page memory */
+	counters.cb = sizeof(counters);
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		printf("%lu page faults, %lu KB peak working set\n", (unsigned long)counters.PageFaultCount, (unsigned long)(counters.PeakWorkingSetSize / 1024));
+}
+
+static int
+output_is_input(const char *outname)
+{
+	char outpath[MAX_PATH], inpath[MAX_PATH];
+	image_worker_data *worker;
+
+	/* compare full paths without regard to case, as Windows does; if a name won't resolve, assume the worst */
+	if (GetFullPathNameA(outname, MAX_PATH, outpath, NULL) == 0)
+		return TRUE;
+	for (worker = workerlist; worker != NULL; worker = worker->next)
+		if (GetFullPathNameA(worker->filename, MAX_PATH, inpath, NULL) == 0 || lstrcmpiA(outpath, inpath) == 0)
+			return TRUE;
+	return FALSE;
 }
 
 int
@@ -1095,13 +2584,19 @@ main(int argc, char* argv[])
 	extern int optind;
 	extern char *optarg;
 	
-	int c, argnum;
+	SYSTEM_INFO sysinfo;
+	image_worker_data *worker;
+	const char *outname;
+	int c, argnum, index;
 	char *xptr;
 
 	InitializeCriticalSection(&critsect);
+	InitializeCriticalSection(&streamsect);
+	bit_kernels_init();
+	spareslot = TlsAlloc();
 
 	/* parse arguments */
-	while ((c = getopt(argc, argv, "lrc:")) != -1)
+	while ((c = getopt(argc, argv, "lm:o:rc:S:t:W:")) != -1)
 	{
 		switch (c)
 		{
@@ -1118,10 +2613,43 @@ main(int argc, char* argv[])
 				cleanit = 1;
 				break;
 
+			case 'm':
+				if (parse_morph_ops(optarg) != 0)
+					usage();
+				break;
+
+			case 'o':
+				if (strncmp(optarg, "auto", 4) == 0)
+				{
+					orient_auto = 1;
+					optarg += 4;
+				}
+				orient_turns = (*optarg != 0) ? atoi(optarg) : 90;
+				if (orient_turns != 90 && orient_turns != 270 && (orient_turns != 180 || orient_auto))
+					usage();
+				orient_turns /= 90;
+				break;
+
+			case 't':
+				shear_tolerance = atof(optarg) / 100.0;
+				break;
+
 			case 'r':
 				norotate = 1;
 				break;
 
+			case 'S':
+				if (atoi(optarg) < 1)
+					usage();
+				pageout_strip_rows = atoi(optarg);
+				break;
+
+			case 'W':
+				stream_window = atoi(optarg);
+				if (stream_window < 1)
+					usage();
+				break;
+
 			case '?':
 				usage();
 				break;
@@ -1141,10 +2669,62 @@ main(int argc, char* argv[])
 	/* build our list of images as work items */
 	if (build_worker_list(&argv[optind], argc - 1 - optind) != 0)
 		return -1;
+	outname = argv[argc - 1];
+
+	/* stream unless something needs every page first: the median size for cropping,
+	   resolutions that depend on which pages auto-orientation turns, or an output that
+	   would overwrite an input before it is read */
+	if ((cropwidth == 0 || croplength == 0) && (!orient_auto || input_square) && !output_is_input(outname))
+	{
+		stream_xres = (orient_turns & 1) ? input_yres : input_xres;
+		stream_yres = (orient_turns & 1) ? input_xres : input_yres;
+		if (stream_window == 0)
+		{
+			GetSystemInfo(&sysinfo);
+			stream_window = 2 * (int)sysinfo.dwNumberOfProcessors;
+		}
+		stream_pages = _TIFFmalloc(workercount * sizeof(*stream_pages));
+		if (stream_pages == NULL)
+			return -1;
+		index = 0;
+		for (worker = workerlist; worker != NULL; worker = worker->next)
+			stream_pages[index++] = worker;
+		stream_file = pageout_open(outname);
+		if (stream_file == NULL)
+			return -1;
+	}
 
 	/* rotate each image and compute the inner margins if cropping */
 	if (queue_and_wait_for_workers(rotate_and_compute_margins, FALSE) != 0)
+	{
+		/* wait out any write in progress and keep the workers from starting another, then drop the partial file */
+		if (stream_file != NULL)
+		{
+			EnterCriticalSection(&streamsect);
+			while (stream_writing)
+			{
+				LeaveCriticalSection(&streamsect);
+				Sleep(10);
+				EnterCriticalSection(&streamsect);
+			}
+			stream_next = workercount;
+			pageout_close(stream_file);
+			remove(outname);
+		}
 		return -1;
+	}
+	
+	/* every page has gone out already */
+	if (stream_file != NULL)
+	{
+		if (pageout_close(stream_file) != 0)
+		{
+			remove(outname);
+			return -1;
+		}
+		report_page_faults();
+		return (0);
+	}
 	
 	/* perform the final crop */
 	if (cropwidth != 0 && croplength != 0)
@@ -1159,19 +2739,27 @@ main(int argc, char* argv[])
 
 	/* save the result */
 	printf("Writing final image\n");
-	if (bilevel_image_save_images(argv[argc - 1], workerlist))
+	if (bilevel_image_save_images(outname, workerlist))
 		return -1;
 
+	report_page_faults();
 	return (0);
 }
 
 
 char* stuff[] = {
-"usage: tiffrotate [options] input.tif [input2.tif [...]] output.tif",
+"usage: tiffrotate [options] input.tif [input2.tif [...]] output.tif|output.pdf",
 "where options are:",
 " -c heightxwidth   auto-crop to the given size",
 " -l                clean the TIFF",
+" -m op[,op...]     morphology before deskewing: e/d/o/c (erode/dilate/open/close)",
+"                   with a WxH rectangle, e.g. c9x1 to close gaps in staff lines",
+" -o turn           turn pages by 90, 180 or 270 degrees clockwise first",
+" -o auto[270]      turn only pages that look sideways (by 90 unless given)",
 " -r                do not attempt to rotate",
+" -S rows           write G4 strips of this many rows, encoded in parallel",
+" -t pct            max % of black pixels fast rotation may misplace (default 2, 0 = sample)",
+" -W pages          pages in flight at once when writing as they finish (default 2 per CPU)",
 NULL
 };
 